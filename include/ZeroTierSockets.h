@@ -376,6 +376,91 @@ typedef int ssize_t;
 typedef void (*CppCallback)(void* msg);
 #endif
 
+//----------------------------------------------------------------------------//
+// State storage                                                              //
+//----------------------------------------------------------------------------//
+
+/**
+ * Kinds of objects the node persists, see `zts_init_set_state_store()`
+ */
+typedef enum {
+    /** The node's public key (identity), id is zero */
+    ZTS_STATE_OBJECT_IDENTITY_PUBLIC = 1,
+    /** The node's secret key (identity), id is zero */
+    ZTS_STATE_OBJECT_IDENTITY_SECRET = 2,
+    /** Root set definition, id is zero */
+    ZTS_STATE_OBJECT_PLANET = 3,
+    /** Moon definition, id[0] is the moon ID */
+    ZTS_STATE_OBJECT_MOON = 4,
+    /** Reachability hints of a peer, id[0] is the peer's node ID */
+    ZTS_STATE_OBJECT_PEER = 5,
+    /** Network configuration, id[0] is the network ID */
+    ZTS_STATE_OBJECT_NETWORK_CONFIG = 6
+} zts_state_object_type_t;
+
+/**
+ * A state object handed to `zts_state_store_t::put_batch`
+ */
+typedef struct {
+    /** One of `zts_state_object_type_t` */
+    int type;
+    uint64_t id[2];
+    const void* data;
+    unsigned int len;
+} zts_state_object_t;
+
+/**
+ * Callbacks through which the node persists its state in storage provided by the application.
+ * Puts and deletes are collected and delivered from the node's service thread once per
+ * iteration of its loop, with repeated updates of an object coalesced. Objects that have been
+ * put but not yet delivered are served from memory. Callbacks must not call `zts_*` functions.
+ */
+typedef struct {
+    /** Passed as the first argument of every callback */
+    void* arg;
+    /** Copy an object into `data`. Return its length, or -1 if there is no such object */
+    int (*get)(void* arg, int type, const uint64_t id[2], void* data, unsigned int maxlen);
+    /** Store (replace) an object */
+    void (*put)(void* arg, int type, const uint64_t id[2], const void* data, unsigned int len);
+    /** Delete an object */
+    void (*del)(void* arg, int type, const uint64_t id[2]);
+    /** Store several objects, optional. If `NULL` `put` is called for each object */
+    void (*put_batch)(void* arg, const zts_state_object_t* objects, unsigned int count);
+} zts_state_store_t;
+
+//----------------------------------------------------------------------------//
+// Network stack limits                                                       //
+//----------------------------------------------------------------------------//
+
+/**
+ * Capacity of the network stack, see `zts_init_set_stack_limits()`. A field set to `0` selects
+ * the compile-time default, which is also the upper bound for every field but `mem_limit`.
+ */
+typedef struct {
+    /** Bytes the stack may allocate for packets, connections and receive buffers (default:
+     * unlimited). Allocations beyond it fail as they would when out of memory */
+    uint64_t mem_limit;
+    /** Number of sockets that can be open at once (default: 1024) */
+    unsigned int max_sockets;
+    /** Number of pooled buffers for frames received from the virtual network (default: 1024) */
+    unsigned int rx_buffers;
+    /** TCP send buffer of each new connection in bytes, at least two segments (default:
+     * 176 KB) */
+    unsigned int tcp_snd_buf;
+    /** TCP receive window of each new connection in bytes, at least two segments (default:
+     * 1 MB) */
+    unsigned int tcp_rcv_wnd;
+    /** Size the send buffer and receive window of each TCP connection from its measured
+     * delivery rate and round-trip time instead. Connections start at 16 segments, grow up to
+     * `tcp_snd_buf` and `tcp_rcv_wnd` while they are limited by them and shrink back after
+     * 10 seconds without traffic. Setting `ZTS_SO_RCVBUF` on a socket stops the tuning of its
+     * receive window (default: 0) */
+    unsigned int tcp_autotune;
+    /** Upper bound on the sum of the send buffers and receive windows of all autotuned
+     * connections in bytes. Connections stop growing when it is reached (default: unlimited) */
+    uint64_t tcp_autotune_mem;
+} zts_stack_limits_t;
+
 //----------------------------------------------------------------------------//
 // Common definitions and structures for interoperability between zts_* and   //
 // lwIP functions. Some of the code in the following section is a borrowed    //
@@ -1374,6 +1459,78 @@ ZTS_API int ZTCALL zts_init_set_random_port_range(unsigned short start_port, uns
  */
 ZTS_API int ZTCALL zts_init_allow_secondary_port(unsigned int allowed);
 
+/**
+ * @brief Set the number of threads that decrypt, authenticate and process packets received
+ * from the physical network. By default (`0`) this happens on the node's service thread, which
+ * limits throughput to what a single core can process. Packets are distributed by source
+ * address so that those of any given peer are still processed in order. This is an
+ * initialization function that can only be called before `zts_node_start()`.
+ *
+ * @param count Number of receive threads, at most 64 (default: 0)
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_init_set_rx_threads(unsigned int count);
+
+/**
+ * @brief Pin each receive thread (see `zts_init_set_rx_threads()`) to one of the CPUs the
+ * process is allowed to run on. Threads are spread over those CPUs, continuing across nodes
+ * started in the same process, so that they do not migrate between CPUs or compete with one
+ * another. Each thread still hands frames to the one shared network stack. A thread that
+ * cannot be pinned is reported on stderr and runs unpinned. Only has an effect on Linux. This
+ * is an initialization function that can only be called before `zts_node_start()`.
+ *
+ * @param enabled Whether or not this feature is enabled (default: 0)
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_init_set_rx_thread_affinity(int enabled);
+
+/**
+ * @brief Keep the identity, roots, network configurations and peer hints in a single file
+ * (`state.db` in the storage path) instead of one file per object under `peers.d` and
+ * `networks.d`. Updates are appended to the file and reads come from a memory mapping of it, so
+ * nodes that know many peers avoid a file per peer and the directory scans at startup and
+ * during cleanup. Space taken by outdated objects is reclaimed periodically by rewriting the
+ * file. Objects that are not in the database yet are read from the separate files, so an
+ * existing storage path can be switched over. Has no effect unless a storage path is set with
+ * `zts_init_from_storage()`. This is an initialization function that can only be called before
+ * `zts_node_start()`.
+ *
+ * @param enabled Whether or not this feature is enabled (default: 0)
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_init_set_state_db(int enabled);
+
+/**
+ * @brief Persist the identity, roots, network configurations and peer hints through
+ * application-provided callbacks instead of the storage path. This lets the node keep its state
+ * in the application's own in-memory or key-value store. The caching restrictions set with
+ * `zts_init_allow_*_cache()` still apply. Networks are not rejoined automatically at startup
+ * since the callbacks cannot be enumerated, call `zts_net_join()` as usual. This is an
+ * initialization function that can only be called before `zts_node_start()`.
+ *
+ * @param store Callbacks, copied. `get`, `put` and `del` are required. `NULL` to stop using
+ *     callbacks
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_init_set_state_store(const zts_state_store_t* store);
+
+/**
+ * @brief Size the network stack for the application instead of using the compile-time
+ * defaults: a small memory budget and few sockets for an embedded agent, or many sockets with
+ * small buffers for a gateway. Sockets beyond `max_sockets` fail with `ZTS_EMFILE`. This is an
+ * initialization function that can only be called before the first `zts_node_start()` of the
+ * process, the stack cannot be resized once it has started.
+ *
+ * @param limits Limits, copied
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_init_set_stack_limits(const zts_stack_limits_t* limits);
+
 /**
  * @brief Allow or disallow the use of port-mapping. This is enabled by default. This is an
  * initialization function that can only be called before `zts_node_start()`.
@@ -1747,7 +1904,7 @@ ZTS_API int ZTCALL zts_node_stop();
  * anticipate communicating over ZeroTier again.
  *
  * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
- *     experiences a problem.
+ *     experiences a problem or `zts_ctx_t` nodes are still running.
  */
 ZTS_API int ZTCALL zts_node_free();
 
@@ -1770,6 +1927,137 @@ ZTS_API int ZTCALL zts_moon_orbit(uint64_t moon_roots_id, uint64_t moon_seed);
  */
 ZTS_API int ZTCALL zts_moon_deorbit(uint64_t moon_roots_id);
 
+//----------------------------------------------------------------------------//
+// Additional node instances                                                  //
+//----------------------------------------------------------------------------//
+
+/**
+ * A ZeroTier node in addition to the one controlled by the `zts_node_*` functions. Each has
+ * its own identity, ports and networks, so that one process can serve several identities.
+ * All nodes share the process's network stack, socket API and event handler: sockets are
+ * bound and routed by address as usual, and events can be told apart by node ID.
+ */
+typedef struct zts_ctx zts_ctx_t;
+
+/**
+ * @brief Create a node instance
+ *
+ * @return New instance, or `NULL` if `zts_node_free()` has been called
+ */
+ZTS_API zts_ctx_t* ZTCALL zts_ctx_new();
+
+/**
+ * @brief Load this node's identity from and save its state to the given path. Callable only
+ *     while the instance's node is stopped.
+ *
+ * @param ctx Instance
+ * @param path Storage path, must differ from that of any other node
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     is running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_init_from_storage(zts_ctx_t* ctx, const char* path);
+
+/**
+ * @brief Use the given identity (see `zts_init_from_memory()`). Callable only while the
+ *     instance's node is stopped.
+ *
+ * @param ctx Instance
+ * @param key Identity key pair
+ * @param len Length of `key`
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     is running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_init_from_memory(zts_ctx_t* ctx, const char* key, unsigned int len);
+
+/**
+ * @brief Set this node's primary port, which must differ from that of any other node. Callable
+ *     only while the instance's node is stopped.
+ *
+ * @param ctx Instance
+ * @param port Port number
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     is running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_init_set_port(zts_ctx_t* ctx, unsigned short port);
+
+/**
+ * @brief Start the instance's node. Starts the network stack and the event callback thread if
+ *     they are not running yet.
+ *
+ * @param ctx Instance
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node is
+ *     already running or `zts_node_free()` has been called, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_node_start(zts_ctx_t* ctx);
+
+/**
+ * @brief Return whether the instance's node is online
+ *
+ * @param ctx Instance
+ * @return `1` if online, `0` if offline or not running
+ */
+ZTS_API int ZTCALL zts_ctx_node_is_online(zts_ctx_t* ctx);
+
+/**
+ * @brief Return the identity of the instance's node
+ *
+ * @param ctx Instance
+ * @return Node ID, `ZTS_ERR_SERVICE` if the node is not running
+ */
+ZTS_API uint64_t ZTCALL zts_ctx_node_get_id(zts_ctx_t* ctx);
+
+/**
+ * @brief Join a network with the instance's node
+ *
+ * @param ctx Instance
+ * @param net_id Network ID
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node is not
+ *     running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_net_join(zts_ctx_t* ctx, uint64_t net_id);
+
+/**
+ * @brief Leave a network with the instance's node
+ *
+ * @param ctx Instance
+ * @param net_id Network ID
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node is not
+ *     running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_net_leave(zts_ctx_t* ctx, uint64_t net_id);
+
+/**
+ * @brief Get the first address assigned to the instance's node on a network
+ *
+ * @param ctx Instance
+ * @param net_id Network ID
+ * @param family `ZTS_AF_INET`, or `ZTS_AF_INET6`
+ * @param addr Destination buffer to hold address
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node is not
+ *     running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL
+zts_ctx_addr_get(zts_ctx_t* ctx, uint64_t net_id, unsigned int family, struct zts_sockaddr_storage* addr);
+
+/**
+ * @brief Stop the instance's node and wait for it to shut down. It can be configured and
+ *     started again afterwards.
+ *
+ * @param ctx Instance
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node is not
+ *     running, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_node_stop(zts_ctx_t* ctx);
+
+/**
+ * @brief Stop the instance's node if it is running and free the instance. Instances must be
+ *     freed before `zts_node_free()` is called.
+ *
+ * @param ctx Instance
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_ctx_free(zts_ctx_t* ctx);
+
 //----------------------------------------------------------------------------//
 // Statistics                                                                 //
 //----------------------------------------------------------------------------//
@@ -1864,11 +2152,14 @@ typedef struct {
  * @brief Get all statistical counters for all protocols and levels.
  * See also: lwip/stats.h.
  *
- * This function can only be used in debug builds.
+ * Link-level counters and the TCP segment counters (`tcp_tx`, `tcp_rx`) are
+ * maintained in all builds and are cheap enough to poll in production. The
+ * other protocol-level counters are only populated when lwIP is built with
+ * `LWIP_STATS`, otherwise they are zero.
  *
  * @param dst Pointer to structure that will be populated with statistics
  *
- * @return ZTS_ERR_OK on success. ZTS_ERR_ARG or ZTS_ERR_NO_RESULT on failure.
+ * @return ZTS_ERR_OK on success. ZTS_ERR_ARG or ZTS_ERR_SERVICE on failure.
  */
 ZTS_API int ZTCALL zts_stats_get_all(zts_stats_counter_t* dst);
 
@@ -2223,6 +2514,86 @@ struct zts_pollfd {
  */
 ZTS_API int ZTCALL zts_bsd_poll(struct zts_pollfd* fds, zts_nfds_t nfds, int timeout);
 
+#define ZTS_EPOLLIN  0x001
+#define ZTS_EPOLLOUT 0x004
+#define ZTS_EPOLLERR 0x008
+#define ZTS_EPOLLHUP 0x010
+/** Edge-triggered: report readiness once per change instead of while ready */
+#define ZTS_EPOLLET 0x80000000u
+
+#define ZTS_EPOLL_CTL_ADD 1
+#define ZTS_EPOLL_CTL_DEL 2
+#define ZTS_EPOLL_CTL_MOD 3
+
+typedef union zts_epoll_data {
+    void* ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} zts_epoll_data_t;
+
+struct zts_epoll_event {
+    /** Requested (`zts_epoll_ctl`) or reported (`zts_epoll_wait`) events */
+    uint32_t events;
+    /** User data, returned as-is by `zts_epoll_wait` */
+    zts_epoll_data_t data;
+};
+
+/**
+ * @brief Create an epoll instance: a persistent set of sockets whose readiness
+ * is tracked by the network stack as events occur. Unlike `zts_bsd_select` and
+ * `zts_bsd_poll` the cost of a wait depends on the number of ready sockets, not
+ * on the number of monitored ones.
+ *
+ * Epoll handles are not socket file descriptors and must be released with
+ * `zts_epoll_close`.
+ *
+ * @return Epoll handle if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem.
+ */
+ZTS_API int ZTCALL zts_epoll_create();
+
+/**
+ * @brief Add, modify or remove a socket in an epoll instance's interest set.
+ * Sockets are removed automatically when closed with `zts_bsd_close`.
+ *
+ * @param epfd Epoll handle
+ * @param op `ZTS_EPOLL_CTL_ADD`, `ZTS_EPOLL_CTL_MOD` or `ZTS_EPOLL_CTL_DEL`
+ * @param fd Socket file descriptor
+ * @param event Events of interest (`ZTS_EPOLLIN`, `ZTS_EPOLLOUT`, optionally
+ *     `ZTS_EPOLLET`) and user data. Ignored for `ZTS_EPOLL_CTL_DEL`
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument, `ZTS_ERR_SOCKET`
+ *     if the socket is invalid, already present (add) or absent (mod, del).
+ *     Sets `zts_errno`
+ */
+ZTS_API int ZTCALL zts_epoll_ctl(int epfd, int op, int fd, struct zts_epoll_event* event);
+
+/**
+ * @brief Wait for events on the sockets of an epoll instance. `ZTS_EPOLLERR`
+ * and `ZTS_EPOLLHUP` are always reported. A TCP socket reports `ZTS_EPOLLHUP`
+ * once the peer has closed the connection or it was reset.
+ *
+ * @param epfd Epoll handle
+ * @param events Array receiving ready events
+ * @param maxevents Capacity of the events array
+ * @param timeout Milliseconds to wait, 0 to return immediately, -1 to wait
+ *     indefinitely
+ * @return Number of ready sockets (0 on timeout) if successful,
+ *     `ZTS_ERR_SERVICE` if the node experiences a problem, `ZTS_ERR_ARG` if
+ *     invalid argument.
+ */
+ZTS_API int ZTCALL zts_epoll_wait(int epfd, struct zts_epoll_event* events, int maxevents, int timeout);
+
+/**
+ * @brief Release an epoll instance. Threads waiting on it return 0.
+ *
+ * @param epfd Epoll handle
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument.
+ */
+ZTS_API int ZTCALL zts_epoll_close(int epfd);
+
 /**
  * @brief Control a device
  *
@@ -2330,6 +2701,49 @@ zts_bsd_recvfrom(int fd, void* buf, size_t len, int flags, struct zts_sockaddr*
  */
 ZTS_API ssize_t ZTCALL zts_bsd_recvmsg(int fd, struct zts_msghdr* msg, int flags);
 
+/* Message and the number of bytes transferred, for batched I/O */
+struct zts_mmsghdr {
+    struct zts_msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+/** Largest number of messages handled by one batched I/O call */
+#define ZTS_MMSG_VLEN_MAX 1024
+
+/**
+ * @brief Send several messages with one call. On datagram sockets the
+ * messages are copied up front and handed to the stack in batches, each
+ * under a single acquisition of its lock. Stops at the first message that
+ * cannot be sent. `msg_len` of each sent message is set to the number of bytes
+ * sent.
+ *
+ * @param fd Socket file descriptor
+ * @param msgvec Array of messages. `msg_name` may be `NULL` on connected sockets
+ * @param vlen Number of messages in `msgvec` (at most `ZTS_MMSG_VLEN_MAX` are sent)
+ * @param flags Specifies type of message transmission
+ * @return Number of messages sent if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument, `ZTS_ERR_SOCKET`
+ *     if no message could be sent. Sets `zts_errno`
+ */
+ZTS_API int ZTCALL zts_bsd_sendmmsg(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen, int flags);
+
+/**
+ * @brief Receive several messages with one call. Each message is dequeued
+ * as by `zts_bsd_recvmsg`, which does not take the stack's lock. Only the
+ * first receive honors the blocking mode of the socket, the call then returns
+ * as soon as no further message is queued. `msg_len` of each received message is set to the
+ * number of bytes received.
+ *
+ * @param fd Socket file descriptor
+ * @param msgvec Array of message buffers
+ * @param vlen Number of messages in `msgvec` (at most `ZTS_MMSG_VLEN_MAX` are received)
+ * @param flags Specifies the type of message receipt
+ * @return Number of messages received if successful, `ZTS_ERR_SERVICE` if the
+ *     node experiences a problem, `ZTS_ERR_ARG` if invalid argument,
+ *     `ZTS_ERR_SOCKET` if no message could be received. Sets `zts_errno`
+ */
+ZTS_API int ZTCALL zts_bsd_recvmmsg(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen, int flags);
+
 /**
  * @brief Read data from socket onto buffer
  *
@@ -2420,9 +2834,10 @@ ZTS_API int ZTCALL zts_socket(int family, int type, int protocol);
  * talk to each other. This can be a problem during connection procedures since
  * some of the initial packets are lost. To alleviate the need to try
  * `zts_bsd_connect` many times, this function will keep re-trying for you, even if
- * no known routes exist. However, if the socket is set to `non-blocking` mode
- * it will behave identically to `zts_bsd_connect` and return immediately upon
- * failure.
+ * no known routes exist. Once the handshake has started it waits for the
+ * network stack to signal its outcome, so it returns as soon as the connection
+ * is established. However, if the socket is set to `non-blocking` mode it will
+ * behave identically to `zts_bsd_connect` and return immediately.
  *
  * @param fd Socket file descriptor
  * @param ipstr Human-readable IP string
@@ -2432,7 +2847,8 @@ ZTS_API int ZTCALL zts_socket(int family, int type, int protocol);
  *     set to `0`.
  *
  * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SOCKET` if the function times
- *     out with no connection made, `ZTS_ERR_SERVICE` if the node experiences a
+ *     out with no connection made (`zts_errno` is `ZTS_ETIMEDOUT`) or the
+ *     connection is refused (`zts_errno` is `ZTS_ECONNREFUSED`), `ZTS_ERR_SERVICE` if the node experiences a
  *     problem, `ZTS_ERR_ARG` if invalid argument. Sets `zts_errno`
  */
 ZTS_API int ZTCALL zts_connect(int fd, const char* ipstr, unsigned short port, int timeout_ms);
@@ -2862,6 +3278,93 @@ ZTS_API int ZTCALL zts_set_keepalive(int fd, int enabled);
  */
 ZTS_API int ZTCALL zts_get_keepalive(int fd);
 
+/**
+ * TCP connection states, as reported in `zts_tcp_info_t::state`
+ */
+typedef enum {
+    ZTS_TCP_CLOSED = 0,
+    ZTS_TCP_LISTEN = 1,
+    ZTS_TCP_SYN_SENT = 2,
+    ZTS_TCP_SYN_RCVD = 3,
+    ZTS_TCP_ESTABLISHED = 4,
+    ZTS_TCP_FIN_WAIT_1 = 5,
+    ZTS_TCP_FIN_WAIT_2 = 6,
+    ZTS_TCP_CLOSE_WAIT = 7,
+    ZTS_TCP_CLOSING = 8,
+    ZTS_TCP_LAST_ACK = 9,
+    ZTS_TCP_TIME_WAIT = 10
+} zts_tcp_state_t;
+
+/**
+ * Statistics of one TCP socket, modelled on Linux `TCP_INFO`. Counters start
+ * when the socket is created or accepted.
+ */
+typedef struct {
+    /** Socket file descriptor */
+    int fd;
+    /** Connection state, see `zts_tcp_state_t` */
+    uint8_t state;
+    /** Number of times the oldest unacknowledged segment has been retransmitted */
+    uint8_t retransmits;
+    /** Window scale used by the peer and by this side */
+    uint8_t snd_wscale;
+    uint8_t rcv_wscale;
+    /** Retransmission timeout (ms) */
+    uint32_t rto;
+    /** Maximum segment size (bytes) */
+    uint32_t snd_mss;
+    /** Smoothed round-trip time and its mean deviation (us, millisecond resolution) */
+    uint32_t rtt;
+    uint32_t rttvar;
+    /** Slow start threshold and congestion window (bytes) */
+    uint32_t snd_ssthresh;
+    uint32_t snd_cwnd;
+    /** Window last advertised by the peer (bytes) */
+    uint32_t snd_wnd;
+    /** Window this side can currently advertise (bytes) */
+    uint32_t rcv_wnd;
+    /** Free space in the send buffer (bytes) */
+    uint32_t snd_buf;
+    /** Bytes sent and not yet acknowledged */
+    uint32_t unacked;
+    /** Segments sent (including retransmissions and pure ACKs) and received */
+    uint64_t segs_out;
+    uint64_t segs_in;
+    /** Segments retransmitted */
+    uint64_t total_retrans;
+    /** Payload bytes sent, including retransmissions */
+    uint64_t bytes_sent;
+    /** Payload bytes retransmitted */
+    uint64_t bytes_retrans;
+    /** Bytes acknowledged by the peer */
+    uint64_t bytes_acked;
+    /** Payload bytes received, not counting duplicates */
+    uint64_t bytes_received;
+} zts_tcp_info_t;
+
+/**
+ * @brief Get statistics of a TCP socket
+ *
+ * @param fd Socket file descriptor
+ * @param dst Structure that will be populated with statistics
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument,
+ *     `ZTS_ERR_SOCKET` if `fd` is not an open TCP socket. Sets `zts_errno`
+ */
+ZTS_API int ZTCALL zts_get_socket_stats(int fd, zts_tcp_info_t* dst);
+
+/**
+ * @brief Get statistics of all open TCP sockets at once. Cheap enough to be
+ *     called periodically.
+ *
+ * @param dst Array that will be populated with statistics, one entry per socket
+ * @param count Number of entries in `dst`, set to the number of entries written.
+ *     If there are more sockets than entries the lowest descriptors are reported.
+ * @return `ZTS_ERR_OK` if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument
+ */
+ZTS_API int ZTCALL zts_get_all_socket_stats(zts_tcp_info_t* dst, unsigned int* count);
+
 //----------------------------------------------------------------------------//
 // DNS                                                                        //
 //----------------------------------------------------------------------------//
@@ -2287,6 +2287,49 @@ zts_bsd_recvfrom(int fd, void* buf, size_t len, int flags, struct zts_sockaddr*
  */
 ZTS_API ssize_t ZTCALL zts_bsd_recvmsg(int fd, struct zts_msghdr* msg, int flags);
 
+/* Message and the number of bytes transferred, for batched I/O */
+struct zts_mmsghdr {
+    struct zts_msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+/** Largest number of messages handled by one batched I/O call */
+#define ZTS_MMSG_VLEN_MAX 1024
+
+/**
+ * @brief Send several messages with one call. On datagram sockets the
+ * messages are copied up front and handed to the stack in batches, each
+ * under a single acquisition of its lock. Stops at the first message that
+ * cannot be sent. `msg_len` of each sent message is set to the number of bytes
+ * sent.
+ *
+ * @param fd Socket file descriptor
+ * @param msgvec Array of messages. `msg_name` may be `NULL` on connected sockets
+ * @param vlen Number of messages in `msgvec` (at most `ZTS_MMSG_VLEN_MAX` are sent)
+ * @param flags Specifies type of message transmission
+ * @return Number of messages sent if successful, `ZTS_ERR_SERVICE` if the node
+ *     experiences a problem, `ZTS_ERR_ARG` if invalid argument, `ZTS_ERR_SOCKET`
+ *     if no message could be sent. Sets `zts_errno`
+ */
+ZTS_API int ZTCALL zts_bsd_sendmmsg(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen, int flags);
+
+/**
+ * @brief Receive several messages with one call. Each message is dequeued
+ * as by `zts_bsd_recvmsg`, which does not take the stack's lock. Only the
+ * first receive honors the blocking mode of the socket, the call then returns
+ * as soon as no further message is queued. `msg_len` of each received message is set to the
+ * number of bytes received.
+ *
+ * @param fd Socket file descriptor
+ * @param msgvec Array of message buffers
+ * @param vlen Number of messages in `msgvec` (at most `ZTS_MMSG_VLEN_MAX` are received)
+ * @param flags Specifies the type of message receipt
+ * @return Number of messages received if successful, `ZTS_ERR_SERVICE` if the
+ *     node experiences a problem, `ZTS_ERR_ARG` if invalid argument,
+ *     `ZTS_ERR_SOCKET` if no message could be received. Sets `zts_errno`
+ */
+ZTS_API int ZTCALL zts_bsd_recvmmsg(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen, int flags);
+
 /**
  * @brief Read data from socket onto buffer
  *
@@ -14,6 +14,7 @@
 use std::convert::TryInto;
 use std::ffi::{c_void, CString};
 use std::io::{self /*, Error, ErrorKind*/};
+use std::mem;
 use std::net::{/*Ipv4Addr, Ipv6Addr,*/ SocketAddr, ToSocketAddrs};
 use std::os::raw::c_int;
 use std::time::Duration;
@@ -250,6 +251,82 @@ impl UdpSocketImpl {
         }
     }
 
+    pub fn send_many(&self, bufs: &[&[u8]]) -> io::Result<usize> {
+        let mut iovs: Vec<zts_iovec> = bufs
+            .iter()
+            .map(|buf| zts_iovec {
+                iov_base: buf.as_ptr() as *mut c_void,
+                iov_len: buf.len(),
+            })
+            .collect();
+        let mut msgs: Vec<zts_mmsghdr> = iovs
+            .iter_mut()
+            .map(|iov| {
+                let mut msg: zts_mmsghdr = unsafe { mem::zeroed() };
+                msg.msg_hdr.msg_iov = iov;
+                msg.msg_hdr.msg_iovlen = 1;
+                msg
+            })
+            .collect();
+        unsafe {
+            let raw = zts_bsd_sendmmsg(
+                *self.inner.as_inner(),
+                msgs.as_mut_ptr(),
+                msgs.len().try_into().unwrap(),
+                0,
+            );
+            if raw >= 0 {
+                Ok(raw.try_into().unwrap())
+            } else {
+                Err(zts_error(raw))
+            }
+        }
+    }
+
+    pub fn recv_many_from(&self, bufs: &mut [&mut [u8]]) -> io::Result<Vec<(usize, SocketAddr)>> {
+        let mut storage: Vec<zts_sockaddr_storage> = vec![unsafe { mem::zeroed() }; bufs.len()];
+        let mut iovs: Vec<zts_iovec> = bufs
+            .iter_mut()
+            .map(|buf| zts_iovec {
+                iov_base: buf.as_mut_ptr() as *mut c_void,
+                iov_len: buf.len(),
+            })
+            .collect();
+        let mut msgs: Vec<zts_mmsghdr> = iovs
+            .iter_mut()
+            .zip(storage.iter_mut())
+            .map(|(iov, addr)| {
+                let mut msg: zts_mmsghdr = unsafe { mem::zeroed() };
+                msg.msg_hdr.msg_name = addr as *mut _ as *mut c_void;
+                msg.msg_hdr.msg_namelen = mem::size_of::<zts_sockaddr_storage>() as zts_socklen_t;
+                msg.msg_hdr.msg_iov = iov;
+                msg.msg_hdr.msg_iovlen = 1;
+                msg
+            })
+            .collect();
+        let raw = unsafe {
+            zts_bsd_recvmmsg(
+                *self.inner.as_inner(),
+                msgs.as_mut_ptr(),
+                msgs.len().try_into().unwrap(),
+                0,
+            )
+        };
+        if raw < 0 {
+            return Err(zts_error(raw));
+        }
+        msgs[..raw as usize]
+            .iter()
+            .zip(storage.iter())
+            .map(|(msg, addr)| {
+                Ok((
+                    msg.msg_len as usize,
+                    sockaddr_to_addr(addr, msg.msg_hdr.msg_namelen as usize)?,
+                ))
+            })
+            .collect()
+    }
+
     pub fn connect(&self, addr: io::Result<&SocketAddr>) -> io::Result<()> {
         let addr = addr?;
         //let (addrp, len) = addr?.into_inner();
@@ -426,6 +503,19 @@ impl UdpSocket {
         self.0.peek(buf)
     }
 
+    /// Sends each buffer as a separate datagram to the connected peer with one
+    /// `zts_bsd_sendmmsg` call, which hands the datagrams to the stack in
+    /// batches. Returns the number of datagrams sent.
+    pub fn send_many(&self, bufs: &[&[u8]]) -> io::Result<usize> {
+        self.0.send_many(bufs)
+    }
+
+    /// Receives up to one datagram per buffer with one `zts_bsd_recvmmsg`
+    /// call, waiting only for the first one. Returns the length and sender of each datagram.
+    pub fn recv_many_from(&self, bufs: &mut [&mut [u8]]) -> io::Result<Vec<(usize, SocketAddr)>> {
+        self.0.recv_many_from(bufs)
+    }
+
     pub fn set_nonblocking(&self, nonblocking: bool) -> io::Result<()> {
         self.0.set_nonblocking(nonblocking)
     }
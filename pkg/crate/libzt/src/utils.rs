@@ -54,6 +54,16 @@ macro_rules! impl_is_minus_one {
 
 impl_is_minus_one! { i8 i16 i32 i64 isize }
 
+/// Error of a failed `zts_bsd_*` call. `ZTS_ERR_SOCKET` (-1) means the socket
+/// error is in `zts_errno`, the other codes are libzt's own.
+pub fn zts_error(raw: c_int) -> io::Error {
+    if raw == -1 {
+        io::Error::from_raw_os_error(unsafe { zts_errno })
+    } else {
+        io::Error::new(ErrorKind::Other, format!("libzt error {}", raw))
+    }
+}
+
 pub fn cvt<T: IsMinusOne>(t: T) -> std::io::Result<T> {
     if t.is_minus_one() {
         Err(std::io::Error::last_os_error())
@@ -20,6 +20,8 @@
 #include "Events.hpp"
 #include "NodeService.hpp"
 #include "Signals.hpp"
+#include "Stats.hpp"
+#include "Thread.hpp"
 #include "VirtualTap.hpp"
 
 #include <string.h>
@@ -54,6 +56,9 @@ Events* zts_events;
 extern Mutex events_m;
 Mutex service_m;
 
+// Number of started zts_ctx_t nodes, guarded by service_m
+static unsigned int _ctxRunning = 0;
+
 int init_subsystems()
 {
     /** Set up service and callback threads and tell them about one another.
@@ -180,6 +185,39 @@ int zts_init_allow_secondary_port(unsigned int allowed)
     return zts_service->allowSecondaryPort(allowed);
 }
 
+int zts_init_set_rx_threads(unsigned int count)
+{
+    ACQUIRE_SERVICE_OFFLINE();
+    return zts_service->setRxThreads(count);
+}
+
+int zts_init_set_rx_thread_affinity(int enabled)
+{
+    ACQUIRE_SERVICE_OFFLINE();
+    return zts_service->setRxThreadAffinity(enabled);
+}
+
+int zts_init_set_state_db(int enabled)
+{
+    ACQUIRE_SERVICE_OFFLINE();
+    return zts_service->setStateDB(enabled);
+}
+
+int zts_init_set_state_store(const zts_state_store_t* store)
+{
+    ACQUIRE_SERVICE_OFFLINE();
+    return zts_service->setStateStore(store);
+}
+
+int zts_init_set_stack_limits(const zts_stack_limits_t* limits)
+{
+    ACQUIRE_SERVICE_OFFLINE();
+    if (! limits) {
+        return ZTS_ERR_ARG;
+    }
+    return zts_lwip_set_stack_limits(limits);
+}
+
 int zts_init_allow_port_mapping(unsigned int allowed)
 {
     ACQUIRE_SERVICE_OFFLINE();
@@ -540,13 +578,16 @@ void* _runNodeService(void* arg)
         zts_service->run();
         // Begin shutdown
         service_m.lock();
-        zts_events->clrState(ZTS_STATE_NODE_RUNNING);
+        // Other nodes may still be using the stack and events
+        const bool othersRunning = (_ctxRunning > 0);
+        if (! othersRunning) {
+            zts_events->clrState(ZTS_STATE_NODE_RUNNING);
+        }
         delete zts_service;
         zts_service = (NodeService*)0;
         service_m.unlock();
         events_m.lock();
-        zts_util_delay(ZTS_CALLBACK_PROCESSING_INTERVAL * 2);
-        if (zts_events) {
+        if (zts_events && ! othersRunning) {
             zts_events->disable();
         }
         events_m.unlock();
@@ -559,14 +600,14 @@ void* _runNodeService(void* arg)
     return NULL;
 }
 
-int zts_node_start()
+// Start the callback thread if there is a callback and it isn't running yet
+static void start_callback_thread()
 {
-    ACQUIRE_SERVICE_OFFLINE();
-    // Start TCP/IP stack
-    zts_lwip_driver_init();
-    // Start callback thread
     int res = ZTS_ERR_OK;
-    if (zts_events->hasCallback()) {
+    if (zts_events->hasCallback() && ! zts_events->getState(ZTS_STATE_CALLBACKS_RUNNING)) {
+        // Set before the thread starts since it exits as soon as it sees an
+        // empty queue without this flag
+        zts_events->setState(ZTS_STATE_CALLBACKS_RUNNING);
 #if defined(__WINDOWS__)
         HANDLE callbackThread = CreateThread(NULL, 0, cbRun, NULL, 0, NULL);
         // TODO: Check success
@@ -581,8 +622,17 @@ int zts_node_start()
             zts_events->clrState(ZTS_STATE_CALLBACKS_RUNNING);
             zts_events->clrCallback();
         }
-        zts_events->setState(ZTS_STATE_CALLBACKS_RUNNING);
     }
+}
+
+int zts_node_start()
+{
+    ACQUIRE_SERVICE_OFFLINE();
+    // Start TCP/IP stack
+    zts_lwip_driver_init();
+    // Start callback thread
+    start_callback_thread();
+    int res = ZTS_ERR_OK;
     // Start ZeroTier service
 #if defined(__WINDOWS__)
     HANDLE serviceThread = CreateThread(NULL, 0, _runNodeService, (void*)NULL, 0, NULL);
@@ -622,7 +672,10 @@ int zts_node_get_port()
 int zts_node_stop()
 {
     ACQUIRE_SERVICE(ZTS_ERR_SERVICE);
-    zts_events->clrState(ZTS_STATE_NODE_RUNNING);
+    if (! _ctxRunning) {
+        zts_events->clrState(ZTS_STATE_NODE_RUNNING);
+        zts_events->disable();
+    }
     zts_service->terminate();
 #if defined(__WINDOWS__)
     WSACleanup();
@@ -633,8 +686,12 @@ int zts_node_stop()
 int zts_node_free()
 {
     ACQUIRE_SERVICE(ZTS_ERR_SERVICE);
+    if (_ctxRunning) {
+        return ZTS_ERR_SERVICE;   // Would take the stack away from them
+    }
     zts_events->setState(ZTS_STATE_FREE_CALLED);
     zts_events->clrState(ZTS_STATE_NODE_RUNNING);
+    zts_events->disable();
     zts_service->terminate();
 #if defined(__WINDOWS__)
     WSACleanup();
@@ -667,6 +724,17 @@ int zts_stats_get_all(zts_stats_counter_t* dst)
     if (! transport_ok()) {
         return ZTS_ERR_SERVICE;
     }
+    memset(dst, 0, sizeof(zts_stats_counter_t));
+
+    // link (always available, counted by the netif driver)
+    dst->link_tx = (uint32_t)zts_stats_sum(ZTS_STAT_LINK_TX);
+    dst->link_rx = (uint32_t)zts_stats_sum(ZTS_STAT_LINK_RX);
+    dst->link_drop = (uint32_t)zts_stats_sum(ZTS_STAT_LINK_DROP);
+    dst->link_err = (uint32_t)zts_stats_sum(ZTS_STAT_LINK_ERR);
+    // tcp (always available, counted by the TCP hooks)
+    dst->tcp_tx = (uint32_t)zts_stats_sum(ZTS_STAT_TCP_TX);
+    dst->tcp_rx = (uint32_t)zts_stats_sum(ZTS_STAT_TCP_RX);
+
 #if LWIP_STATS
 
     extern struct stats_ lwip_stats;
@@ -675,12 +743,10 @@ int zts_stats_get_all(zts_stats_counter_t* dst)
 
     /* Summarize lwIP's statistics for simplicity at the expense of specificity */
 
-    // link
-    dst->link_tx = lws.link.xmit;
-    dst->link_rx = lws.link.recv;
-    dst->link_drop = lws.link.drop;
-    dst->link_err = lws.link.chkerr + lws.link.lenerr + lws.link.memerr + lws.link.rterr + lws.link.proterr
-                    + lws.link.opterr + lws.link.err;
+    // link (drops and errors detected by lwIP itself)
+    dst->link_drop += lws.link.drop;
+    dst->link_err += lws.link.chkerr + lws.link.lenerr + lws.link.memerr + lws.link.rterr + lws.link.proterr
+                     + lws.link.opterr + lws.link.err;
     // etharp
     dst->etharp_tx = lws.etharp.xmit;
     dst->etharp_rx = lws.etharp.recv;
@@ -721,8 +787,6 @@ int zts_stats_get_all(zts_stats_counter_t* dst)
     dst->udp_err = lws.udp.chkerr + lws.udp.lenerr + lws.udp.memerr + lws.udp.rterr + lws.udp.proterr + lws.udp.opterr
                    + lws.udp.err;
     // tcp
-    dst->tcp_tx = lws.tcp.xmit;
-    dst->tcp_rx = lws.tcp.recv;
     dst->tcp_drop = lws.tcp.drop;
     dst->tcp_err = lws.tcp.chkerr + lws.tcp.lenerr + lws.tcp.memerr + lws.tcp.rterr + lws.tcp.proterr + lws.tcp.opterr
                    + lws.tcp.err;
@@ -735,11 +799,9 @@ int zts_stats_get_all(zts_stats_counter_t* dst)
 
     // TODO: Add mem and sys stats
 
-    return ZTS_ERR_OK;
-#else
-    return ZTS_ERR_NO_RESULT;
-#endif
 #undef lws
+#endif
+    return ZTS_ERR_OK;
 }
 
 #ifdef __cplusplus
@@ -747,3 +809,184 @@ int zts_stats_get_all(zts_stats_counter_t* dst)
 #endif
 
 }   // namespace ZeroTier
+
+//----------------------------------------------------------------------------//
+// Additional node instances                                                  //
+//----------------------------------------------------------------------------//
+
+/**
+ * A node with its own identity, ports and networks. Uses the process-wide
+ * network stack and event system.
+ */
+struct zts_ctx {
+    NodeService* service;
+    Thread thread;
+    bool started;
+    Mutex m;
+
+    void threadMain() throw()
+    {
+        try {
+            service->run();
+        }
+        catch (...) {
+        }
+    }
+};
+
+// Lock context and check that its node is not running
+#define ACQUIRE_CTX_OFFLINE(ctx)                                                                                       \
+    if (! ctx) {                                                                                                       \
+        return ZTS_ERR_ARG;                                                                                            \
+    }                                                                                                                  \
+    Mutex::Lock _lc(ctx->m);                                                                                           \
+    if (ctx->started) {                                                                                                \
+        return ZTS_ERR_SERVICE;                                                                                        \
+    }
+// Lock context and check that its node is running, returns null_x for a NULL
+// context and x if the node is not running
+#define ACQUIRE_CTX(ctx, null_x, x)                                                                                    \
+    if (! ctx) {                                                                                                       \
+        return null_x;                                                                                                 \
+    }                                                                                                                  \
+    Mutex::Lock _lc(ctx->m);                                                                                           \
+    if (! ctx->started) {                                                                                              \
+        return x;                                                                                                      \
+    }
+
+static NodeService* ctx_new_service()
+{
+    NodeService* service = new NodeService();
+    service->setUserEventSystem(zts_events);
+    return service;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+zts_ctx_t* zts_ctx_new()
+{
+    Mutex::Lock _ls(service_m);
+    if (! zts_events) {
+        zts_events = new Events();
+    }
+    if (zts_events->getState(ZTS_STATE_FREE_CALLED)) {
+        return NULL;
+    }
+#if defined(__WINDOWS__)
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    zts_ctx_t* ctx = new zts_ctx_t();
+    ctx->service = ctx_new_service();
+    ctx->started = false;
+    return ctx;
+}
+
+int zts_ctx_init_from_storage(zts_ctx_t* ctx, const char* path)
+{
+    ACQUIRE_CTX_OFFLINE(ctx);
+    return ctx->service->setHomePath(path);
+}
+
+int zts_ctx_init_from_memory(zts_ctx_t* ctx, const char* key, unsigned int len)
+{
+    ACQUIRE_CTX_OFFLINE(ctx);
+    return ctx->service->setIdentity(key, len);
+}
+
+int zts_ctx_init_set_port(zts_ctx_t* ctx, unsigned short port)
+{
+    ACQUIRE_CTX_OFFLINE(ctx);
+    return ctx->service->setPrimaryPort(port);
+}
+
+int zts_ctx_node_start(zts_ctx_t* ctx)
+{
+    ACQUIRE_CTX_OFFLINE(ctx);
+    {
+        Mutex::Lock _ls(service_m);
+        if (zts_events->getState(ZTS_STATE_FREE_CALLED)) {
+            return ZTS_ERR_SERVICE;
+        }
+        zts_lwip_driver_init();
+        if (zts_events->hasCallback()) {
+            ctx->service->enableEvents();
+            start_callback_thread();
+        }
+        _ctxRunning++;
+        zts_events->setState(ZTS_STATE_NODE_RUNNING);
+    }
+    try {
+        ctx->thread = Thread::start(ctx);
+    }
+    catch (...) {
+        Mutex::Lock _ls(service_m);
+        _ctxRunning--;
+        return ZTS_ERR_GENERAL;
+    }
+    ctx->started = true;
+    return ZTS_ERR_OK;
+}
+
+int zts_ctx_node_is_online(zts_ctx_t* ctx)
+{
+    ACQUIRE_CTX(ctx, 0, 0);
+    return ctx->service->nodeIsOnline();
+}
+
+uint64_t zts_ctx_node_get_id(zts_ctx_t* ctx)
+{
+    ACQUIRE_CTX(ctx, ZTS_ERR_SERVICE, ZTS_ERR_SERVICE);
+    return ctx->service->getNodeId();
+}
+
+int zts_ctx_net_join(zts_ctx_t* ctx, uint64_t net_id)
+{
+    ACQUIRE_CTX(ctx, ZTS_ERR_ARG, ZTS_ERR_SERVICE);
+    return ctx->service->join(net_id);
+}
+
+int zts_ctx_net_leave(zts_ctx_t* ctx, uint64_t net_id)
+{
+    ACQUIRE_CTX(ctx, ZTS_ERR_ARG, ZTS_ERR_SERVICE);
+    return ctx->service->leave(net_id);
+}
+
+int zts_ctx_addr_get(zts_ctx_t* ctx, uint64_t net_id, unsigned int family, struct zts_sockaddr_storage* addr)
+{
+    ACQUIRE_CTX(ctx, ZTS_ERR_ARG, ZTS_ERR_SERVICE);
+    return ctx->service->getFirstAssignedAddr(net_id, family, addr);
+}
+
+int zts_ctx_node_stop(zts_ctx_t* ctx)
+{
+    ACQUIRE_CTX(ctx, ZTS_ERR_ARG, ZTS_ERR_SERVICE);
+    ctx->service->terminate();
+    Thread::join(ctx->thread);
+    // A service only runs once, have a fresh one ready for the next start
+    delete ctx->service;
+    ctx->service = ctx_new_service();
+    ctx->started = false;
+    Mutex::Lock _ls(service_m);
+    _ctxRunning--;
+    if (! _ctxRunning && ! (zts_service && zts_service->isRunning())) {
+        zts_events->clrState(ZTS_STATE_NODE_RUNNING);
+    }
+    return ZTS_ERR_OK;
+}
+
+int zts_ctx_free(zts_ctx_t* ctx)
+{
+    if (! ctx) {
+        return ZTS_ERR_ARG;
+    }
+    zts_ctx_node_stop(ctx);
+    delete ctx->service;
+    delete ctx;
+    return ZTS_ERR_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -23,6 +23,11 @@
 #include "NodeService.hpp"
 #include "concurrentqueue.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+
 #ifdef ZTS_ENABLE_JAVA
 #include <jni.h>
 #endif
@@ -77,19 +82,85 @@ void (*_userEventCallback)(void*);
 
 moodycamel::ConcurrentQueue<zts_event_msg_t*> _callbackMsgQueue;
 
+template <typename T> struct EventPoolState {
+    moodycamel::ConcurrentQueue<T*> free;
+    std::atomic<int> count;
+
+    EventPoolState() : count(0)
+    {
+    }
+};
+
+template <typename T> static EventPoolState<T>& eventPoolState()
+{
+    static EventPoolState<T> state;
+    return state;
+}
+
+template <typename T> T* EventPool<T>::alloc()
+{
+    EventPoolState<T>& ps = eventPoolState<T>();
+    T* obj = NULL;
+    if (! ps.free.try_dequeue(obj)) {
+        if (ps.count.fetch_add(1) >= ZTS_EVENT_POOL_SIZE) {
+            ps.count.fetch_sub(1);
+            return NULL;
+        }
+        obj = new T;
+    }
+    memset((void*)obj, 0, sizeof(T));
+    return obj;
+}
+
+template <typename T> void EventPool<T>::release(T* obj)
+{
+    if (obj) {
+        eventPoolState<T>().free.enqueue(obj);
+    }
+}
+
+template class EventPool<zts_event_msg_t>;
+template class EventPool<zts_node_info_t>;
+template class EventPool<zts_net_info_t>;
+template class EventPool<zts_netif_info_t>;
+template class EventPool<zts_route_info_t>;
+template class EventPool<zts_peer_info_t>;
+template class EventPool<zts_addr_info_t>;
+
+// Used to wake the callback thread when a message is enqueued or when it
+// should stop. The flag is set after the message is in the queue so a
+// wakeup can't be lost between an empty dequeue and the wait.
+static std::mutex _callbackWake_m;
+static std::condition_variable _callbackWake_cv;
+static bool _callbackWakePending = false;
+
+static void wakeCallbackThread()
+{
+    {
+        std::lock_guard<std::mutex> _l(_callbackWake_m);
+        _callbackWakePending = true;
+    }
+    _callbackWake_cv.notify_one();
+}
+
 void Events::run()
 {
+    zts_event_msg_t* msgs[ZTS_CALLBACK_BATCH_SIZE];
     while (getState(ZTS_STATE_CALLBACKS_RUNNING) || _callbackMsgQueue.size_approx() > 0) {
-        zts_event_msg_t* msg;
-        size_t sz = _callbackMsgQueue.size_approx();
-        for (size_t j = 0; j < sz; j++) {
-            if (_callbackMsgQueue.try_dequeue(msg)) {
-                events_m.lock();
-                sendToUser(msg);
-                events_m.unlock();
+        size_t sz = _callbackMsgQueue.try_dequeue_bulk(msgs, ZTS_CALLBACK_BATCH_SIZE);
+        if (sz == 0) {
+            std::unique_lock<std::mutex> _l(_callbackWake_m);
+            while (! _callbackWakePending && getState(ZTS_STATE_CALLBACKS_RUNNING)) {
+                _callbackWake_cv.wait(_l);
             }
+            _callbackWakePending = false;
+            continue;
+        }
+        for (size_t j = 0; j < sz; j++) {
+            events_m.lock();
+            sendToUser(msgs[j]);
+            events_m.unlock();
         }
-        zts_util_delay(ZTS_CALLBACK_PROCESSING_INTERVAL);
     }
 }
 
@@ -98,14 +169,17 @@ bool Events::enqueue(unsigned int event_code, const void* arg, int len)
     if (! _enabled) {
         return false;
     }
-    if (_callbackMsgQueue.size_approx() > 1024) {
+    if (_callbackMsgQueue.size_approx() > ZTS_EVENT_QUEUE_MAX) {
         /* Rate-limit number of events. This value should only grow if the
         user application isn't returning from the event handler in a timely manner.
         For most applications it should hover around 1 to 2 */
         return false;
     }
     
-    zts_event_msg_t* msg = new zts_event_msg_t();
+    zts_event_msg_t* msg = EventPool<zts_event_msg_t>::alloc();
+    if (! msg) {
+        return false;
+    }
     msg->event_code = event_code;
 
     if (ZTS_NODE_EVENT(event_code)) {
@@ -144,6 +218,7 @@ bool Events::enqueue(unsigned int event_code, const void* arg, int len)
     // ownership of arg is now transferred
     //
     _callbackMsgQueue.enqueue(msg);
+    wakeCallbackThread();
     return true;
 }
 
@@ -152,25 +227,13 @@ void Events::destroy(zts_event_msg_t* msg)
     if (! msg) {
         return;
     }
-    if (msg->node) {
-        delete msg->node;
-    }
-    if (msg->network) {
-        delete msg->network;
-    }
-    if (msg->netif) {
-        delete msg->netif;
-    }
-    if (msg->route) {
-        delete msg->route;
-    }
-    if (msg->peer) {
-        delete msg->peer;
-    }
-    if (msg->addr) {
-        delete msg->addr;
-    }
-    delete msg;
+    EventPool<zts_node_info_t>::release(msg->node);
+    EventPool<zts_net_info_t>::release(msg->network);
+    EventPool<zts_netif_info_t>::release(msg->netif);
+    EventPool<zts_route_info_t>::release(msg->route);
+    EventPool<zts_peer_info_t>::release(msg->peer);
+    EventPool<zts_addr_info_t>::release(msg->addr);
+    EventPool<zts_event_msg_t>::release(msg);
     msg = NULL;
 }
 
@@ -288,6 +351,10 @@ void Events::clrState(uint8_t newFlags)
     else {
         CLR_FLAGS(ZTS_STATE_NET_SERVICE_RUNNING);
     }
+    if (newFlags & ZTS_STATE_CALLBACKS_RUNNING) {
+        // Let a waiting callback thread observe that it should exit
+        wakeCallbackThread();
+    }
 }
 
 bool Events::getState(uint8_t testFlags)
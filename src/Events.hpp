@@ -86,9 +86,40 @@ inline int transport_ok()
 }
 
 /**
- * How often callback messages are assembled and/or sent
+ * Maximum number of callback messages dequeued at once
  */
-#define ZTS_CALLBACK_PROCESSING_INTERVAL 25
+#define ZTS_CALLBACK_BATCH_SIZE 32
+
+/**
+ * Maximum number of callback messages waiting to be sent to the user
+ */
+#define ZTS_EVENT_QUEUE_MAX 1024
+
+/**
+ * Number of callback messages (and of each payload type) that can exist at
+ * once: everything that may be queued plus the batch being delivered.
+ */
+#define ZTS_EVENT_POOL_SIZE (ZTS_EVENT_QUEUE_MAX + (2 * ZTS_CALLBACK_BATCH_SIZE))
+
+/**
+ * Fixed-capacity recycling pool for callback messages and their payload
+ * structures. Objects are allocated on first use and are never returned to
+ * the heap, so event storms reuse the same memory instead of fragmenting it.
+ * Instantiated in Events.cpp for each zts_*_info_t type and zts_event_msg_t.
+ */
+template <typename T> class EventPool {
+  public:
+    /**
+     * Return a zeroed object, or NULL if ZTS_EVENT_POOL_SIZE objects of this
+     * type are already in use
+     */
+    static T* alloc();
+
+    /**
+     * Return an object to the pool. NULL is ignored.
+     */
+    static void release(T* obj);
+};
 
 class Events {
     bool _enabled;
@@ -99,7 +130,8 @@ class Events {
     }
 
     /**
-     * Perform one iteration of callback processing
+     * Deliver callback messages to the user until callbacks are stopped.
+     * Blocks while the queue is empty and wakes up on enqueue.
      */
     void run();
 
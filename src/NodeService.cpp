@@ -25,8 +25,14 @@
 #include "InetAddress.hpp"
 #include "Mutex.hpp"
 #include "Node.hpp"
+#include "Thread.hpp"
 #include "Utilities.hpp"
 #include "VirtualTap.hpp"
+#include "concurrentqueue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 #if defined(__WINDOWS__)
 #include <iphlpapi.h>
@@ -37,10 +43,363 @@
 #define stat _stat
 #endif
 
+#if ! defined(__WINDOWS__)
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #define ZT_TCP_FALLBACK_RELAY "204.80.128.1/443"
 
+// Packets queued on a receive worker beyond which new ones are dropped
+#define ZTS_RX_WORKER_QUEUE_MAX 4096
+// Packets a receive worker dequeues at once
+#define ZTS_RX_WORKER_BATCH 32
+// Memory held by idle packet buffers kept for reuse
+#define ZTS_RX_PACKET_POOL_BYTES (4 * 1024 * 1024)
+// Datagrams read from a UDP socket per recvmmsg() call
+#define ZTS_RX_MMSG_BATCH 32
+// Datagrams drained from a UDP socket per readiness notification
+#define ZTS_RX_MMSG_DRAIN_MAX 1024
+// Datagrams a thread queues before sending them with one sendmmsg() call
+#define ZTS_TX_MMSG_BATCH 64
+// Largest datagram that is queued, larger ones are sent immediately
+#define ZTS_TX_MMSG_PACKET_SIZE 16384
+// Interval at which every peer is checked for paths the core has expired
+#define ZTS_PEER_PATH_SWEEP_INTERVAL 5000
+// State database object present once networks.d has been imported, outside
+// the range of ZT_StateObjectType
+#define ZTS_STATE_DB_MIGRATED 0x100
+
 namespace ZeroTier {
 
+//----------------------------------------------------------------------------//
+// Receive workers                                                            //
+//----------------------------------------------------------------------------//
+
+/**
+ * A datagram copied off the service thread's receive buffer
+ */
+struct RxPacket {
+    PhySocket* sock;
+    struct sockaddr_storage from;
+    unsigned long len;
+    char data[ZT_MAX_PACKET_LENGTH];
+};
+
+static moodycamel::ConcurrentQueue<RxPacket*> _rxPacketPool;
+static std::atomic<int> _rxPacketPoolCount(0);
+
+static RxPacket* rx_packet_alloc()
+{
+    RxPacket* p = NULL;
+    if (_rxPacketPool.try_dequeue(p)) {
+        _rxPacketPoolCount--;
+        return p;
+    }
+    return new RxPacket;
+}
+
+static void rx_packet_free(RxPacket* p)
+{
+    if (_rxPacketPoolCount.load(std::memory_order_relaxed) < (int)(ZTS_RX_PACKET_POOL_BYTES / sizeof(RxPacket))) {
+        _rxPacketPoolCount++;
+        _rxPacketPool.enqueue(p);
+        return;
+    }
+    delete p;
+}
+
+// Index into the allowed CPUs of the next receive worker to be pinned, shared
+// by all nodes in the process
+static std::atomic<unsigned int> _nextRxCpu(0);
+
+// Networks the calling receive worker has delivered frames to since it last
+// flushed, NULL on other threads
+static thread_local std::vector<uint64_t>* _rxTouchedNets = NULL;
+
+//----------------------------------------------------------------------------//
+// TCP tunnel framing                                                         //
+//----------------------------------------------------------------------------//
+
+// Total length of the frame whose 5-byte header is at buf
+static inline unsigned long tunnel_frame_length(const char* buf)
+{
+    return ((((unsigned long)buf[3] & 0xff) << 8) | ((unsigned long)buf[4] & 0xff)) + 5;
+}
+
+/**
+ * Send as much of a stream queue as the socket accepts, both segments of the
+ * ring with a single call where possible
+ *
+ * @return Number of bytes sent, or -1 if the connection failed
+ */
+static long stream_send_queued(Phy<NodeService*>& phy, PhySocket* sock, StreamBuffer& q)
+{
+    const void* seg[2];
+    unsigned long seglen[2];
+    const unsigned int nseg = q.peek(seg, seglen);
+    if (! nseg) {
+        return 0;
+    }
+#if defined(__WINDOWS__)
+    long sent = phy.streamSend(sock, seg[0], seglen[0], false);
+    if ((nseg > 1) && (sent == (long)seglen[0])) {
+        const long more = phy.streamSend(sock, seg[1], seglen[1], false);
+        if (more > 0) {
+            sent += more;
+        }
+    }
+    return (sent < 0) ? 0 : sent;
+#else
+    struct iovec iov[2];
+    for (unsigned int i = 0; i < nseg; i++) {
+        iov[i].iov_base = const_cast<void*>(seg[i]);
+        iov[i].iov_len = seglen[i];
+    }
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = nseg;
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    const long sent = (long)::sendmsg((int)phy.getDescriptor(sock), &mh, flags);
+    if (sent < 0) {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) || (errno == ENOBUFS)) ? 0 : -1;
+    }
+    return sent;
+#endif
+}
+
+//----------------------------------------------------------------------------//
+// Batched wire packet transmission                                           //
+//----------------------------------------------------------------------------//
+
+#if defined(__linux__)
+/**
+ * Datagrams queued by one thread until its next flush point
+ */
+struct TxBatch {
+    unsigned int count;
+    char* bufs;
+    int fds[ZTS_TX_MMSG_BATCH];
+    struct sockaddr_storage to[ZTS_TX_MMSG_BATCH];
+    struct iovec iov[ZTS_TX_MMSG_BATCH];
+    struct mmsghdr msgs[ZTS_TX_MMSG_BATCH];
+    char ctl[ZTS_TX_MMSG_BATCH][CMSG_SPACE(sizeof(int))];
+
+    TxBatch() : count(0), bufs(new char[ZTS_TX_MMSG_BATCH * ZTS_TX_MMSG_PACKET_SIZE])
+    {
+    }
+
+    ~TxBatch()
+    {
+        delete[] bufs;
+    }
+};
+
+// Only threads with a flush point (service loop, receive workers) batch,
+// others such as the network stack thread send right away
+static thread_local TxBatch* _txBatch = NULL;
+#endif
+
+static void tx_batch_flush()
+{
+#if defined(__linux__)
+    TxBatch* b = _txBatch;
+    if (! b) {
+        return;
+    }
+    unsigned int i = 0;
+    while (i < b->count) {
+        // sendmmsg() takes a single socket, send each run of them separately
+        unsigned int j = i + 1;
+        while (j < b->count && b->fds[j] == b->fds[i]) {
+            j++;
+        }
+        while (i < j) {
+            int n = sendmmsg(b->fds[i], &(b->msgs[i]), j - i, 0);
+            // Skip a datagram that cannot be sent, as a failed sendto() would
+            i += (n > 0) ? (unsigned int)n : 1;
+        }
+    }
+    b->count = 0;
+#endif
+}
+
+/** Start queueing wire packets sent by the calling thread */
+static void tx_batch_begin()
+{
+#if defined(__linux__)
+    if (! _txBatch) {
+        _txBatch = new TxBatch();
+    }
+#endif
+}
+
+/** Send anything queued and stop queueing on the calling thread */
+static void tx_batch_end()
+{
+#if defined(__linux__)
+    tx_batch_flush();
+    delete _txBatch;
+    _txBatch = NULL;
+#endif
+}
+
+/**
+ * Queue a datagram if the calling thread batches its sends. A TTL is applied
+ * to the one datagram through ancillary data instead of changing it on the
+ * socket before and after.
+ *
+ * @return Whether the datagram was queued
+ */
+static bool
+tx_batch_queue(int fd, const struct sockaddr_storage* to, const void* data, unsigned int len, unsigned int ttl)
+{
+#if defined(__linux__)
+    TxBatch* b = _txBatch;
+    if (! b || len > ZTS_TX_MMSG_PACKET_SIZE || (to->ss_family != AF_INET && to->ss_family != AF_INET6)) {
+        return false;
+    }
+    if (b->count == ZTS_TX_MMSG_BATCH) {
+        tx_batch_flush();
+    }
+    const unsigned int i = b->count++;
+    char* buf = b->bufs + (i * ZTS_TX_MMSG_PACKET_SIZE);
+    memcpy(buf, data, len);
+    b->fds[i] = fd;
+    const socklen_t tolen = (to->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    memcpy(&(b->to[i]), to, tolen);
+    b->iov[i].iov_base = buf;
+    b->iov[i].iov_len = len;
+    struct msghdr* mh = &(b->msgs[i].msg_hdr);
+    memset(mh, 0, sizeof(struct msghdr));
+    mh->msg_name = &(b->to[i]);
+    mh->msg_namelen = tolen;
+    mh->msg_iov = &(b->iov[i]);
+    mh->msg_iovlen = 1;
+    if (ttl && to->ss_family == AF_INET) {
+        mh->msg_control = b->ctl[i];
+        mh->msg_controllen = sizeof(b->ctl[i]);
+        struct cmsghdr* cm = CMSG_FIRSTHDR(mh);
+        cm->cmsg_level = IPPROTO_IP;
+        cm->cmsg_type = IP_TTL;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        const int t = (int)ttl;
+        memcpy(CMSG_DATA(cm), &t, sizeof(int));
+    }
+    return true;
+#else
+    ZTS_UNUSED_ARG(fd);
+    ZTS_UNUSED_ARG(to);
+    ZTS_UNUSED_ARG(data);
+    ZTS_UNUSED_ARG(len);
+    ZTS_UNUSED_ARG(ttl);
+    return false;
+#endif
+}
+
+/**
+ * A thread calling processWirePacket() for the peers sharded onto it. All
+ * packets from a given source address go to the same worker so that they are
+ * processed in the order they were received.
+ */
+struct RxWorker {
+    NodeService* parent;
+    Thread thread;
+    moodycamel::ConcurrentQueue<RxPacket*> q;
+    std::atomic<int> depth;
+    std::mutex m;
+    std::condition_variable cv;
+    bool wakePending;
+    bool running;
+    // CPU to run on, -1 to leave it to the scheduler
+    int cpu;
+
+    RxWorker(NodeService* p) : parent(p), depth(0), wakePending(false), running(true), cpu(-1)
+    {
+    }
+
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> _l(m);
+            wakePending = true;
+        }
+        cv.notify_one();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> _l(m);
+            running = false;
+        }
+        cv.notify_one();
+        Thread::join(thread);
+        RxPacket* p = NULL;
+        while (q.try_dequeue(p)) {
+            rx_packet_free(p);
+        }
+    }
+
+    void threadMain() throw()
+    {
+        RxPacket* pkts[ZTS_RX_WORKER_BATCH];
+        std::vector<uint64_t> touched;
+#if defined(__linux__)
+        if (cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (err != 0) {
+                fprintf(stderr, "WARNING: unable to pin receive thread to CPU %d: %s" ZT_EOL_S, cpu, strerror(err));
+            }
+        }
+#endif
+        tx_batch_begin();
+        _rxTouchedNets = &touched;
+        for (;;) {
+            size_t n = q.try_dequeue_bulk(pkts, ZTS_RX_WORKER_BATCH);
+            if (n == 0) {
+                std::unique_lock<std::mutex> _l(m);
+                while (! wakePending && running) {
+                    cv.wait(_l);
+                }
+                if (! running) {
+                    break;
+                }
+                wakePending = false;
+                continue;
+            }
+            depth -= (int)n;
+            for (size_t i = 0; i < n; i++) {
+                RxPacket* p = pkts[i];
+                parent->processWirePacket(p->sock, (const struct sockaddr*)&(p->from), p->data, p->len);
+                rx_packet_free(p);
+            }
+            // Frames decrypted by this worker would otherwise wait for the
+            // service thread's next poll iteration
+            parent->flushTaps(touched);
+            touched.clear();
+            tx_batch_flush();
+        }
+        _rxTouchedNets = NULL;
+        tx_batch_end();
+    }
+};
+
+
 static int SnodeVirtualNetworkConfigFunction(
     ZT_Node* node,
     void* uptr,
@@ -175,6 +534,8 @@ NodeService::NodeService()
     , _randomPortRangeStart(0)
     , _randomPortRangeEnd(0)
     , _udpPortPickerCounter(0)
+    , _allPeersChanged(true)
+    , _recheckDue(false)
     , _lastDirectReceiveFromGlobal(0)
     , _fallbackRelayAddress(ZT_TCP_FALLBACK_RELAY)
     , _allowTcpRelay(true)
@@ -183,7 +544,9 @@ NodeService::NodeService()
     , _tcpFallbackTunnel((TcpConnection*)0)
     , _lastRestart(0)
     , _nextBackgroundTaskDeadline(0)
+    , _useStateDB(false)
     , _run(false)
+    , _terminated(false)
     , _termReason(ONE_STILL_RUNNING)
     , _allowPortMapping(true)
 #ifdef ZT_USE_MINIUPNPC
@@ -199,7 +562,11 @@ NodeService::NodeService()
     , _eventsEnabled(false)
     , _homePath("")
     , _events(NULL)
+    , _rxThreads(0)
+    , _pinRxThreads(false)
+    , _rxLastSock(NULL)
 {
+    memset(&_userStore, 0, sizeof(_userStore));
 }
 
 NodeService::~NodeService()
@@ -212,7 +579,13 @@ NodeService::~NodeService()
 
 NodeService::ReasonForTermination NodeService::run()
 {
-    _run = true;
+    {
+        Mutex::Lock _lr(_run_m);
+        if (_terminated) {
+            return ONE_NORMAL_TERMINATION;   // Stopped before the service thread got here
+        }
+        _run = true;
+    }
     try {
         // Create home path (if necessary)
         // By default, _homePath is empty and nothing is written to storage
@@ -238,6 +611,14 @@ NodeService::ReasonForTermination NodeService::run()
             }
         }
 
+        if (_useStateDB && (_homePath.length() > 0) && ! _userStore.get) {
+            if (! _stateDB.open(_homePath + ZT_PATH_SEPARATOR_S "state.db")) {
+                fprintf(stderr, "WARNING: unable to use state database, storing state in separate files" ZT_EOL_S);
+            }
+        }
+        _stateStore.setDB(_stateDB.isOpen() ? &_stateDB : NULL);
+        _stateStore.start();
+
         // Set callbacks for ZT Node
         {
             struct ZT_Node_Callbacks cb;
@@ -341,8 +722,18 @@ NodeService::ReasonForTermination NodeService::run()
         }
 #endif
 
+        // Join existing networks in the state database, importing those in
+        // networks.d the first time it is used
+        bool joinFromNetworksDotD = _allowNetworkCaching;
+        if (_allowNetworkCaching && _stateDB.isOpen() && migrateNetworksToStateDB()) {
+            std::vector<uint64_t> nwids(_stateDB.list(ZT_STATE_OBJECT_NETWORK_CONFIG));
+            for (std::vector<uint64_t>::iterator n(nwids.begin()); n != nwids.end(); ++n) {
+                _node->join(*n, (void*)0, (void*)0);
+            }
+            joinFromNetworksDotD = false;
+        }
         // Join existing networks in networks.d
-        if (_allowNetworkCaching) {
+        if (joinFromNetworksDotD) {
             std::vector<std::string> networksDotD(
                 OSUtils::listDirectory((_homePath + ZT_PATH_SEPARATOR_S "networks.d").c_str()));
             for (std::vector<std::string>::iterator f(networksDotD.begin()); f != networksDotD.end(); ++f) {
@@ -353,15 +744,18 @@ NodeService::ReasonForTermination NodeService::run()
             }
         }
         // Main I/O loop
-        _nextBackgroundTaskDeadline = 0;
+        _nextBackgroundTaskDeadline.store(0);
         int64_t clockShouldBe = OSUtils::now();
         _lastRestart = clockShouldBe;
         int64_t lastTapMulticastGroupCheck = 0;
         int64_t lastBindRefresh = 0;
         int64_t lastCleanedPeersDb = 0;
+        int64_t lastPeerPathSweep = 0;
         int64_t lastLocalInterfaceAddressCheck =
             (clockShouldBe - ZT_LOCAL_INTERFACE_CHECK_INTERVAL) + 15000;   // do this in 15s to give portmapper time to
         int64_t lastOnline = OSUtils::now();
+        tx_batch_begin();
+        startRxWorkers();
         for (;;) {
             _run_m.lock();
             if (! _run) {
@@ -418,10 +812,23 @@ NodeService::ReasonForTermination NodeService::run()
             generateSyntheticEvents();
 
             // Run background task processor in core if it's time to do so
-            int64_t dl = _nextBackgroundTaskDeadline;
+            int64_t dl = _nextBackgroundTaskDeadline.load();
             if (dl <= now) {
-                _node->processBackgroundTasks((void*)0, now, &_nextBackgroundTaskDeadline);
-                dl = _nextBackgroundTaskDeadline;
+                volatile int64_t next = dl;
+                _node->processBackgroundTasks((void*)0, now, &next);
+                // Keep an earlier deadline a receive worker set meanwhile
+                int64_t expected = dl;
+                if (! _nextBackgroundTaskDeadline.compare_exchange_strong(expected, next)) {
+                    lowerBackgroundTaskDeadline(next);
+                }
+                _recheckDue = true;
+                dl = _nextBackgroundTaskDeadline.load();
+            }
+
+            // Paths expire without notice, look for dead ones now and then
+            if ((now - lastPeerPathSweep) >= ZTS_PEER_PATH_SWEEP_INTERVAL) {
+                lastPeerPathSweep = now;
+                markAllPeersChanged();
             }
 
             // Close TCP fallback tunnel if we have direct UDP
@@ -491,14 +898,28 @@ NodeService::ReasonForTermination NodeService::run()
             // Clean peers.d periodically
             if ((now - lastCleanedPeersDb) >= 3600000) {
                 lastCleanedPeersDb = now;
-                OSUtils::cleanDirectory(
-                    (_homePath + ZT_PATH_SEPARATOR_S "peers.d").c_str(),
-                    now - 2592000000LL);   // delete older than 30 days
+                if (_stateDB.isOpen()) {
+                    _stateStore.compact(ZT_STATE_OBJECT_PEER, now - 2592000000LL);
+                }
+                else {
+                    OSUtils::cleanDirectory(
+                        (_homePath + ZT_PATH_SEPARATOR_S "peers.d").c_str(),
+                        now - 2592000000LL);   // delete older than 30 days
+                }
             }
 
             const unsigned long delay = (dl > now) ? (unsigned long)(dl - now) : 100;
             clockShouldBe = now + (uint64_t)delay;
+            // Deliver frames produced by this iteration, then everything
+            // that arrived during the poll, to the stack in batches. Send
+            // the wire packets queued while doing so.
+            flushTaps();
+            tx_batch_flush();
+            flushUserStore();
+            _rxLastSock = NULL;
             _phy.poll(delay);
+            flushTaps();
+            tx_batch_flush();
         }
     }
     catch (std::exception& e) {
@@ -512,6 +933,9 @@ NodeService::ReasonForTermination NodeService::run()
         _fatalErrorMessage = "unexpected exception in main thread: unknown exception";
     }
 
+    stopRxWorkers();
+    tx_batch_end();
+
     {
         Mutex::Lock _l(_nets_m);
         for (std::map<uint64_t, NetworkState>::iterator n(_nets.begin()); n != _nets.end(); ++n) {
@@ -532,6 +956,10 @@ NodeService::ReasonForTermination NodeService::run()
     }
     delete _node;
     _node = (Node*)0;
+    flushUserStore();
+    _stateStore.stop();
+    _stateStore.setDB(NULL);
+    _stateDB.close();
     return _termReason;
 }
 
@@ -551,6 +979,7 @@ void NodeService::terminate()
 {
     _run_m.lock();
     _run = false;
+    _terminated = true;
     _run_m.unlock();
     _nodeId = 0x0;
     _primaryPort = 0;
@@ -562,7 +991,6 @@ void NodeService::terminate()
     memset(_publicIdStr, 0, ZT_IDENTITY_STRING_BUFFER_LENGTH);
     memset(_secretIdStr, 0, ZT_IDENTITY_STRING_BUFFER_LENGTH);
     _interfacePrefixBlacklist.clear();
-    _events->disable();
     _phy.whack();
 }
 
@@ -584,7 +1012,10 @@ void NodeService::syncManagedStuff(NetworkState& n)
                 fprintf(stderr, "ERROR: unable to remove ip address %s" ZT_EOL_S, ip->toString(ipbuf));
             }
             else {
-                zts_addr_info_t* ad = new zts_addr_info_t();
+                zts_addr_info_t* ad = EventPool<zts_addr_info_t>::alloc();
+                if (! ad) {
+                    continue;
+                }
                 ad->net_id = n.tap->_net_id;
                 if ((*ip).isV4()) {
                     struct sockaddr_in* in4 = (struct sockaddr_in*)&(ad->addr);
@@ -607,7 +1038,10 @@ void NodeService::syncManagedStuff(NetworkState& n)
                 fprintf(stderr, "ERROR: unable to add ip address %s" ZT_EOL_S, ip->toString(ipbuf));
             }
             else {
-                zts_addr_info_t* ad = new zts_addr_info_t();
+                zts_addr_info_t* ad = EventPool<zts_addr_info_t>::alloc();
+                if (! ad) {
+                    continue;
+                }
                 ad->net_id = n.tap->_net_id;
                 if ((*ip).isV4()) {
                     struct sockaddr_in* in4 = (struct sockaddr_in*)&(ad->addr);
@@ -627,21 +1061,84 @@ void NodeService::syncManagedStuff(NetworkState& n)
     n.managedIps.swap(newManagedIps);
 }
 
-void NodeService::phyOnDatagram(
-    PhySocket* sock,
-    void** uptr,
-    const struct sockaddr* localAddr,
-    const struct sockaddr* from,
-    void* data,
-    unsigned long len)
+// Lock order on the receive path: _nets_m, then VirtualTap::_rxInject_m (taken
+// by VirtualTap::flush() and put()), then the lwIP core lock. VirtualTap::_rxq_m
+// is only held briefly and never while taking another lock. Nothing that holds
+// the core lock may take any of the others.
+void NodeService::flushTaps()
 {
-    if (_forceTcpRelay) {
-        return;
+    Mutex::Lock _l(_nets_m);
+    for (std::map<uint64_t, NetworkState>::iterator n(_nets.begin()); n != _nets.end(); ++n) {
+        if (n->second.tap) {
+            n->second.tap->flush();
+        }
     }
-    ZTS_UNUSED_ARG(uptr);
-    ZTS_UNUSED_ARG(localAddr);
-    if ((len >= 16) && (reinterpret_cast<const InetAddress*>(from)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
-        _lastDirectReceiveFromGlobal = OSUtils::now();
+}
+
+void NodeService::flushTaps(const std::vector<uint64_t>& nets)
+{
+    Mutex::Lock _l(_nets_m);
+    for (size_t i = 0; i < nets.size(); i++) {
+        std::map<uint64_t, NetworkState>::iterator n(_nets.find(nets[i]));
+        if (n != _nets.end() && n->second.tap) {
+            n->second.tap->flush();
+        }
+    }
+}
+
+void NodeService::startRxWorkers()
+{
+    // CPUs the process may run on, which need not be the first ones
+    std::vector<int> cpus;
+#if defined(__linux__)
+    if (_pinRxThreads) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &allowed)) {
+                    cpus.push_back(c);
+                }
+            }
+        }
+        else {
+            fprintf(stderr, "WARNING: unable to read CPU affinity, receive threads are not pinned" ZT_EOL_S);
+        }
+    }
+#endif
+    for (unsigned int i = 0; i < _rxThreads; i++) {
+        RxWorker* w = new RxWorker(this);
+        if (! cpus.empty()) {
+            // Continue where the previous node left off, so that the workers
+            // of several nodes in one process do not share the same CPUs
+            w->cpu = cpus[_nextRxCpu++ % cpus.size()];
+        }
+        w->thread = Thread::start(w);
+        _rxWorkers.push_back(w);
+    }
+}
+
+void NodeService::stopRxWorkers()
+{
+    for (std::vector<RxWorker*>::iterator w(_rxWorkers.begin()); w != _rxWorkers.end(); ++w) {
+        (*w)->stop();
+        delete *w;
+    }
+    _rxWorkers.clear();
+}
+
+void NodeService::lowerBackgroundTaskDeadline(int64_t dl)
+{
+    int64_t cur = _nextBackgroundTaskDeadline.load();
+    while (dl < cur && ! _nextBackgroundTaskDeadline.compare_exchange_weak(cur, dl)) {
+    }
+}
+
+void NodeService::processWirePacket(PhySocket* sock, const struct sockaddr* from, const void* data, unsigned long len)
+{
+    // Called by the receive workers concurrently, each with its own copy of
+    // the deadline
+    volatile int64_t dl = _nextBackgroundTaskDeadline.load();
     const ZT_ResultCode rc = _node->processWirePacket(
         (void*)0,
         OSUtils::now(),
@@ -650,7 +1147,8 @@ void NodeService::phyOnDatagram(
                                                                   // it'll always be that big
         data,
         len,
-        &_nextBackgroundTaskDeadline);
+        &dl);
+    lowerBackgroundTaskDeadline(dl);
     if (ZT_ResultCode_isFatal(rc)) {
         char tmp[256] = { 0 };
         OSUtils::ztsnprintf(tmp, sizeof(tmp), "fatal error code from processWirePacket: %d", (int)rc);
@@ -661,6 +1159,127 @@ void NodeService::phyOnDatagram(
     }
 }
 
+void NodeService::markPeerChanged(uint64_t address)
+{
+    Mutex::Lock _l(_changedPeers_m);
+    _changedPeers.push_back(address);
+}
+
+void NodeService::markAllPeersChanged()
+{
+    Mutex::Lock _l(_changedPeers_m);
+    _allPeersChanged = true;
+}
+
+void NodeService::phyOnDatagram(
+    PhySocket* sock,
+    void** uptr,
+    const struct sockaddr* localAddr,
+    const struct sockaddr* from,
+    void* data,
+    unsigned long len)
+{
+    if (_forceTcpRelay) {
+        return;
+    }
+    ZTS_UNUSED_ARG(uptr);
+    ZTS_UNUSED_ARG(localAddr);
+    if ((len >= 16) && (reinterpret_cast<const InetAddress*>(from)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
+        _lastDirectReceiveFromGlobal = OSUtils::now();
+    if (_rxWorkers.empty() || len > ZT_MAX_PACKET_LENGTH) {
+        processWirePacket(sock, from, data, len);
+    }
+    else {
+        RxPacket* p = rx_packet_alloc();
+        p->sock = sock;
+        memcpy(&(p->from), from, sizeof(struct sockaddr_storage));
+        p->len = len;
+        memcpy(p->data, data, len);
+        dispatchRxPacket(p);
+    }
+    // Phy reads one datagram per call until the socket is empty. A second one
+    // from the same socket means more are queued, read the rest in batches.
+    // Draining after every datagram would cost an extra empty read each time
+    // traffic is light.
+    if (sock == _rxLastSock) {
+        drainUdpSocket(sock);
+    }
+    _rxLastSock = sock;
+}
+
+void NodeService::dispatchRxPacket(RxPacket* p)
+{
+    RxWorker* w = _rxWorkers[reinterpret_cast<const InetAddress*>(&(p->from))->hashCode() % _rxWorkers.size()];
+    if (w->depth.load(std::memory_order_relaxed) >= ZTS_RX_WORKER_QUEUE_MAX) {
+        rx_packet_free(p);   // Worker is saturated, drop like a full socket buffer would
+        return;
+    }
+    w->depth++;
+    w->q.enqueue(p);
+    w->wake();
+}
+
+void NodeService::drainUdpSocket(PhySocket* sock)
+{
+#if defined(__linux__)
+    // Phy hands us one datagram per recvfrom(), read whatever else is queued
+    // on the socket with as few calls as possible. Phy's next recvfrom() then
+    // finds the socket empty. Buffers hold ZT_MAX_PACKET_LENGTH bytes, larger
+    // datagrams are truncated and dropped as ZeroTier would not accept them.
+    const int fd = (int)_phy.getDescriptor(sock);
+    RxPacket* pkts[ZTS_RX_MMSG_BATCH];
+    struct iovec iov[ZTS_RX_MMSG_BATCH];
+    struct mmsghdr msgs[ZTS_RX_MMSG_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < ZTS_RX_MMSG_BATCH; i++) {
+        pkts[i] = rx_packet_alloc();
+    }
+    unsigned int total = 0;
+    while (total < ZTS_RX_MMSG_DRAIN_MAX) {
+        for (unsigned int i = 0; i < ZTS_RX_MMSG_BATCH; i++) {
+            iov[i].iov_base = pkts[i]->data;
+            iov[i].iov_len = sizeof(pkts[i]->data);
+            msgs[i].msg_hdr.msg_name = &(pkts[i]->from);
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            msgs[i].msg_hdr.msg_iov = &(iov[i]);
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_flags = 0;
+        }
+        const int n = recvmmsg(fd, msgs, ZTS_RX_MMSG_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            RxPacket* p = pkts[i];
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                continue;
+            }
+            p->sock = sock;
+            p->len = msgs[i].msg_len;
+            const InetAddress* from = reinterpret_cast<const InetAddress*>(&(p->from));
+            if ((p->len >= 16) && (from->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
+                _lastDirectReceiveFromGlobal = OSUtils::now();
+            if (_rxWorkers.empty()) {
+                processWirePacket(sock, (const struct sockaddr*)&(p->from), p->data, p->len);
+            }
+            else {
+                dispatchRxPacket(p);
+                pkts[i] = rx_packet_alloc();
+            }
+        }
+        total += (unsigned int)n;
+        if (n < ZTS_RX_MMSG_BATCH) {
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < ZTS_RX_MMSG_BATCH; i++) {
+        rx_packet_free(pkts[i]);
+    }
+#else
+    ZTS_UNUSED_ARG(sock);
+#endif
+}
+
 void NodeService::phyOnTcpConnect(PhySocket* sock, void** uptr, bool success)
 {
     if (! success) {
@@ -703,6 +1322,81 @@ void NodeService::phyOnTcpClose(PhySocket* sock, void** uptr)
     }
 }
 
+bool NodeService::processTunnelFrame(PhySocket* sock, const char* data, unsigned long mlen)
+{
+    InetAddress from;
+
+    unsigned long plen = mlen;   // payload length, modified if there's an IP header
+    if (plen == 4) {
+        // Hello message, which isn't sent by proxy and would be ignored by client
+    }
+    else if (plen) {
+        // Messages should contain IPv4 or IPv6 source IP address data
+        switch (data[0]) {
+            case 4:   // IPv4
+                if (plen >= 7) {
+                    from.set(
+                        (const void*)(data + 1),
+                        4,
+                        ((((unsigned int)data[5]) & 0xff) << 8) | (((unsigned int)data[6]) & 0xff));
+                    data += 7;   // type + 4 byte IP + 2 byte port
+                    plen -= 7;
+                }
+                else {
+                    _phy.close(sock);
+                    return false;
+                }
+                break;
+            case 6:   // IPv6
+                if (plen >= 19) {
+                    from.set(
+                        (const void*)(data + 1),
+                        16,
+                        ((((unsigned int)data[17]) & 0xff) << 8) | (((unsigned int)data[18]) & 0xff));
+                    data += 19;   // type + 16 byte IP + 2 byte port
+                    plen -= 19;
+                }
+                else {
+                    _phy.close(sock);
+                    return false;
+                }
+                break;
+            case 0:   // none/omitted
+                ++data;
+                --plen;
+                break;
+            default:   // invalid address type
+                _phy.close(sock);
+                return false;
+        }
+
+        if (from) {
+            InetAddress fakeTcpLocalInterfaceAddress((uint32_t)0xffffffff, 0xffff);
+            volatile int64_t dl = _nextBackgroundTaskDeadline.load();
+            const ZT_ResultCode rc = _node->processWirePacket(
+                (void*)0,
+                OSUtils::now(),
+                -1,
+                reinterpret_cast<struct sockaddr_storage*>(&from),
+                data,
+                plen,
+                &dl);
+            lowerBackgroundTaskDeadline(dl);
+            if (ZT_ResultCode_isFatal(rc)) {
+                char tmp[256];
+                OSUtils::ztsnprintf(tmp, sizeof(tmp), "fatal error code from processWirePacket: %d", (int)rc);
+                Mutex::Lock _l(_termReason_m);
+                _termReason = ONE_UNRECOVERABLE_ERROR;
+                _fatalErrorMessage = tmp;
+                this->terminate();
+                _phy.close(sock);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 void NodeService::phyOnTcpData(PhySocket* sock, void** uptr, void* data, unsigned long len)
 {
     try {
@@ -716,100 +1410,36 @@ void NodeService::phyOnTcpData(PhySocket* sock, void** uptr, void* data, unsigne
             case TcpConnection::TCP_HTTP_INCOMING:
             case TcpConnection::TCP_HTTP_OUTGOING:
                 break;
-            case TcpConnection::TCP_TUNNEL_OUTGOING:
-                tc->readq.append((const char*)data, len);
-                while (tc->readq.length() >= 5) {
-                    const char* data = tc->readq.data();
-                    const unsigned long mlen =
-                        (((((unsigned long)data[3]) & 0xff) << 8) | (((unsigned long)data[4]) & 0xff));
-                    if (tc->readq.length() >= (mlen + 5)) {
-                        InetAddress from;
-
-                        unsigned long plen = mlen;   // payload length, modified if there's an IP header
-                        data += 5;                   // skip forward past pseudo-TLS junk and mlen
-                        if (plen == 4) {
-                            // Hello message, which isn't sent by proxy and would be ignored by client
-                        }
-                        else if (plen) {
-                            // Messages should contain IPv4 or IPv6 source IP address data
-                            switch (data[0]) {
-                                case 4:   // IPv4
-                                    if (plen >= 7) {
-                                        from.set(
-                                            (const void*)(data + 1),
-                                            4,
-                                            ((((unsigned int)data[5]) & 0xff) << 8) | (((unsigned int)data[6]) & 0xff));
-                                        data += 7;   // type + 4 byte IP + 2 byte port
-                                        plen -= 7;
-                                    }
-                                    else {
-                                        _phy.close(sock);
-                                        return;
-                                    }
-                                    break;
-                                case 6:   // IPv6
-                                    if (plen >= 19) {
-                                        from.set(
-                                            (const void*)(data + 1),
-                                            16,
-                                            ((((unsigned int)data[17]) & 0xff) << 8)
-                                                | (((unsigned int)data[18]) & 0xff));
-                                        data += 19;   // type + 16 byte IP + 2 byte port
-                                        plen -= 19;
-                                    }
-                                    else {
-                                        _phy.close(sock);
-                                        return;
-                                    }
-                                    break;
-                                case 0:   // none/omitted
-                                    ++data;
-                                    --plen;
-                                    break;
-                                default:   // invalid address type
-                                    _phy.close(sock);
-                                    return;
-                            }
-
-                            if (from) {
-                                InetAddress fakeTcpLocalInterfaceAddress((uint32_t)0xffffffff, 0xffff);
-                                const ZT_ResultCode rc = _node->processWirePacket(
-                                    (void*)0,
-                                    OSUtils::now(),
-                                    -1,
-                                    reinterpret_cast<struct sockaddr_storage*>(&from),
-                                    data,
-                                    plen,
-                                    &_nextBackgroundTaskDeadline);
-                                if (ZT_ResultCode_isFatal(rc)) {
-                                    char tmp[256];
-                                    OSUtils::ztsnprintf(
-                                        tmp,
-                                        sizeof(tmp),
-                                        "fatal error code from processWirePacket: %d",
-                                        (int)rc);
-                                    Mutex::Lock _l(_termReason_m);
-                                    _termReason = ONE_UNRECOVERABLE_ERROR;
-                                    _fatalErrorMessage = tmp;
-                                    this->terminate();
-                                    _phy.close(sock);
-                                    return;
-                                }
-                            }
-                        }
-
-                        if (tc->readq.length() > (mlen + 5)) {
-                            tc->readq.erase(tc->readq.begin(), tc->readq.begin() + (mlen + 5));
-                        }
-                        else {
-                            tc->readq.clear();
+            case TcpConnection::TCP_TUNNEL_OUTGOING: {
+                const char* p = (const char*)data;
+                // Complete the frame left over from the previous read
+                while (tc->readq.length() > 0 && len > 0) {
+                    const unsigned long need = (tc->readq.length() < 5) ? 5 : tunnel_frame_length(tc->readq.data());
+                    const unsigned long n = std::min(need - tc->readq.length(), len);
+                    tc->readq.append(p, n);
+                    p += n;
+                    len -= n;
+                    if (tc->readq.length() == need && need == tunnel_frame_length(tc->readq.data())) {
+                        if (! processTunnelFrame(sock, tc->readq.data() + 5, need - 5)) {
+                            return;
                         }
+                        tc->readq.clear();
                     }
-                    else {
-                        break;
+                }
+                // Frames received whole are processed where they are
+                while (len >= 5 && len >= tunnel_frame_length(p)) {
+                    const unsigned long flen = tunnel_frame_length(p);
+                    if (! processTunnelFrame(sock, p + 5, flen - 5)) {
+                        return;
                     }
+                    p += flen;
+                    len -= flen;
+                }
+                if (len > 0) {
+                    tc->readq.assign(p, len);
                 }
                 return;
+            }
         }
     }
     catch (...) {
@@ -823,16 +1453,16 @@ void NodeService::phyOnTcpWritable(PhySocket* sock, void** uptr)
     bool closeit = false;
     {
         Mutex::Lock _l(tc->writeq_m);
-        if (tc->writeq.length() > 0) {
-            long sent = (long)_phy.streamSend(sock, tc->writeq.data(), (unsigned long)tc->writeq.length(), true);
+        if (tc->writeq.size() > 0) {
+            long sent = stream_send_queued(_phy, sock, tc->writeq);
             if (sent > 0) {
-                if ((unsigned long)sent >= (unsigned long)tc->writeq.length()) {
-                    tc->writeq.clear();
+                tc->writeq.consume((unsigned long)sent);
+                if (tc->writeq.size() == 0) {
                     _phy.setNotifyWritable(sock, false);
                 }
-                else {
-                    tc->writeq.erase(tc->writeq.begin(), tc->writeq.begin() + sent);
-                }
+            }
+            else if (sent < 0) {
+                closeit = true;
             }
         }
         else {
@@ -852,6 +1482,8 @@ int NodeService::nodeVirtualNetworkConfigFunction(
 {
     Mutex::Lock _l(_nets_m);
     NetworkState& n = _nets[net_id];
+    // Joining or leaving a network may change the peers we talk to
+    markAllPeersChanged();
 
     switch (op) {
         case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_UP:
@@ -925,9 +1557,11 @@ void NodeService::nodeEventCallback(enum ZT_Event event, const void* metaData)
             break;
         case ZT_EVENT_ONLINE:
             event_code = ZTS_EVENT_NODE_ONLINE;
+            markAllPeersChanged();
             break;
         case ZT_EVENT_OFFLINE:
             event_code = ZTS_EVENT_NODE_OFFLINE;
+            markAllPeersChanged();
             break;
         case ZT_EVENT_DOWN:
             event_code = ZTS_EVENT_NODE_DOWN;
@@ -966,7 +1600,9 @@ void NodeService::sendEventToUser(unsigned int zt_event_code, const void* obj, u
         case ZTS_EVENT_NODE_OFFLINE:
         case ZTS_EVENT_NODE_DOWN:
         case ZTS_EVENT_NODE_FATAL_ERROR: {
-            nd = new zts_node_info_t;
+            if (! (nd = EventPool<zts_node_info_t>::alloc())) {
+                return;
+            }
             nd->node_id = _nodeId;
             nd->ver_major = ZEROTIER_ONE_VERSION_MAJOR;
             nd->ver_minor = ZEROTIER_ONE_VERSION_MINOR;
@@ -983,7 +1619,9 @@ void NodeService::sendEventToUser(unsigned int zt_event_code, const void* obj, u
         case ZTS_EVENT_NETWORK_ACCESS_DENIED:
         case ZTS_EVENT_NETWORK_DOWN: {
             NetworkState* ns = (NetworkState*)obj;
-            nt = new zts_net_info_t();
+            if (! (nt = EventPool<zts_net_info_t>::alloc())) {
+                return;
+            }
             nt->net_id = ns->config.nwid;
             objptr = (void*)nt;
             break;
@@ -993,7 +1631,9 @@ void NodeService::sendEventToUser(unsigned int zt_event_code, const void* obj, u
         case ZTS_EVENT_NETWORK_READY_IP6:
         case ZTS_EVENT_NETWORK_OK: {
             NetworkState* ns = (NetworkState*)obj;
-            nt = new zts_net_info_t();
+            if (! (nt = EventPool<zts_net_info_t>::alloc())) {
+                return;
+            }
             nt->net_id = ns->config.nwid;
             nt->mac = ns->config.mac;
             strncpy(nt->name, ns->config.name, sizeof(ns->config.name));
@@ -1054,7 +1694,9 @@ void NodeService::sendEventToUser(unsigned int zt_event_code, const void* obj, u
         case ZTS_EVENT_PEER_UNREACHABLE:
         case ZTS_EVENT_PEER_PATH_DISCOVERED:
         case ZTS_EVENT_PEER_PATH_DEAD: {
-            pr = new zts_peer_info_t();
+            if (! (pr = EventPool<zts_peer_info_t>::alloc())) {
+                return;
+            }
             ZT_Peer* peer = (ZT_Peer*)obj;
             memcpy(pr, peer, sizeof(zts_peer_info_t));
             for (unsigned int j = 0; j < peer->pathCount; j++) {
@@ -1070,61 +1712,46 @@ void NodeService::sendEventToUser(unsigned int zt_event_code, const void* obj, u
     // Send event
 
     if (objptr) {
-        if (!_events->enqueue(zt_event_code, objptr, len)) {
+        if (! _events->enqueue(zt_event_code, objptr, len)) {
             //
-            // ownership of objptr was NOT transferred, so delete any news from above
+            // ownership of objptr was NOT transferred, so return anything
+            // taken from the pools above
             //
             switch (zt_event_code) {
                 case ZTS_EVENT_NODE_UP:
                 case ZTS_EVENT_NODE_ONLINE:
                 case ZTS_EVENT_NODE_OFFLINE:
                 case ZTS_EVENT_NODE_DOWN:
-                case ZTS_EVENT_NODE_FATAL_ERROR: {
-                    delete nd;
+                case ZTS_EVENT_NODE_FATAL_ERROR:
+                    EventPool<zts_node_info_t>::release(nd);
                     break;
-                }
                 case ZTS_EVENT_NETWORK_NOT_FOUND:
                 case ZTS_EVENT_NETWORK_CLIENT_TOO_OLD:
                 case ZTS_EVENT_NETWORK_REQ_CONFIG:
                 case ZTS_EVENT_NETWORK_ACCESS_DENIED:
-                case ZTS_EVENT_NETWORK_DOWN: {
-                    delete nt;
-                    break;
-                }
+                case ZTS_EVENT_NETWORK_DOWN:
                 case ZTS_EVENT_NETWORK_UPDATE:
                 case ZTS_EVENT_NETWORK_READY_IP4:
                 case ZTS_EVENT_NETWORK_READY_IP6:
-                case ZTS_EVENT_NETWORK_OK: {
-                    delete nt;
+                case ZTS_EVENT_NETWORK_OK:
+                    EventPool<zts_net_info_t>::release(nt);
                     break;
-                }
                 case ZTS_EVENT_ADDR_ADDED_IP4:
-                    break;
                 case ZTS_EVENT_ADDR_ADDED_IP6:
-                    break;
                 case ZTS_EVENT_ADDR_REMOVED_IP4:
-                    break;
                 case ZTS_EVENT_ADDR_REMOVED_IP6:
-                    break;
-                case ZTS_EVENT_STORE_IDENTITY_PUBLIC:
-                    break;
-                case ZTS_EVENT_STORE_IDENTITY_SECRET:
-                    break;
-                case ZTS_EVENT_STORE_PLANET:
-                    break;
-                case ZTS_EVENT_STORE_PEER:
-                    break;
-                case ZTS_EVENT_STORE_NETWORK:
+                    // Allocated by syncManagedStuff() and handed to us
+                    EventPool<zts_addr_info_t>::release((zts_addr_info_t*)objptr);
                     break;
                 case ZTS_EVENT_PEER_DIRECT:
                 case ZTS_EVENT_PEER_RELAY:
                 case ZTS_EVENT_PEER_UNREACHABLE:
                 case ZTS_EVENT_PEER_PATH_DISCOVERED:
-                case ZTS_EVENT_PEER_PATH_DEAD: {
-                    delete pr;
+                case ZTS_EVENT_PEER_PATH_DEAD:
+                    EventPool<zts_peer_info_t>::release(pr);
                     break;
-                }
                 default:
+                    // Store events point at data owned by the caller
                     break;
             }
         }
@@ -1141,7 +1768,7 @@ void NodeService::generateSyntheticEvents()
     // Generate messages to be dequeued by the callback message thread
     Mutex::Lock _l(_nets_m);
     for (std::map<uint64_t, NetworkState>::iterator n(_nets.begin()); n != _nets.end(); ++n) {
-        auto netState = n->second;
+        NetworkState& netState = n->second;
         int mostRecentStatus = netState.config.status;
         VirtualTap* tap = netState.tap;
         // uint64_t net_id = n->first;
@@ -1176,34 +1803,69 @@ void NodeService::generateSyntheticEvents()
         }
         netState.tap->_networkStatus = mostRecentStatus;
     }
+    // A path is only learned after nodePathCheckFunction() approved it. A
+    // peer that is checked before it has learned its new path is looked at
+    // once more after the core next runs its background tasks. Expired paths
+    // are found by the periodic sweep of all peers.
+    std::vector<uint64_t> changed;
+    bool all;
+    {
+        Mutex::Lock _l(_changedPeers_m);
+        changed.swap(_changedPeers);
+        all = _allPeersChanged;
+        _allPeersChanged = false;
+    }
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    std::vector<uint64_t> recheck;
+    if (_recheckDue) {
+        recheck.swap(_recheckPeers);
+        _recheckDue = false;
+    }
+    _recheckPeers.insert(_recheckPeers.end(), changed.begin(), changed.end());
+    if (! recheck.empty()) {
+        changed.insert(changed.end(), recheck.begin(), recheck.end());
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    }
+    if (! all && changed.empty()) {
+        return;
+    }
     ZT_PeerList* pl = _node->peers();
     if (pl) {
         for (unsigned long i = 0; i < pl->peerCount; ++i) {
-            if (! peerCache.count(pl->peers[i].address)) {
+            if (! all && ! std::binary_search(changed.begin(), changed.end(), pl->peers[i].address)) {
+                continue;
+            }
+            const long cached = peerCache.get(pl->peers[i].address);
+            const long pathCount = (long)pl->peers[i].pathCount;
+            if (cached < 0) {
                 // New peer, add status
-                if (pl->peers[i].pathCount > 0) {
+                if (pathCount > 0) {
                     sendEventToUser(ZTS_EVENT_PEER_DIRECT, (void*)&(pl->peers[i]));
                 }
-                if (pl->peers[i].pathCount == 0) {
+                if (pathCount == 0) {
                     sendEventToUser(ZTS_EVENT_PEER_RELAY, (void*)&(pl->peers[i]));
                 }
             }
-            else {   // Previously known peer, update status
-                if (peerCache[pl->peers[i].address] < pl->peers[i].pathCount) {
+            else if (cached != pathCount) {   // Previously known peer, update status
+                if (cached < pathCount) {
                     sendEventToUser(ZTS_EVENT_PEER_PATH_DISCOVERED, (void*)&(pl->peers[i]));
                 }
-                if (peerCache[pl->peers[i].address] > pl->peers[i].pathCount) {
+                if (cached > pathCount) {
                     sendEventToUser(ZTS_EVENT_PEER_PATH_DEAD, (void*)&(pl->peers[i]));
                 }
-                if (peerCache[pl->peers[i].address] == 0 && pl->peers[i].pathCount > 0) {
+                if (cached == 0 && pathCount > 0) {
                     sendEventToUser(ZTS_EVENT_PEER_DIRECT, (void*)&(pl->peers[i]));
                 }
-                if (peerCache[pl->peers[i].address] > 0 && pl->peers[i].pathCount == 0) {
+                if (cached > 0 && pathCount == 0) {
                     sendEventToUser(ZTS_EVENT_PEER_RELAY, (void*)&(pl->peers[i]));
                 }
             }
-            // Update our cache with most recently observed path count
-            peerCache[pl->peers[i].address] = pl->peers[i].pathCount;
+            if (cached != pathCount) {
+                // Update our cache with most recently observed path count
+                peerCache.set(pl->peers[i].address, pl->peers[i].pathCount);
+            }
         }
     }
     _node->freeQueryResult((void*)pl);
@@ -1528,10 +2190,9 @@ void NodeService::nodeStatePutFunction(
     enum ZT_StateObjectType type,
     const uint64_t id[2],
     const void* data,
-    unsigned int len)
+    int len)
 {
     char p[1024] = { 0 };
-    FILE* f;
     bool secure = false;
     char dirname[1024] = { 0 };
     dirname[0] = 0;
@@ -1542,7 +2203,7 @@ void NodeService::nodeStatePutFunction(
         case ZT_STATE_OBJECT_IDENTITY_PUBLIC:
             sendEventToUser(ZTS_EVENT_STORE_IDENTITY_PUBLIC, data, len);
             memcpy(_publicIdStr, data, len);
-            if (_homePath.length() > 0 && _allowIdentityCaching) {
+            if (hasStorage() && _allowIdentityCaching) {
                 OSUtils::ztsnprintf(p, sizeof(p), "%s" ZT_PATH_SEPARATOR_S "identity.public", _homePath.c_str());
             }
             else {
@@ -1552,7 +2213,7 @@ void NodeService::nodeStatePutFunction(
         case ZT_STATE_OBJECT_IDENTITY_SECRET:
             sendEventToUser(ZTS_EVENT_STORE_IDENTITY_SECRET, data, len);
             memcpy(_secretIdStr, data, len);
-            if (_homePath.length() > 0 && _allowIdentityCaching) {
+            if (hasStorage() && _allowIdentityCaching) {
                 OSUtils::ztsnprintf(p, sizeof(p), "%s" ZT_PATH_SEPARATOR_S "identity.secret", _homePath.c_str());
                 secure = true;
             }
@@ -1563,7 +2224,7 @@ void NodeService::nodeStatePutFunction(
         case ZT_STATE_OBJECT_PLANET:
             sendEventToUser(ZTS_EVENT_STORE_PLANET, data, len);
             memcpy(_rootsData, data, len);
-            if (_homePath.length() > 0 && _allowRootSetCaching) {
+            if (hasStorage() && _allowRootSetCaching) {
                 OSUtils::ztsnprintf(p, sizeof(p), "%s" ZT_PATH_SEPARATOR_S "roots", _homePath.c_str());
             }
             else {
@@ -1571,7 +2232,7 @@ void NodeService::nodeStatePutFunction(
             }
             break;
         case ZT_STATE_OBJECT_NETWORK_CONFIG:
-            if (_homePath.length() > 0 && _allowNetworkCaching) {
+            if (hasStorage() && _allowNetworkCaching) {
                 OSUtils::ztsnprintf(dirname, sizeof(dirname), "%s" ZT_PATH_SEPARATOR_S "networks.d", _homePath.c_str());
                 OSUtils::ztsnprintf(
                     p,
@@ -1586,7 +2247,7 @@ void NodeService::nodeStatePutFunction(
             }
             break;
         case ZT_STATE_OBJECT_PEER:
-            if (_homePath.length() > 0 && _allowPeerCaching) {
+            if (hasStorage() && _allowPeerCaching) {
                 OSUtils::ztsnprintf(dirname, sizeof(dirname), "%s" ZT_PATH_SEPARATOR_S "peers.d", _homePath.c_str());
                 OSUtils::ztsnprintf(
                     p,
@@ -1603,47 +2264,33 @@ void NodeService::nodeStatePutFunction(
             return;
     }
 
-    if (len >= 0) {
-        // Check to see if we've already written this first. This reduces
-        // redundant writes and I/O overhead on most platforms and has
-        // little effect on others.
-        f = fopen(p, "rb");
-        if (f) {
-            char buf[65535] = { 0 };
-            long l = (long)fread(buf, 1, sizeof(buf), f);
-            fclose(f);
-            if ((l == (long)len) && (memcmp(data, buf, l) == 0)) {
-                return;
-            }
+    if (_userStore.get) {
+        const UserStoreKey k = { (int)type, { id[0], id[1] } };
+        Mutex::Lock _lu(_userStore_m);
+        UserStorePending& obj = _userStorePending[k];
+        obj.removed = (len < 0);
+        if (len >= 0) {
+            obj.data.assign((const char*)data, len);
         }
-
-        f = fopen(p, "wb");
-        if ((! f) && (dirname[0])) {   // create subdirectory if it does not exist
-            OSUtils::mkdir(dirname);
-            f = fopen(p, "wb");
+        else {
+            obj.data.clear();
         }
-        if (f) {
-            if (fwrite(data, len, 1, f) != 1)
-                fprintf(
-                    stderr,
-                    "WARNING: unable to write to file: %s (I/O "
-                    "error)" ZT_EOL_S,
-                    p);
-            fclose(f);
-            if (secure) {
-                OSUtils::lockDownFile(p, false);
-            }
+        return;
+    }
+    if (_stateDB.isOpen()) {
+        if (len >= 0) {
+            _stateStore.put(type, id, data, (unsigned int)len);
         }
         else {
-            fprintf(
-                stderr,
-                "WARNING: unable to write to file: %s (unable to "
-                "open)" ZT_EOL_S,
-                p);
+            _stateStore.remove(type, id);
         }
+        return;
+    }
+    if (len >= 0) {
+        _stateStore.put(p, dirname, data, (unsigned int)len, secure);
     }
     else {
-        OSUtils::rm(p);
+        _stateStore.remove(p);
     }
 }
 
@@ -1702,9 +2349,40 @@ int NodeService::nodeStateGetFunction(
         default:
             return -1;
     }
+    if (_userStore.get) {
+        {
+            const UserStoreKey k = { (int)type, { id[0], id[1] } };
+            Mutex::Lock _lu(_userStore_m);
+            std::map<UserStoreKey, UserStorePending>::const_iterator obj(_userStorePending.find(k));
+            if (obj != _userStorePending.end()) {
+                if (obj->second.removed) {
+                    return -1;
+                }
+                const unsigned int len =
+                    (obj->second.data.length() < maxlen) ? (unsigned int)obj->second.data.length() : maxlen;
+                memcpy(data, obj->second.data.data(), len);
+                return (int)len;
+            }
+        }
+        return _userStore.get(_userStore.arg, (int)type, id, data, maxlen);
+    }
+    int n = -1;
+    if (_stateDB.isOpen()) {
+        if (_stateStore.get(type, id, data, maxlen, n)) {
+            return n;
+        }
+        // Objects not in the database yet are read from files written before it was enabled
+        n = _stateDB.get(type, id, data, maxlen);
+        if (n >= 0) {
+            return n;
+        }
+    }
+    if (_stateStore.get(p, data, maxlen, n)) {
+        return n;
+    }
     FILE* f = fopen(p, "rb");
     if (f) {
-        int n = (int)fread(data, 1, maxlen, f);
+        n = (int)fread(data, 1, maxlen, f);
         fclose(f);
         if (n >= 0) {
             return n;
@@ -1736,27 +2414,25 @@ int NodeService::nodeWirePacketSendFunction(
                         bool flushNow = false;
                         {
                             Mutex::Lock _l(_tcpFallbackTunnel->writeq_m);
-                            if (_tcpFallbackTunnel->writeq.size() < (1024 * 64)) {
-                                if (_tcpFallbackTunnel->writeq.length() == 0) {
+                            StreamBuffer& writeq = _tcpFallbackTunnel->writeq;
+                            const unsigned long mlen = len + 7;
+                            if ((writeq.size() < (ZTS_TCP_TUNNEL_WRITEQ_SIZE / 2)) && (writeq.space() >= (mlen + 5))) {
+                                if (writeq.size() == 0) {
                                     _phy.setNotifyWritable(_tcpFallbackTunnel->sock, true);
                                     flushNow = true;
                                 }
-                                const unsigned long mlen = len + 7;
-                                _tcpFallbackTunnel->writeq.push_back((char)0x17);
-                                _tcpFallbackTunnel->writeq.push_back((char)0x03);
-                                _tcpFallbackTunnel->writeq.push_back((char)0x03);   // fake TLS 1.2 header
-                                _tcpFallbackTunnel->writeq.push_back((char)((mlen >> 8) & 0xff));
-                                _tcpFallbackTunnel->writeq.push_back((char)(mlen & 0xff));
-                                _tcpFallbackTunnel->writeq.push_back((char)4);   // IPv4
-                                _tcpFallbackTunnel->writeq.append(
-                                    reinterpret_cast<const char*>(reinterpret_cast<const void*>(
-                                        &(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr.s_addr))),
-                                    4);
-                                _tcpFallbackTunnel->writeq.append(
-                                    reinterpret_cast<const char*>(reinterpret_cast<const void*>(
-                                        &(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_port))),
-                                    2);
-                                _tcpFallbackTunnel->writeq.append((const char*)data, len);
+                                char hdr[12];
+                                hdr[0] = (char)0x17;
+                                hdr[1] = (char)0x03;
+                                hdr[2] = (char)0x03;   // fake TLS 1.2 header
+                                hdr[3] = (char)((mlen >> 8) & 0xff);
+                                hdr[4] = (char)(mlen & 0xff);
+                                hdr[5] = (char)4;   // IPv4
+                                const struct sockaddr_in* sin = reinterpret_cast<const struct sockaddr_in*>(addr);
+                                memcpy(hdr + 6, &(sin->sin_addr.s_addr), 4);
+                                memcpy(hdr + 10, &(sin->sin_port), 2);
+                                writeq.append(hdr, sizeof(hdr));
+                                writeq.append(data, len);
                             }
                         }
                         if (flushNow) {
@@ -1798,6 +2474,12 @@ int NodeService::nodeWirePacketSendFunction(
     // proxy fallback, which is slow.
 
     if ((localSocket != -1) && (localSocket != 0) && (_binder.isUdpSocketValid((PhySocket*)((uintptr_t)localSocket)))) {
+        if (tx_batch_queue((int)_phy.getDescriptor((PhySocket*)((uintptr_t)localSocket)), addr, data, len, ttl)) {
+            return 0;
+        }
+        // The TTL is a socket option, so no other thread may send on the
+        // socket between setting and restoring it
+        Mutex::Lock _l(_udpSend_m);
         if ((ttl) && (addr->ss_family == AF_INET))
             _phy.setIp4UdpTtl((PhySocket*)((uintptr_t)localSocket), ttl);
         const bool r = _phy.udpSend((PhySocket*)((uintptr_t)localSocket), (const struct sockaddr*)addr, data, len);
@@ -1806,6 +2488,7 @@ int NodeService::nodeWirePacketSendFunction(
         return ((r) ? 0 : -1);
     }
     else {
+        Mutex::Lock _l(_udpSend_m);
         return ((_binder.udpSendAll(_phy, addr, data, len, ttl)) ? 0 : -1);
     }
 }
@@ -1821,12 +2504,15 @@ void NodeService::nodeVirtualNetworkFrameFunction(
     unsigned int len)
 {
     ZTS_UNUSED_ARG(vlanId);
-    ZTS_UNUSED_ARG(net_id);
     NetworkState* n = reinterpret_cast<NetworkState*>(*nuptr);
     if ((! n) || (! n->tap)) {
         return;
     }
     n->tap->put(MAC(sourceMac), MAC(destMac), etherType, data, len);
+    std::vector<uint64_t>* touched = _rxTouchedNets;
+    if (touched && std::find(touched->begin(), touched->end(), net_id) == touched->end()) {
+        touched->push_back(net_id);
+    }
 }
 
 int NodeService::nodePathCheckFunction(
@@ -1835,6 +2521,8 @@ int NodeService::nodePathCheckFunction(
     const struct sockaddr_storage* remoteAddr)
 {
     ZTS_UNUSED_ARG(localSocket);
+    // The peer is about to learn a path if this approves it
+    markPeerChanged(ztaddr);
     // Make sure we're not trying to do ZeroTier-over-ZeroTier
     {
         Mutex::Lock _l(_nets_m);
@@ -1923,6 +2611,7 @@ void NodeService::tapFrameHandler(
     const void* data,
     unsigned int len)
 {
+    volatile int64_t dl = _nextBackgroundTaskDeadline.load();
     _node->processVirtualNetworkFrame(
         (void*)0,
         OSUtils::now(),
@@ -1933,7 +2622,8 @@ void NodeService::tapFrameHandler(
         vlanId,
         data,
         len,
-        &_nextBackgroundTaskDeadline);
+        &dl);
+    lowerBackgroundTaskDeadline(dl);
 }
 
 int NodeService::shouldBindInterface(const char* ifname, const InetAddress& ifaddr)
@@ -2122,6 +2812,129 @@ int NodeService::allowPortMapping(unsigned int allowed)
     return ZTS_ERR_OK;
 }
 
+int NodeService::setRxThreads(unsigned int count)
+{
+    Mutex::Lock _lr(_run_m);
+    if (_run) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (count > ZTS_RX_THREADS_MAX) {
+        return ZTS_ERR_ARG;
+    }
+    _rxThreads = count;
+    return ZTS_ERR_OK;
+}
+
+int NodeService::setRxThreadAffinity(bool enabled)
+{
+    Mutex::Lock _lr(_run_m);
+    if (_run) {
+        return ZTS_ERR_SERVICE;
+    }
+    _pinRxThreads = enabled;
+    return ZTS_ERR_OK;
+}
+
+int NodeService::setStateDB(bool enabled)
+{
+    Mutex::Lock _lr(_run_m);
+    if (_run) {
+        return ZTS_ERR_SERVICE;
+    }
+    _useStateDB = enabled;
+    return ZTS_ERR_OK;
+}
+
+int NodeService::setStateStore(const zts_state_store_t* store)
+{
+    Mutex::Lock _lr(_run_m);
+    if (_run) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! store) {
+        memset(&_userStore, 0, sizeof(_userStore));
+        return ZTS_ERR_OK;
+    }
+    if (! store->get || ! store->put || ! store->del) {
+        return ZTS_ERR_ARG;
+    }
+    _userStore = *store;
+    return ZTS_ERR_OK;
+}
+
+bool NodeService::migrateNetworksToStateDB()
+{
+    const uint64_t markerId[2] = { 0, 0 };
+    char marker = 1;
+    if (_stateDB.get(ZTS_STATE_DB_MIGRATED, markerId, &marker, 1) >= 0) {
+        return true;
+    }
+    // Written directly rather than through _stateStore, the import has to be
+    // complete before the marker is
+    const std::string networksDotD(_homePath + ZT_PATH_SEPARATOR_S "networks.d");
+    std::vector<std::string> files(OSUtils::listDirectory(networksDotD.c_str()));
+    for (std::vector<std::string>::iterator f(files.begin()); f != files.end(); ++f) {
+        std::size_t dot = f->find_last_of('.');
+        if ((dot != 16) || (f->substr(16) != ".conf")) {
+            continue;
+        }
+        std::string conf;
+        if (! OSUtils::readFile((networksDotD + ZT_PATH_SEPARATOR_S + *f).c_str(), conf)) {
+            return false;
+        }
+        const uint64_t id[2] = { Utils::hexStrToU64(f->substr(0, dot).c_str()), 0 };
+        if (! _stateDB.put(ZT_STATE_OBJECT_NETWORK_CONFIG, id, conf.data(), (unsigned int)conf.length())) {
+            return false;
+        }
+    }
+    return _stateDB.put(ZTS_STATE_DB_MIGRATED, markerId, &marker, 1);
+}
+
+void NodeService::flushUserStore()
+{
+    if (! _userStore.get) {
+        return;
+    }
+    Mutex::Lock _lu(_userStore_m);
+    if (_userStorePending.empty()) {
+        return;
+    }
+    std::vector<zts_state_object_t> puts;
+    for (std::map<UserStoreKey, UserStorePending>::const_iterator i(_userStorePending.begin());
+         i != _userStorePending.end();
+         ++i) {
+        if (i->second.removed) {
+            _userStore.del(_userStore.arg, i->first.type, i->first.id);
+        }
+        else if (_userStore.put_batch) {
+            zts_state_object_t obj;
+            obj.type = i->first.type;
+            obj.id[0] = i->first.id[0];
+            obj.id[1] = i->first.id[1];
+            obj.data = i->second.data.data();
+            obj.len = (unsigned int)i->second.data.length();
+            puts.push_back(obj);
+        }
+        else {
+            _userStore.put(
+                _userStore.arg,
+                i->first.type,
+                i->first.id,
+                i->second.data.data(),
+                (unsigned int)i->second.data.length());
+        }
+    }
+    if (! puts.empty()) {
+        _userStore.put_batch(_userStore.arg, puts.data(), (unsigned int)puts.size());
+    }
+    _userStorePending.clear();
+}
+
+bool NodeService::hasStorage() const
+{
+    return (_homePath.length() > 0) || (_userStore.get != NULL);
+}
+
 int NodeService::allowSecondaryPort(unsigned int allowed)
 {
     Mutex::Lock _lr(_run_m);
@@ -25,11 +25,17 @@
 #include "Binder.hpp"
 #include "Mutex.hpp"
 #include "Node.hpp"
+#include "PeerCache.hpp"
 #include "Phy.hpp"
 #include "PortMapper.hpp"
+#include "StateDB.hpp"
+#include "StateStore.hpp"
+#include "StreamBuffer.hpp"
 #include "ZeroTierSockets.h"
 #include "version.h"
 
+#include <atomic>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -47,6 +53,13 @@
 // Attempt to engage TCP fallback after this many ms of no reply to packets sent to global-scope IPs
 #define ZT_TCP_FALLBACK_AFTER 30000
 
+// Upper bound for the number of threads processing received wire packets
+#define ZTS_RX_THREADS_MAX 64
+
+// Capacity of a TCP tunnel's send queue, must be a power of two. New frames are
+// only queued while less than half of it is in use.
+#define ZTS_TCP_TUNNEL_WRITEQ_SIZE 131072
+
 // Fake TLS hello for TCP tunnel outgoing connections (TUNNELED mode)
 static const char ZT_TCP_TUNNEL_HELLO[9] = { 0x17,
                                              0x03,
@@ -69,6 +82,8 @@ struct InetAddress;
 class VirtualTap;
 class MAC;
 class Events;
+struct RxWorker;
+struct RxPacket;
 
 /**
  * A TCP connection and related state and buffers
@@ -86,8 +101,13 @@ struct TcpConnection {
     InetAddress remoteAddr;
     uint64_t lastReceive;
 
+    TcpConnection() : writeq(ZTS_TCP_TUNNEL_WRITEQ_SIZE)
+    {
+    }
+
+    // Incomplete frame carried over from the previous read
     std::string readq;
-    std::string writeq;
+    StreamBuffer writeq;
     Mutex writeq_m;
 };
 
@@ -163,7 +183,17 @@ class NodeService {
 
     volatile unsigned int _udpPortPickerCounter;
 
-    std::map<uint64_t, unsigned int> peerCache;
+    /** Path count of each peer as of the last scan for peer events */
+    PeerCache peerCache;
+    /** Peers that may have learned a path since peer events were last generated */
+    Mutex _changedPeers_m;
+    std::vector<uint64_t> _changedPeers;
+    /** Set on events that may change the paths of every peer, guarded by _changedPeers_m */
+    bool _allPeersChanged;
+    /** Peers to look at again once the core's background tasks have run. Service thread only */
+    std::vector<uint64_t> _recheckPeers;
+    /** Set when the core's background tasks have run. Service thread only */
+    bool _recheckDue;
 
     // Local configuration and memo-ized information from it
     Hashtable<uint64_t, std::vector<InetAddress> > _v4Hints;
@@ -211,8 +241,13 @@ class NodeService {
     // Last potential sleep/wake event
     uint64_t _lastRestart;
 
-    // Deadline for the next background task service function
-    volatile int64_t _nextBackgroundTaskDeadline;
+    // Deadline for the next background task service function. Lowered by
+    // the receive workers and the lwIP thread, see lowerBackgroundTaskDeadline()
+    std::atomic<int64_t> _nextBackgroundTaskDeadline;
+
+    // Held by sends that bypass the Linux send batch, which may change a
+    // socket's TTL for the duration of one send
+    Mutex _udpSend_m;
 
     // Configured networks
     struct NetworkState {
@@ -236,10 +271,39 @@ class NodeService {
     Mutex _nets_m;
     /** Lock to control access to storage data */
     Mutex _store_m;
+    /** Writes state objects to storage off the service thread */
+    StateStore _stateStore;
+    /** Whether to keep state objects in a single database file instead */
+    bool _useStateDB;
+    /** Database of state objects, open while the service runs if _useStateDB is set */
+    StateDB _stateDB;
+    /** Application-provided storage, used instead of files if userStore.get is set */
+    zts_state_store_t _userStore;
+    struct UserStoreKey {
+        int type;
+        uint64_t id[2];
+
+        bool operator<(const UserStoreKey& k) const
+        {
+            if (type != k.type) {
+                return type < k.type;
+            }
+            return (id[0] != k.id[0]) ? (id[0] < k.id[0]) : (id[1] < k.id[1]);
+        }
+    };
+    struct UserStorePending {
+        std::string data;
+        bool removed;
+    };
+    /** Lock to control access to objects not yet delivered to the application, held while delivering */
+    Mutex _userStore_m;
+    std::map<UserStoreKey, UserStorePending> _userStorePending;
     /** Lock to control access to service run state */
     Mutex _run_m;
     // Set to false to force service to stop
     volatile bool _run;
+    // Set by terminate(), which may be called before run()
+    bool _terminated;
     /** Lock to control access to termination reason */
     Mutex _termReason_m;
     // Termination status information
@@ -278,6 +342,15 @@ class NodeService {
     /** System to ingest events from this class and emit them to the user */
     Events* _events;
 
+    /** Number of threads processing received wire packets, 0 for the service thread */
+    unsigned int _rxThreads;
+    /** Whether to pin each receive worker to its own CPU */
+    bool _pinRxThreads;
+    /** Receive workers, UDP packets are sharded onto these by source address */
+    std::vector<RxWorker*> _rxWorkers;
+    /** Socket of the last datagram Phy delivered during the current poll, NULL at its start */
+    PhySocket* _rxLastSock;
+
     NodeService();
     ~NodeService();
 
@@ -294,6 +367,37 @@ class NodeService {
     /** Apply or update managed IPs for a configured network */
     void syncManagedStuff(NetworkState& n);
 
+    /** Hand frames queued on each tap to the network stack */
+    void flushTaps();
+
+    /** Hand frames queued on the taps of the given networks to the network stack */
+    void flushTaps(const std::vector<uint64_t>& nets);
+
+    /** Start the configured number of receive workers */
+    void startRxWorkers();
+
+    /** Stop receive workers and discard packets they have not processed */
+    void stopRxWorkers();
+
+    /** Move the background task deadline earlier, never later. Thread-safe */
+    void lowerBackgroundTaskDeadline(int64_t dl);
+
+    /** Decrypt, authenticate and act upon a packet received from the physical network */
+    void processWirePacket(PhySocket* sock, const struct sockaddr* from, const void* data, unsigned long len);
+
+    /** Note that a peer's paths may change before peer events are next generated */
+    void markPeerChanged(uint64_t address);
+
+    /** Note that the paths of every peer may change, e.g. when going online or joining a network */
+    void markAllPeersChanged();
+
+    /** Queue a received packet on the worker responsible for its source address */
+    void dispatchRxPacket(RxPacket* p);
+
+    /** Read and process the datagrams remaining on a UDP socket in batches. Only
+     * called once Phy has delivered a second datagram from the socket in one poll */
+    void drainUdpSocket(PhySocket* sock);
+
     void phyOnDatagram(
         PhySocket* sock,
         void** uptr,
@@ -304,6 +408,13 @@ class NodeService {
 
     void phyOnTcpConnect(PhySocket* sock, void** uptr, bool success);
 
+    /**
+     * @brief Handle one framed message received through the TCP tunnel
+     *
+     * @return False if the connection was closed
+     */
+    bool processTunnelFrame(PhySocket* sock, const char* data, unsigned long mlen);
+
     int nodeVirtualNetworkConfigFunction(
         uint64_t net_id,
         void** nuptr,
@@ -375,7 +486,7 @@ class NodeService {
     /** Set the node's identity */
     int setIdentity(const char* keypair, unsigned int len);
 
-    void nodeStatePutFunction(enum ZT_StateObjectType type, const uint64_t id[2], const void* data, unsigned int len);
+    void nodeStatePutFunction(enum ZT_StateObjectType type, const uint64_t id[2], const void* data, int len);
 
     int nodeStateGetFunction(enum ZT_StateObjectType type, const uint64_t id[2], void* data, unsigned int maxlen);
 
@@ -439,6 +550,33 @@ class NodeService {
     /** Allow or disallow backup port */
     int allowSecondaryPort(unsigned int allowed);
 
+    /** Set the number of threads processing received wire packets */
+    int setRxThreads(unsigned int count);
+
+    /** Pin receive workers to CPUs */
+    int setRxThreadAffinity(bool enabled);
+
+    /** Keep state objects in a single database file instead of one file per object */
+    int setStateDB(bool enabled);
+
+    /** Persist state objects through application-provided callbacks */
+    int setStateStore(const zts_state_store_t* store);
+
+    /**
+     * @brief Import network configs from networks.d into the state database,
+     * once per database
+     *
+     * @return Whether the database holds every network, false if networks.d
+     *     has to be used this time
+     */
+    bool migrateNetworksToStateDB();
+
+    /** Deliver pending puts and deletes to the application-provided storage */
+    void flushUserStore();
+
+    /** Whether state objects can be persisted anywhere */
+    bool hasStorage() const;
+
     /** Set the event system instance used to convey messages to the user */
     int setUserEventSystem(Events* events);
 
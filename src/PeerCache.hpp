@@ -0,0 +1,120 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Last observed path count of each peer
+ */
+
+#ifndef ZTS_PEER_CACHE_HPP
+#define ZTS_PEER_CACHE_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+// Initial number of slots, must be a power of two
+#define ZTS_PEER_CACHE_INITIAL_SLOTS 64
+
+namespace ZeroTier {
+
+/**
+ * Open-addressing (linear probing) map from ZeroTier address to path count.
+ * Entries are never removed. Not thread-safe.
+ */
+class PeerCache {
+  public:
+    PeerCache() : _slots(new Slot[ZTS_PEER_CACHE_INITIAL_SLOTS]), _mask(ZTS_PEER_CACHE_INITIAL_SLOTS - 1), _count(0)
+    {
+        memset(_slots, 0, sizeof(Slot) * ZTS_PEER_CACHE_INITIAL_SLOTS);
+    }
+
+    ~PeerCache()
+    {
+        delete[] _slots;
+    }
+
+    /**
+     * @param address ZeroTier address, never zero
+     * @return Path count last stored for the address, -1 if none
+     */
+    inline long get(uint64_t address) const
+    {
+        for (unsigned long i = slot(address);; i = (i + 1) & _mask) {
+            if (_slots[i].address == address) {
+                return (long)_slots[i].pathCount;
+            }
+            if (! _slots[i].address) {
+                return -1;
+            }
+        }
+    }
+
+    inline void set(uint64_t address, unsigned int pathCount)
+    {
+        unsigned long i = slot(address);
+        while (_slots[i].address && (_slots[i].address != address)) {
+            i = (i + 1) & _mask;
+        }
+        if (! _slots[i].address) {
+            // Keep the load factor at or below 1/2 so probe sequences stay short
+            if ((_count + 1) * 2 > (_mask + 1)) {
+                grow();
+                set(address, pathCount);
+                return;
+            }
+            _slots[i].address = address;
+            ++_count;
+        }
+        _slots[i].pathCount = pathCount;
+    }
+
+  private:
+    PeerCache(const PeerCache&);
+    PeerCache& operator=(const PeerCache&);
+
+    struct Slot {
+        uint64_t address;   // 0 if empty
+        unsigned int pathCount;
+    };
+
+    inline unsigned long slot(uint64_t address) const
+    {
+        // Addresses are not uniformly distributed in their low bits, mix them
+        return (unsigned long)((address * 0x9e3779b97f4a7c15ULL) >> 32) & _mask;
+    }
+
+    void grow()
+    {
+        Slot* const old = _slots;
+        const unsigned long oldSlots = _mask + 1;
+        _slots = new Slot[oldSlots * 2];
+        memset(_slots, 0, sizeof(Slot) * oldSlots * 2);
+        _mask = (oldSlots * 2) - 1;
+        _count = 0;
+        for (unsigned long i = 0; i < oldSlots; i++) {
+            if (old[i].address) {
+                set(old[i].address, old[i].pathCount);
+            }
+        }
+        delete[] old;
+    }
+
+    Slot* _slots;
+    unsigned long _mask;
+    unsigned long _count;
+};
+
+}   // namespace ZeroTier
+
+#endif   // _H
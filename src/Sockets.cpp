@@ -20,9 +20,28 @@
 #include "lwip/sockets.h"
 
 #include "Events.hpp"
+#include "Stats.hpp"
 #include "ZeroTierSockets.h"
+#include "lwip/api.h"
 #include "lwip/dns.h"
+#include "lwip/inet.h"
 #include "lwip/netdb.h"
+#include "lwip/priv/sockets_priv.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #if defined(__ANDROID__)
 #include <sys/endian.h>
@@ -32,6 +51,925 @@ int zts_errno;
 
 namespace ZeroTier {
 
+//----------------------------------------------------------------------------//
+// Epoll interest sets                                                        //
+//----------------------------------------------------------------------------//
+
+/*
+ * Each epoll instance keeps its interest set and a list of descriptors that
+ * may be ready. The list is fed by wrapping the netconn event callback that
+ * lwIP installs for sockets, so a wait only looks at descriptors that have
+ * seen an event since they were last found idle, instead of scanning all of
+ * them like lwip_select()/lwip_poll() do.
+ *
+ * Lock order: core lock, epoll_m, EpollInstance::m
+ */
+
+struct EpollItem {
+    struct zts_epoll_event ev;
+    bool queued;   // Present in EpollInstance::readyq
+};
+
+struct EpollInstance {
+    std::mutex m;
+    std::condition_variable cv;
+    std::map<int, EpollItem> items;
+    std::deque<int> readyq;
+    bool closed;
+
+    EpollInstance() : closed(false)
+    {
+    }
+
+    // Assumes m is locked
+    void forget(int fd)
+    {
+        items.erase(fd);
+        readyq.erase(std::remove(readyq.begin(), readyq.end(), fd), readyq.end());
+    }
+
+    // Assumes m is locked
+    void markReady(int fd)
+    {
+        std::map<int, EpollItem>::iterator it = items.find(fd);
+        if (it != items.end() && ! it->second.queued) {
+            it->second.queued = true;
+            readyq.push_back(fd);
+            cv.notify_one();
+        }
+    }
+};
+
+// Guards epoll handles, per-socket watcher lists and the saved lwIP callback
+static std::mutex epoll_m;
+static std::map<int, std::shared_ptr<EpollInstance> > _epolls;
+static int _nextEpfd = 1;
+// Epoll instances interested in each socket, indexed by fd - LWIP_SOCKET_OFFSET
+static std::vector<std::shared_ptr<EpollInstance> > _epollWatchers[MEMP_NUM_NETCONN];
+// The event handler lwIP's socket layer installed on its netconns
+static netconn_callback _lwipSocketEventCallback = NULL;
+// Set once a watched socket's connection was reset or closed by the peer,
+// guarded by SYS_ARCH_PROTECT like the event counters of lwip_sock
+static uint8_t _epollHup[MEMP_NUM_NETCONN];
+
+static bool epoll_fd_in_range(int fd)
+{
+    return (fd - LWIP_SOCKET_OFFSET) >= 0 && (fd - LWIP_SOCKET_OFFSET) < MEMP_NUM_NETCONN;
+}
+
+// Whether a connection is gone or the peer has closed its side. Assumes the
+// core lock is held
+static bool epoll_conn_hup(struct netconn* conn)
+{
+    if (NETCONNTYPE_GROUP(netconn_type(conn)) != NETCONN_TCP) {
+        return false;
+    }
+    if (! conn->pcb.tcp) {
+        return true;   // Freed by the stack after a reset or an abort
+    }
+    switch (conn->pcb.tcp->state) {
+        case CLOSE_WAIT:
+        case CLOSING:
+        case LAST_ACK:
+        case TIME_WAIT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void epoll_set_hup(int fd, bool hup)
+{
+    SYS_ARCH_DECL_PROTECT(lev);
+    SYS_ARCH_PROTECT(lev);
+    _epollHup[fd - LWIP_SOCKET_OFFSET] = hup;
+    SYS_ARCH_UNPROTECT(lev);
+}
+
+// Called by the stack (core lock held) for every event on a watched netconn
+static void epoll_netconn_event(struct netconn* conn, enum netconn_evt evt, u16_t len)
+{
+    if (_lwipSocketEventCallback) {
+        _lwipSocketEventCallback(conn, evt, len);
+    }
+    if (! conn || evt == NETCONN_EVT_RCVMINUS || evt == NETCONN_EVT_SENDMINUS) {
+        return;
+    }
+    int fd = conn->socket;   // Negative until accept() has assigned a descriptor
+    if (! epoll_fd_in_range(fd)) {
+        return;
+    }
+    // An empty receive event is a FIN, except on a listener where it is a
+    // new connection
+    if (evt == NETCONN_EVT_ERROR
+        || (evt == NETCONN_EVT_RCVPLUS && len == 0 && NETCONNTYPE_GROUP(netconn_type(conn)) == NETCONN_TCP
+            && conn->pcb.tcp && conn->pcb.tcp->state != LISTEN)) {
+        epoll_set_hup(fd, true);
+    }
+    std::lock_guard<std::mutex> _l(epoll_m);
+    std::vector<std::shared_ptr<EpollInstance> >& w = _epollWatchers[fd - LWIP_SOCKET_OFFSET];
+    for (size_t i = 0; i < w.size(); i++) {
+        std::lock_guard<std::mutex> _li(w[i]->m);
+        w[i]->markReady(fd);
+    }
+}
+
+// Return the current readiness of a socket as ZTS_EPOLL* flags
+static uint32_t epoll_fd_events(int fd)
+{
+    struct lwip_sock* sock = lwip_socket_dbg_get_socket(fd);
+    if (! sock || ! sock->conn) {
+        return ZTS_EPOLLERR | ZTS_EPOLLHUP;
+    }
+    uint32_t events = 0;
+    SYS_ARCH_DECL_PROTECT(lev);
+    SYS_ARCH_PROTECT(lev);
+    if (sock->lastdata.pbuf != NULL || sock->rcvevent > 0) {
+        events |= ZTS_EPOLLIN;
+    }
+    if (sock->sendevent != 0) {
+        events |= ZTS_EPOLLOUT;
+    }
+    if (sock->errevent != 0) {
+        events |= ZTS_EPOLLERR;
+    }
+    if (_epollHup[fd - LWIP_SOCKET_OFFSET]) {
+        events |= ZTS_EPOLLHUP;
+    }
+    SYS_ARCH_UNPROTECT(lev);
+    return events;
+}
+
+// Assumes inst->m is locked
+static int epoll_collect(EpollInstance* inst, struct zts_epoll_event* events, int maxevents)
+{
+    int n = 0;
+    size_t pending = inst->readyq.size();
+    while (pending-- > 0 && n < maxevents) {
+        int fd = inst->readyq.front();
+        inst->readyq.pop_front();
+        std::map<int, EpollItem>::iterator it = inst->items.find(fd);
+        if (it == inst->items.end()) {
+            continue;
+        }
+        EpollItem& item = it->second;
+        uint32_t revents = epoll_fd_events(fd) & (item.ev.events | ZTS_EPOLLERR | ZTS_EPOLLHUP);
+        if (! revents) {
+            item.queued = false;
+            continue;
+        }
+        events[n].events = revents;
+        events[n].data = item.ev.data;
+        n++;
+        if (item.ev.events & ZTS_EPOLLET) {
+            // Reported once, the next stack event puts it back
+            item.queued = false;
+        }
+        else {
+            // Stays ready until a wait finds it idle
+            inst->readyq.push_back(fd);
+        }
+    }
+    return n;
+}
+
+// Remove a socket from every interest set, called before it is closed
+static void epoll_forget_fd(int fd)
+{
+    if (! epoll_fd_in_range(fd)) {
+        return;
+    }
+    std::lock_guard<std::mutex> _l(epoll_m);
+    std::vector<std::shared_ptr<EpollInstance> >& w = _epollWatchers[fd - LWIP_SOCKET_OFFSET];
+    for (size_t i = 0; i < w.size(); i++) {
+        std::lock_guard<std::mutex> _li(w[i]->m);
+        w[i]->forget(fd);
+    }
+    w.clear();
+    epoll_set_hup(fd, false);
+}
+
+//----------------------------------------------------------------------------//
+// Batched datagram I/O                                                       //
+//----------------------------------------------------------------------------//
+
+// Datagrams handed to the stack per core lock acquisition
+#define ZTS_MMSG_BATCH 64
+
+// Destination of a message. IPv4-mapped IPv6 addresses are unmapped, as
+// lwip_sendmsg() does on dual-stack sockets.
+static bool mmsg_sockaddr_to_ipaddr(const struct zts_msghdr* msg, ip_addr_t* ip, u16_t* port)
+{
+    const struct zts_sockaddr* sa = (const struct zts_sockaddr*)msg->msg_name;
+    if (sa->sa_family == ZTS_AF_INET && msg->msg_namelen >= (zts_socklen_t)sizeof(struct zts_sockaddr_in)) {
+        const struct zts_sockaddr_in* in4 = (const struct zts_sockaddr_in*)sa;
+        inet_addr_to_ip4addr(ip_2_ip4(ip), (const struct in_addr*)&in4->sin_addr);
+        IP_SET_TYPE_VAL(*ip, IPADDR_TYPE_V4);
+        *port = lwip_ntohs(in4->sin_port);
+        return true;
+    }
+#if LWIP_IPV6
+    if (sa->sa_family == ZTS_AF_INET6 && msg->msg_namelen >= (zts_socklen_t)sizeof(struct zts_sockaddr_in6)) {
+        const struct zts_sockaddr_in6* in6 = (const struct zts_sockaddr_in6*)sa;
+        inet6_addr_to_ip6addr(ip_2_ip6(ip), (const struct in6_addr*)&in6->sin6_addr);
+#if LWIP_IPV6_SCOPES
+        ip6_addr_set_zone(ip_2_ip6(ip), (u8_t)in6->sin6_scope_id);
+#endif
+        IP_SET_TYPE_VAL(*ip, IPADDR_TYPE_V6);
+        *port = lwip_ntohs(in6->sin6_port);
+#if LWIP_IPV4
+        if (ip6_addr_isipv4mappedipv6(ip_2_ip6(ip))) {
+            unmap_ipv4_mapped_ipv6(ip_2_ip4(ip), ip_2_ip6(ip));
+            IP_SET_TYPE_VAL(*ip, IPADDR_TYPE_V4);
+        }
+#endif
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Copy a message into a new pbuf ready for udp_send(), NULL on failure
+static struct pbuf* mmsg_to_pbuf(const struct zts_msghdr* msg, size_t* len)
+{
+    if (! msg->msg_iov || msg->msg_iovlen <= 0 || msg->msg_iovlen > IOV_MAX) {
+        zts_errno = ZTS_EMSGSIZE;
+        return NULL;
+    }
+    size_t total = 0;
+    for (int i = 0; i < msg->msg_iovlen; i++) {
+        if (! msg->msg_iov[i].iov_base && msg->msg_iov[i].iov_len) {
+            zts_errno = ZTS_EINVAL;
+            return NULL;
+        }
+        total += msg->msg_iov[i].iov_len;
+    }
+    if (total > 0xFFFF - 8) {
+        zts_errno = ZTS_EMSGSIZE;
+        return NULL;
+    }
+    struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, (u16_t)total, PBUF_RAM);
+    if (! p) {
+        zts_errno = ZTS_ENOMEM;
+        return NULL;
+    }
+    u16_t offset = 0;
+    for (int i = 0; i < msg->msg_iovlen; i++) {
+        u16_t n = (u16_t)msg->msg_iov[i].iov_len;
+        if (n > 0) {
+            pbuf_take_at(p, msg->msg_iov[i].iov_base, n, offset);
+            offset += n;
+        }
+    }
+    *len = total;
+    return p;
+}
+
+/*
+ * Send up to ZTS_MMSG_BATCH datagrams on a UDP socket. Allocation and copying
+ * happen before the core lock is taken, which is then held once while the
+ * socket is looked up and every datagram is handed to its pcb. This is what
+ * lwip_sendmsg() does per datagram (lwIP takes no socket reference with
+ * LWIP_NETCONN_FULLDUPLEX disabled). Returns the number of datagrams sent,
+ * or -1 if the first one failed.
+ */
+static int mmsg_send_udp_batch(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen)
+{
+    struct pbuf* p[ZTS_MMSG_BATCH];
+    ip_addr_t dst[ZTS_MMSG_BATCH];
+    u16_t port[ZTS_MMSG_BATCH];
+    size_t len[ZTS_MMSG_BATCH];
+    unsigned int prepared = 0;
+    for (; prepared < vlen; prepared++) {
+        const struct zts_msghdr* msg = &msgvec[prepared].msg_hdr;
+        port[prepared] = 0;
+        if (msg->msg_name && ! mmsg_sockaddr_to_ipaddr(msg, &dst[prepared], &port[prepared])) {
+            zts_errno = ZTS_EINVAL;
+            break;
+        }
+        if (! (p[prepared] = mmsg_to_pbuf(msg, &len[prepared]))) {
+            break;
+        }
+    }
+    if (prepared == 0) {
+        return -1;
+    }
+    unsigned int sent = 0;
+    err_t err = ERR_OK;
+    LOCK_TCPIP_CORE();
+    struct lwip_sock* sock = lwip_socket_dbg_get_socket(fd);
+    if (! sock || ! sock->conn || NETCONNTYPE_GROUP(netconn_type(sock->conn)) != NETCONN_UDP) {
+        err = ERR_CLSD;
+    }
+    else if ((err = netconn_err(sock->conn)) == ERR_OK && ! sock->conn->pcb.udp) {
+        err = ERR_CONN;
+    }
+    for (; err == ERR_OK && sent < prepared; sent++) {
+        if (msgvec[sent].msg_hdr.msg_name) {
+            err = udp_sendto(sock->conn->pcb.udp, p[sent], &dst[sent], port[sent]);
+        }
+        else {
+            err = udp_send(sock->conn->pcb.udp, p[sent]);
+        }
+        if (err != ERR_OK) {
+            break;
+        }
+        msgvec[sent].msg_len = (unsigned int)len[sent];
+    }
+    UNLOCK_TCPIP_CORE();
+    for (unsigned int i = 0; i < prepared; i++) {
+        pbuf_free(p[i]);
+    }
+    if (err == ERR_CLSD) {
+        zts_errno = ZTS_EBADF;
+    }
+    else if (err != ERR_OK) {
+        zts_errno = err_to_errno(err);
+    }
+    return sent > 0 ? (int)sent : -1;
+}
+
+//----------------------------------------------------------------------------//
+// Connection establishment                                                   //
+//----------------------------------------------------------------------------//
+
+// Backoff between attempts while no route to the remote host exists yet
+#define ZTS_CONNECT_RETRY_MIN_MS 10
+#define ZTS_CONNECT_RETRY_MAX_MS 250
+
+static int connect_ms_left(std::chrono::steady_clock::time_point deadline)
+{
+    std::chrono::milliseconds::rep ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    return ms > 0 ? (int)ms : 0;
+}
+
+/*
+ * Connect a non-blocking socket and wait for the outcome. lwip_poll() sleeps
+ * on a semaphore that the socket event callback signals when the SYN/ACK (or
+ * an error) arrives. ZeroTier links are transport-triggered, so attempts that
+ * fail because the network has no route yet are retried until the deadline.
+ */
+static int connect_and_wait(int fd, const struct zts_sockaddr* sa, zts_socklen_t addrlen, int timeout_ms)
+{
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    int backoff_ms = ZTS_CONNECT_RETRY_MIN_MS;
+    for (;;) {
+        if (lwip_connect(fd, (sockaddr*)sa, addrlen) == 0) {
+            return ZTS_ERR_OK;
+        }
+        if (zts_errno == ZTS_EINPROGRESS) {
+            break;
+        }
+        if (zts_errno != ZTS_EHOSTUNREACH && zts_errno != ZTS_ENETUNREACH) {
+            return ZTS_ERR_SOCKET;
+        }
+        int left = connect_ms_left(deadline);
+        if (left == 0) {
+            zts_errno = ZTS_ETIMEDOUT;
+            return ZTS_ERR_SOCKET;
+        }
+        zts_util_delay(std::min(backoff_ms, left));
+        backoff_ms = std::min(backoff_ms * 2, ZTS_CONNECT_RETRY_MAX_MS);
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int n = lwip_poll(&pfd, 1, connect_ms_left(deadline));
+    if (n < 0) {
+        return ZTS_ERR_SOCKET;
+    }
+    if (n == 0) {
+        zts_errno = ZTS_ETIMEDOUT;
+        return ZTS_ERR_SOCKET;
+    }
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+    if (lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0) {
+        return ZTS_ERR_SOCKET;
+    }
+    if (so_error != 0) {
+        // lwIP reports a RST in reply to our SYN as a reset connection
+        zts_errno = (so_error == ZTS_ECONNRESET) ? ZTS_ECONNREFUSED : so_error;
+        return ZTS_ERR_SOCKET;
+    }
+    return ZTS_ERR_OK;
+}
+
+//----------------------------------------------------------------------------//
+// Stack limits                                                               //
+//----------------------------------------------------------------------------//
+
+extern zts_stack_limits_t zts_stack_limits;
+
+// Number of sockets created or accepted and not yet closed
+static std::atomic<unsigned int> _openSockets(0);
+
+// Count a new socket, fails with ZTS_EMFILE if max_sockets are already open
+static bool socket_reserve()
+{
+    if (_openSockets.fetch_add(1) >= zts_stack_limits.max_sockets) {
+        _openSockets.fetch_sub(1);
+        zts_errno = ZTS_EMFILE;
+        return false;
+    }
+    return true;
+}
+
+// Lower a buffer of a new pcb to the configured size, keeping whatever part
+// of it is already in use accounted for
+static tcpwnd_size_t socket_limit_buf(tcpwnd_size_t cur, tcpwnd_size_t max, tcpwnd_size_t limit)
+{
+    const tcpwnd_size_t used = (max > cur) ? (max - cur) : 0;
+    return (limit > used) ? std::min(cur, (tcpwnd_size_t)(limit - used)) : 0;
+}
+
+//----------------------------------------------------------------------------//
+// TCP buffer autotuning                                                      //
+//----------------------------------------------------------------------------//
+
+// How often the buffers of autotuned connections are re-evaluated (ms)
+#define ZTS_TCP_AUTOTUNE_INTERVAL 100
+// Send buffer and receive window that connections start with and return to
+#define ZTS_TCP_AUTOTUNE_MIN (16 * TCP_MSS)
+// Time without traffic after which a connection gives its buffers back (ms)
+#define ZTS_TCP_AUTOTUNE_IDLE 10000
+
+/**
+ * Autotuning state of a TCP socket. The buffer sizes are the pcb's snd_buf
+ * and rcv_wnd plus whatever part of them is in use. All of it is only
+ * accessed with the core lock held.
+ */
+struct TcpTune {
+    bool active;
+    bool rcvLocked;        // Receive buffer set by the application
+    struct tcp_pcb* pcb;   // Pcb the sample was started on
+    tcpwnd_size_t sndCap;
+    tcpwnd_size_t rcvCap;
+    // Start of the current rate sample
+    u32_t sampleStart;
+    u32_t sampleAck;
+    u32_t sampleRcv;
+    u32_t lastActive;
+};
+
+// Indexed by fd - LWIP_SOCKET_OFFSET
+static std::vector<TcpTune> _tcpTune;
+// Sum of sndCap and rcvCap over all active entries
+static uint64_t _tcpTuneCommitted = 0;
+static bool _tcpTuneTimerArmed = false;
+
+static void tcp_autotune_tick(void* arg);
+
+static TcpTune* tcp_autotune_entry(int fd)
+{
+    const unsigned int i = (unsigned int)(fd - LWIP_SOCKET_OFFSET);
+    return (fd >= LWIP_SOCKET_OFFSET && i < _tcpTune.size()) ? &_tcpTune[i] : NULL;
+}
+
+// Bytes a connection may still grow by without exceeding tcp_autotune_mem
+static uint64_t tcp_autotune_available()
+{
+    if (! zts_stack_limits.tcp_autotune_mem) {
+        return (uint64_t)-1;
+    }
+    return (zts_stack_limits.tcp_autotune_mem > _tcpTuneCommitted)
+               ? (zts_stack_limits.tcp_autotune_mem - _tcpTuneCommitted)
+               : 0;
+}
+
+// TCP pcb of a socket, or NULL when it has none. Assumes the core lock is held.
+static struct tcp_pcb* tcp_autotune_pcb(int fd)
+{
+    struct lwip_sock* sock = lwip_socket_dbg_get_socket(fd);
+    if (! sock || ! sock->conn || NETCONNTYPE_GROUP(netconn_type(sock->conn)) != NETCONN_TCP) {
+        return NULL;
+    }
+    return sock->conn->pcb.tcp;
+}
+
+// Start tuning a new socket, assumes the core lock is held
+static void tcp_autotune_track(int fd, struct tcp_pcb* pcb, tcpwnd_size_t sndCap, tcpwnd_size_t rcvCap)
+{
+    if (_tcpTune.empty()) {
+        _tcpTune.resize(MEMP_NUM_NETCONN);
+    }
+    TcpTune* t = tcp_autotune_entry(fd);
+    if (! t) {
+        return;
+    }
+    if (t->active) {
+        _tcpTuneCommitted -= t->sndCap + t->rcvCap;
+    }
+    const u32_t now = sys_now();
+    t->active = true;
+    t->rcvLocked = false;
+    t->pcb = pcb;
+    t->sndCap = sndCap;
+    t->rcvCap = rcvCap;
+    t->sampleStart = now;
+    t->sampleAck = pcb->lastack;
+    t->sampleRcv = pcb->rcv_nxt;
+    t->lastActive = now;
+    _tcpTuneCommitted += sndCap + rcvCap;
+    if (! _tcpTuneTimerArmed) {
+        _tcpTuneTimerArmed = true;
+        sys_timeout(ZTS_TCP_AUTOTUNE_INTERVAL, tcp_autotune_tick, NULL);
+    }
+}
+
+// Stop tuning a socket, assumes the core lock is held
+static void tcp_autotune_forget(TcpTune* t)
+{
+    if (t && t->active) {
+        _tcpTuneCommitted -= t->sndCap + t->rcvCap;
+        t->active = false;
+    }
+}
+
+// The application sized the receive buffer, stop tuning the window and open
+// it fully so that only the buffer applies. Assumes the core lock is held.
+static void tcp_autotune_lock_rcv(int fd)
+{
+    TcpTune* t = tcp_autotune_entry(fd);
+    if (! t || ! t->active || t->rcvLocked) {
+        return;
+    }
+    struct tcp_pcb* pcb = tcp_autotune_pcb(fd);
+    if (! pcb || pcb != t->pcb || pcb->state == LISTEN) {
+        tcp_autotune_forget(t);
+        return;
+    }
+    t->rcvLocked = true;
+    tcpwnd_size_t max = zts_stack_limits.tcp_rcv_wnd;
+    if (pcb->state != CLOSED) {
+        max = std::min(max, (tcpwnd_size_t)TCP_WND_MAX(pcb));
+    }
+    if (t->rcvCap >= max) {
+        return;
+    }
+    const tcpwnd_size_t grow = max - t->rcvCap;
+    pcb->rcv_wnd += grow;
+    t->rcvCap += grow;
+    _tcpTuneCommitted += grow;
+    if (pcb->state != CLOSED) {
+        tcp_recved(pcb, 0);
+    }
+    else {
+        pcb->rcv_ann_wnd = pcb->rcv_wnd;
+    }
+}
+
+// Resize the buffers of one connection from its last rate sample
+static void tcp_autotune_update(TcpTune* t, struct tcp_pcb* pcb, u32_t now)
+{
+    // Smoothed RTT, kept by lwIP in eighths of slow timer ticks
+    const u32_t rtt = std::max((u32_t)(pcb->sa > 0 ? (pcb->sa * TCP_SLOW_INTERVAL) >> 3 : 0),
+                               (u32_t)ZTS_TCP_AUTOTUNE_INTERVAL);
+    const u32_t elapsed = now - t->sampleStart;
+    if (elapsed < rtt) {
+        return;
+    }
+    const u32_t acked = pcb->lastack - t->sampleAck;
+    const u32_t rcvd = pcb->rcv_nxt - t->sampleRcv;
+    t->sampleStart = now;
+    t->sampleAck = pcb->lastack;
+    t->sampleRcv = pcb->rcv_nxt;
+    if (acked || rcvd) {
+        t->lastActive = now;
+    }
+    else if ((now - t->lastActive) >= ZTS_TCP_AUTOTUNE_IDLE) {
+        // Shrink only what is not in use, an idle connection usually has
+        // nothing buffered
+        const tcpwnd_size_t min = ZTS_TCP_AUTOTUNE_MIN;
+        if (t->sndCap > min && pcb->snd_buf == t->sndCap) {
+            _tcpTuneCommitted -= t->sndCap - min;
+            pcb->snd_buf = min;
+            t->sndCap = min;
+        }
+        // The peer may still send whatever window was announced to it
+        const tcpwnd_size_t rcvMin = std::max(min, (tcpwnd_size_t)pcb->rcv_ann_wnd);
+        if (! t->rcvLocked && t->rcvCap > rcvMin && pcb->rcv_wnd == t->rcvCap) {
+            _tcpTuneCommitted -= t->rcvCap - rcvMin;
+            pcb->rcv_wnd = rcvMin;
+            t->rcvCap = rcvMin;
+        }
+        return;
+    }
+    // Twice the bandwidth-delay product at the measured rate. While the
+    // buffers are what limits the rate this doubles them every RTT.
+    const uint64_t sndWant = std::min((uint64_t)acked * rtt * 2 / elapsed, (uint64_t)zts_stack_limits.tcp_snd_buf);
+    if (sndWant > t->sndCap) {
+        const tcpwnd_size_t grow = (tcpwnd_size_t)std::min(sndWant - t->sndCap, tcp_autotune_available());
+        pcb->snd_buf += grow;
+        t->sndCap += grow;
+        _tcpTuneCommitted += grow;
+    }
+    const uint64_t rcvMax = std::min((tcpwnd_size_t)zts_stack_limits.tcp_rcv_wnd, (tcpwnd_size_t)TCP_WND_MAX(pcb));
+    const uint64_t rcvWant = std::min((uint64_t)rcvd * rtt * 2 / elapsed, rcvMax);
+    if (! t->rcvLocked && rcvWant > t->rcvCap) {
+        const tcpwnd_size_t grow = (tcpwnd_size_t)std::min(rcvWant - t->rcvCap, tcp_autotune_available());
+        if (grow) {
+            pcb->rcv_wnd += grow;
+            t->rcvCap += grow;
+            _tcpTuneCommitted += grow;
+            // Announce the larger window now rather than with the next ACK
+            tcp_recved(pcb, 0);
+        }
+    }
+}
+
+// Runs on the lwIP thread while any connection is being tuned
+static void tcp_autotune_tick(void* arg)
+{
+    LWIP_UNUSED_ARG(arg);
+    const u32_t now = sys_now();
+    bool any = false;
+    for (size_t i = 0; i < _tcpTune.size(); i++) {
+        TcpTune* t = &_tcpTune[i];
+        if (! t->active) {
+            continue;
+        }
+        struct tcp_pcb* pcb = tcp_autotune_pcb((int)i + LWIP_SOCKET_OFFSET);
+        if (! pcb || pcb != t->pcb || pcb->state == LISTEN) {
+            // Listening, or the connection is gone
+            tcp_autotune_forget(t);
+            continue;
+        }
+        any = true;
+        if (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT) {
+            tcp_autotune_update(t, pcb, now);
+        }
+    }
+    _tcpTuneTimerArmed = any;
+    if (any) {
+        sys_timeout(ZTS_TCP_AUTOTUNE_INTERVAL, tcp_autotune_tick, NULL);
+    }
+}
+
+// Send buffer and receive window caps of new TCP connections, false when the
+// compile-time sizes apply unchanged
+static bool socket_limit_caps(tcpwnd_size_t* sndCap, tcpwnd_size_t* rcvCap)
+{
+    if (! zts_stack_limits.tcp_autotune && zts_stack_limits.tcp_snd_buf >= TCP_SND_BUF
+        && zts_stack_limits.tcp_rcv_wnd >= TCP_WND) {
+        return false;
+    }
+    *sndCap = zts_stack_limits.tcp_snd_buf;
+    *rcvCap = zts_stack_limits.tcp_rcv_wnd;
+    if (zts_stack_limits.tcp_autotune) {
+        *sndCap = std::min(*sndCap, (tcpwnd_size_t)ZTS_TCP_AUTOTUNE_MIN);
+        *rcvCap = std::min(*rcvCap, (tcpwnd_size_t)ZTS_TCP_AUTOTUNE_MIN);
+    }
+    return true;
+}
+
+// Lower the buffers of a pcb that has not announced a window yet (core lock held)
+static void socket_limit_pcb(struct tcp_pcb* pcb, tcpwnd_size_t sndCap, tcpwnd_size_t rcvCap)
+{
+    pcb->snd_buf = socket_limit_buf(pcb->snd_buf, TCP_SND_BUF, sndCap);
+    pcb->rcv_wnd = socket_limit_buf(pcb->rcv_wnd, TCP_WND, rcvCap);
+    pcb->rcv_ann_wnd = pcb->rcv_wnd;
+}
+
+// Called by lwIP when a listening pcb creates the pcb of an incoming
+// connection, before its SYN|ACK announces a receive window (core lock held)
+static err_t socket_limits_passive_open(u8_t id, struct tcp_pcb_listen* lpcb, struct tcp_pcb* cpcb)
+{
+    LWIP_UNUSED_ARG(id);
+    LWIP_UNUSED_ARG(lpcb);
+    tcpwnd_size_t sndCap, rcvCap;
+    if (socket_limit_caps(&sndCap, &rcvCap)) {
+        socket_limit_pcb(cpcb, sndCap, rcvCap);
+    }
+    return ERR_OK;
+}
+
+static const struct tcp_ext_arg_callbacks _limitsExtArgCallbacks = { NULL, socket_limits_passive_open };
+static u8_t _limitsExtArgId = LWIP_TCP_PCB_NUM_EXT_ARGS;   // Not allocated yet
+
+// Apply the configured send buffer and receive window to a new TCP socket.
+// Accepted connections were already limited when their pcb was created.
+static void socket_apply_limits(int fd, bool accepted)
+{
+    tcpwnd_size_t sndCap, rcvCap;
+    if (! socket_limit_caps(&sndCap, &rcvCap)) {
+        return;
+    }
+    LOCK_TCPIP_CORE();
+    struct lwip_sock* sock = lwip_socket_dbg_get_socket(fd);
+    if (sock && sock->conn && NETCONNTYPE_GROUP(netconn_type(sock->conn)) == NETCONN_TCP && sock->conn->pcb.tcp) {
+        struct tcp_pcb* pcb = sock->conn->pcb.tcp;
+        if (! accepted) {
+            socket_limit_pcb(pcb, sndCap, rcvCap);
+            // lwIP copies the extension arguments to the listening pcb, so
+            // connections accepted on this socket are limited as they arrive
+            if (_limitsExtArgId == LWIP_TCP_PCB_NUM_EXT_ARGS) {
+                _limitsExtArgId = tcp_ext_arg_alloc_id();
+            }
+            tcp_ext_arg_set_callbacks(pcb, _limitsExtArgId, &_limitsExtArgCallbacks);
+        }
+        if (zts_stack_limits.tcp_autotune) {
+            tcp_autotune_track(fd, pcb, sndCap, rcvCap);
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+}
+
+//----------------------------------------------------------------------------//
+// Per-socket TCP statistics                                                  //
+//----------------------------------------------------------------------------//
+
+/*
+ * lwIP keeps no per-connection totals and measures round-trip times in slow
+ * timer ticks, so segments are counted by the TCP input and output hooks
+ * (see lwipopts.h). Both run with the core lock held, which also guards the
+ * counters.
+ */
+
+struct TcpCounters {
+    uint64_t segsOut;
+    uint64_t segsIn;
+    uint64_t totalRetrans;
+    uint64_t bytesSent;
+    uint64_t bytesRetrans;
+    uint64_t bytesAcked;
+    uint64_t bytesReceived;
+    // One past the highest sequence number sent
+    u32_t sndMax;
+    bool sndMaxValid;
+    // Round-trip time of one segment at a time, none is timed while
+    // retransmitting (Karn's algorithm)
+    bool rttTiming;
+    u32_t rttSeq;
+    u32_t rttStart;
+    bool rttValid;
+    u32_t srtt;     // us
+    u32_t rttvar;   // us
+};
+
+// Indexed by fd - LWIP_SOCKET_OFFSET
+static TcpCounters _tcpCounters[MEMP_NUM_NETCONN];
+
+// Counters of the socket a pcb belongs to, NULL if it has none
+static TcpCounters* tcp_counters_entry(const struct tcp_pcb* pcb)
+{
+    if (! pcb || pcb->state == LISTEN || ! pcb->callback_arg) {
+        return NULL;
+    }
+    // Negative until accept() has assigned a descriptor
+    const int fd = ((struct netconn*)pcb->callback_arg)->socket;
+    return epoll_fd_in_range(fd) ? &_tcpCounters[fd - LWIP_SOCKET_OFFSET] : NULL;
+}
+
+// Start counting from zero for a new socket
+static void tcp_counters_reset(int fd)
+{
+    if (! epoll_fd_in_range(fd)) {
+        return;
+    }
+    LOCK_TCPIP_CORE();
+    memset(&_tcpCounters[fd - LWIP_SOCKET_OFFSET], 0, sizeof(TcpCounters));
+    UNLOCK_TCPIP_CORE();
+}
+
+// Smooth a round-trip time sample (us) the same way as RFC 6298
+static void tcp_counters_rtt_sample(TcpCounters* c, u32_t sample)
+{
+    if (! c->rttValid) {
+        c->rttValid = true;
+        c->srtt = sample;
+        c->rttvar = sample / 2;
+        return;
+    }
+    const u32_t err = (sample > c->srtt) ? (sample - c->srtt) : (c->srtt - sample);
+    c->rttvar = c->rttvar - c->rttvar / 4 + err / 4;
+    c->srtt = c->srtt - c->srtt / 8 + sample / 8;
+}
+
+// Assumes the core lock is held
+static void tcp_info_fill(int fd, const struct tcp_pcb* pcb, zts_tcp_info_t* dst)
+{
+    memset(dst, 0, sizeof(zts_tcp_info_t));
+    dst->fd = fd;
+    dst->state = pcb ? (uint8_t)pcb->state : (uint8_t)CLOSED;
+    if (pcb && pcb->state != LISTEN) {
+        dst->retransmits = pcb->nrtx;
+#if LWIP_WND_SCALE
+        dst->snd_wscale = pcb->snd_scale;
+        dst->rcv_wscale = pcb->rcv_scale;
+#endif
+        dst->rto = (uint32_t)pcb->rto * TCP_SLOW_INTERVAL;
+        dst->snd_mss = pcb->mss;
+        dst->snd_ssthresh = pcb->ssthresh;
+        dst->snd_cwnd = pcb->cwnd;
+        dst->snd_wnd = pcb->snd_wnd;
+        dst->rcv_wnd = pcb->rcv_wnd;
+        dst->snd_buf = pcb->snd_buf;
+        dst->unacked = pcb->snd_nxt - pcb->lastack;
+    }
+    const TcpCounters* c = &_tcpCounters[fd - LWIP_SOCKET_OFFSET];
+    dst->rtt = c->srtt;
+    dst->rttvar = c->rttvar;
+    dst->segs_out = c->segsOut;
+    dst->segs_in = c->segsIn;
+    dst->total_retrans = c->totalRetrans;
+    dst->bytes_sent = c->bytesSent;
+    dst->bytes_retrans = c->bytesRetrans;
+    dst->bytes_acked = c->bytesAcked;
+    dst->bytes_received = c->bytesReceived;
+}
+
+// The TCP socket behind a descriptor, NULL if there is none. Assumes the core
+// lock is held.
+static struct lwip_sock* tcp_info_socket(int fd)
+{
+    struct lwip_sock* sock = epoll_fd_in_range(fd) ? lwip_socket_dbg_get_socket(fd) : NULL;
+    if (! sock || ! sock->conn || NETCONNTYPE_GROUP(netconn_type(sock->conn)) != NETCONN_TCP) {
+        return NULL;
+    }
+    return sock;
+}
+
+}   // namespace ZeroTier
+
+// TCP hooks for lwIP (LWIP_HOOK_TCP_* in lwipopts.h)
+extern "C" {
+
+// Called for each segment handed to a pcb, header fields are in host order
+signed char zts_lwip_tcp_in_hook(struct tcp_pcb* pcb, struct tcp_hdr* hdr, struct pbuf* p)
+{
+    ZeroTier::zts_stats_add(ZeroTier::ZTS_STAT_TCP_RX);
+    ZeroTier::TcpCounters* c = ZeroTier::tcp_counters_entry(pcb);
+    if (! c) {
+        return ERR_OK;
+    }
+    c->segsIn++;
+    const u8_t flags = TCPH_FLAGS(hdr);
+    if (flags & TCP_ACK) {
+        const u32_t ack = hdr->ackno;
+        if (pcb->state >= ESTABLISHED && TCP_SEQ_GT(ack, pcb->lastack) && TCP_SEQ_LEQ(ack, pcb->snd_nxt)) {
+            c->bytesAcked += ack - pcb->lastack;
+        }
+        if (c->rttTiming && TCP_SEQ_GEQ(ack, c->rttSeq) && TCP_SEQ_LEQ(ack, pcb->snd_nxt)) {
+            c->rttTiming = false;
+            ZeroTier::tcp_counters_rtt_sample(c, (sys_now() - c->rttStart) * 1000);
+        }
+    }
+    // p->payload is the segment's data
+    if (p->tot_len && pcb->state != SYN_SENT) {
+        const u32_t seq = hdr->seqno + ((flags & TCP_SYN) ? 1 : 0);
+        const u32_t end = seq + p->tot_len;
+        if (TCP_SEQ_GT(end, pcb->rcv_nxt)) {
+            c->bytesReceived += end - (TCP_SEQ_GT(seq, pcb->rcv_nxt) ? seq : pcb->rcv_nxt);
+        }
+    }
+    return ERR_OK;
+}
+
+// Called for each segment sent by a pcb, header fields are in network order.
+// A segment that is retransmitted may still carry the headers of lower
+// layers in front of hdr.
+uint32_t* zts_lwip_tcp_out_hook(struct pbuf* p, struct tcp_hdr* hdr, const struct tcp_pcb* pcb, uint32_t* opts)
+{
+    ZeroTier::zts_stats_add(ZeroTier::ZTS_STAT_TCP_TX);
+    ZeroTier::TcpCounters* c = ZeroTier::tcp_counters_entry(pcb);
+    if (! c) {
+        return opts;
+    }
+    c->segsOut++;
+    const u16_t offset = (u16_t)((u8_t*)hdr - (u8_t*)p->payload) + TCPH_HDRLEN_BYTES(hdr);
+    const u32_t len = (p->tot_len > offset) ? (u32_t)(p->tot_len - offset) : 0;
+    const u8_t flags = TCPH_FLAGS(hdr);
+    const u32_t seqLen = len + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+    if (! seqLen) {
+        return opts;   // Pure ACK, window update or keepalive
+    }
+    const u32_t seq = lwip_ntohl(hdr->seqno);
+    if (c->sndMaxValid && TCP_SEQ_LT(seq, c->sndMax)) {
+        c->totalRetrans++;
+        c->bytesRetrans += len;
+        c->rttTiming = false;
+    }
+    else if (! c->rttTiming) {
+        c->rttTiming = true;
+        c->rttSeq = seq + seqLen;
+        c->rttStart = sys_now();
+    }
+    c->bytesSent += len;
+    if (! c->sndMaxValid || TCP_SEQ_GT(seq + seqLen, c->sndMax)) {
+        c->sndMaxValid = true;
+        c->sndMax = seq + seqLen;
+    }
+    return opts;
+}
+
+}   // extern "C"
+
+namespace ZeroTier {
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -41,7 +979,17 @@ int zts_bsd_socket(const int socket_family, const int socket_type, const int pro
     if (! transport_ok()) {
         return ZTS_ERR_SERVICE;
     }
-    return lwip_socket(socket_family, socket_type, protocol);
+    if (! socket_reserve()) {
+        return ZTS_ERR_SOCKET;
+    }
+    int fd = lwip_socket(socket_family, socket_type, protocol);
+    if (fd < 0) {
+        _openSockets.fetch_sub(1);
+        return fd;
+    }
+    socket_apply_limits(fd, false);
+    tcp_counters_reset(fd);
+    return fd;
 }
 
 int zts_bsd_connect(int fd, const struct zts_sockaddr* addr, zts_socklen_t addrlen)
@@ -86,7 +1034,18 @@ int zts_bsd_accept(int fd, struct zts_sockaddr* addr, zts_socklen_t* addrlen)
     if (! transport_ok()) {
         return ZTS_ERR_SERVICE;
     }
-    return lwip_accept(fd, (sockaddr*)addr, (socklen_t*)addrlen);
+    int acc_fd = lwip_accept(fd, (sockaddr*)addr, (socklen_t*)addrlen);
+    if (acc_fd < 0) {
+        return acc_fd;
+    }
+    if (! socket_reserve()) {
+        lwip_close(acc_fd);
+        zts_errno = ZTS_EMFILE;
+        return ZTS_ERR_SOCKET;
+    }
+    socket_apply_limits(acc_fd, true);
+    tcp_counters_reset(acc_fd);
+    return acc_fd;
 }
 
 int zts_bsd_setsockopt(int fd, int level, int optname, const void* optval, zts_socklen_t optlen)
@@ -94,7 +1053,13 @@ int zts_bsd_setsockopt(int fd, int level, int optname, const void* optval, zts_s
     if (! transport_ok()) {
         return ZTS_ERR_SERVICE;
     }
-    return lwip_setsockopt(fd, level, optname, optval, optlen);
+    int err = lwip_setsockopt(fd, level, optname, optval, optlen);
+    if (err == 0 && level == SOL_SOCKET && optname == SO_RCVBUF && zts_stack_limits.tcp_autotune) {
+        LOCK_TCPIP_CORE();
+        tcp_autotune_lock_rcv(fd);
+        UNLOCK_TCPIP_CORE();
+    }
+    return err;
 }
 
 int zts_bsd_getsockopt(int fd, int level, int optname, void* optval, zts_socklen_t* optlen)
@@ -138,7 +1103,18 @@ int zts_bsd_close(int fd)
     if (! transport_ok()) {
         return ZTS_ERR_SERVICE;
     }
-    return lwip_close(fd);
+    epoll_forget_fd(fd);
+    if (zts_stack_limits.tcp_autotune) {
+        // Before the fd can be reused by another socket
+        LOCK_TCPIP_CORE();
+        tcp_autotune_forget(tcp_autotune_entry(fd));
+        UNLOCK_TCPIP_CORE();
+    }
+    int err = lwip_close(fd);
+    if (err == 0) {
+        _openSockets.fetch_sub(1);
+    }
+    return err;
 }
 
 int zts_bsd_select(
@@ -170,6 +1146,162 @@ int zts_bsd_poll(struct zts_pollfd* fds, nfds_t nfds, int timeout)
     return lwip_poll((pollfd*)fds, nfds, timeout);
 }
 
+int zts_epoll_create()
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    std::lock_guard<std::mutex> _l(epoll_m);
+    int epfd = _nextEpfd++;
+    _epolls[epfd] = std::make_shared<EpollInstance>();
+    return epfd;
+}
+
+int zts_epoll_ctl(int epfd, int op, int fd, struct zts_epoll_event* event)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! epoll_fd_in_range(fd)) {
+        return ZTS_ERR_ARG;
+    }
+    if ((op == ZTS_EPOLL_CTL_ADD || op == ZTS_EPOLL_CTL_MOD) && ! event) {
+        return ZTS_ERR_ARG;
+    }
+    if (op != ZTS_EPOLL_CTL_ADD && op != ZTS_EPOLL_CTL_MOD && op != ZTS_EPOLL_CTL_DEL) {
+        return ZTS_ERR_ARG;
+    }
+    int err = ZTS_ERR_OK;
+    // The core lock keeps the netconn alive and its callback from running
+    // while it is being wrapped
+    LOCK_TCPIP_CORE();
+    {
+        std::lock_guard<std::mutex> _l(epoll_m);
+        std::map<int, std::shared_ptr<EpollInstance> >::iterator e = _epolls.find(epfd);
+        struct lwip_sock* sock = lwip_socket_dbg_get_socket(fd);
+        if (e == _epolls.end()) {
+            err = ZTS_ERR_ARG;
+        }
+        else if (! sock || ! sock->conn) {
+            zts_errno = ZTS_EBADF;
+            err = ZTS_ERR_SOCKET;
+        }
+        else {
+            std::shared_ptr<EpollInstance> inst = e->second;
+            std::vector<std::shared_ptr<EpollInstance> >& w = _epollWatchers[fd - LWIP_SOCKET_OFFSET];
+            std::lock_guard<std::mutex> _li(inst->m);
+            std::map<int, EpollItem>::iterator it = inst->items.find(fd);
+            switch (op) {
+                case ZTS_EPOLL_CTL_ADD:
+                    if (it != inst->items.end()) {
+                        zts_errno = ZTS_EEXIST;
+                        err = ZTS_ERR_SOCKET;
+                        break;
+                    }
+                    if (sock->conn->callback != epoll_netconn_event) {
+                        _lwipSocketEventCallback = sock->conn->callback;
+                        sock->conn->callback = epoll_netconn_event;
+                        // Events before this point were not seen by the wrapper
+                        epoll_set_hup(fd, epoll_conn_hup(sock->conn));
+                    }
+                    inst->items[fd].ev = *event;
+                    inst->items[fd].queued = false;
+                    w.push_back(inst);
+                    inst->markReady(fd);   // Report a socket that is already ready
+                    break;
+                case ZTS_EPOLL_CTL_MOD:
+                    if (it == inst->items.end()) {
+                        zts_errno = ZTS_ENOENT;
+                        err = ZTS_ERR_SOCKET;
+                        break;
+                    }
+                    it->second.ev = *event;
+                    inst->markReady(fd);
+                    break;
+                case ZTS_EPOLL_CTL_DEL:
+                    if (it == inst->items.end()) {
+                        zts_errno = ZTS_ENOENT;
+                        err = ZTS_ERR_SOCKET;
+                        break;
+                    }
+                    inst->forget(fd);
+                    for (size_t i = 0; i < w.size(); i++) {
+                        if (w[i] == inst) {
+                            w.erase(w.begin() + i);
+                            break;
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+    return err;
+}
+
+int zts_epoll_wait(int epfd, struct zts_epoll_event* events, int maxevents, int timeout)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! events || maxevents <= 0) {
+        return ZTS_ERR_ARG;
+    }
+    std::shared_ptr<EpollInstance> inst;
+    {
+        std::lock_guard<std::mutex> _l(epoll_m);
+        std::map<int, std::shared_ptr<EpollInstance> >::iterator e = _epolls.find(epfd);
+        if (e == _epolls.end()) {
+            return ZTS_ERR_ARG;
+        }
+        inst = e->second;
+    }
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout > 0 ? timeout : 0);
+    std::unique_lock<std::mutex> _li(inst->m);
+    for (;;) {
+        int n = epoll_collect(inst.get(), events, maxevents);
+        if (n > 0 || timeout == 0 || inst->closed) {
+            return n;
+        }
+        if (timeout < 0) {
+            inst->cv.wait(_li);
+        }
+        else if (inst->cv.wait_until(_li, deadline) == std::cv_status::timeout) {
+            return epoll_collect(inst.get(), events, maxevents);
+        }
+    }
+}
+
+int zts_epoll_close(int epfd)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    std::lock_guard<std::mutex> _l(epoll_m);
+    std::map<int, std::shared_ptr<EpollInstance> >::iterator e = _epolls.find(epfd);
+    if (e == _epolls.end()) {
+        return ZTS_ERR_ARG;
+    }
+    std::shared_ptr<EpollInstance> inst = e->second;
+    _epolls.erase(e);
+    std::lock_guard<std::mutex> _li(inst->m);
+    for (std::map<int, EpollItem>::iterator it = inst->items.begin(); it != inst->items.end(); ++it) {
+        std::vector<std::shared_ptr<EpollInstance> >& w = _epollWatchers[it->first - LWIP_SOCKET_OFFSET];
+        for (size_t i = 0; i < w.size(); i++) {
+            if (w[i] == inst) {
+                w.erase(w.begin() + i);
+                break;
+            }
+        }
+    }
+    inst->items.clear();
+    inst->readyq.clear();
+    inst->closed = true;
+    inst->cv.notify_all();
+    return ZTS_ERR_OK;
+}
+
 int zts_bsd_ioctl(int fd, unsigned long request, void* argp)
 {
     if (! transport_ok()) {
@@ -215,6 +1347,51 @@ ssize_t zts_bsd_sendmsg(int fd, const struct zts_msghdr* msg, int flags)
     return lwip_sendmsg(fd, (const struct msghdr*)msg, flags);
 }
 
+int zts_bsd_sendmmsg(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen, int flags)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! msgvec || vlen == 0) {
+        return ZTS_ERR_ARG;
+    }
+    vlen = std::min(vlen, (unsigned int)ZTS_MMSG_VLEN_MAX);
+    // Datagrams never block and UDP ignores the only flags lwip_sendmsg()
+    // accepts, anything else is left to it to reject
+    bool udp = false;
+    if (! (flags & ~(ZTS_MSG_DONTWAIT | ZTS_MSG_MORE))) {
+        LOCK_TCPIP_CORE();
+        struct lwip_sock* sock = lwip_socket_dbg_get_socket(fd);
+        udp = sock && sock->conn && NETCONNTYPE_GROUP(netconn_type(sock->conn)) == NETCONN_UDP;
+        UNLOCK_TCPIP_CORE();
+    }
+    unsigned int sent = 0;
+    if (udp) {
+        while (sent < vlen) {
+            unsigned int n = std::min(vlen - sent, (unsigned int)ZTS_MMSG_BATCH);
+            int err = mmsg_send_udp_batch(fd, msgvec + sent, n);
+            if (err < 0) {
+                break;
+            }
+            sent += err;
+            if ((unsigned int)err < n) {
+                break;
+            }
+        }
+    }
+    else {
+        // Streams gain nothing from batching inside the stack
+        for (; sent < vlen; sent++) {
+            ssize_t err = lwip_sendmsg(fd, (const struct msghdr*)&msgvec[sent].msg_hdr, flags);
+            if (err < 0) {
+                break;
+            }
+            msgvec[sent].msg_len = (unsigned int)err;
+        }
+    }
+    return sent > 0 ? (int)sent : ZTS_ERR_SOCKET;
+}
+
 ssize_t zts_bsd_recv(int fd, void* buf, size_t len, int flags)
 {
     if (! transport_ok()) {
@@ -248,6 +1425,30 @@ ssize_t zts_bsd_recvmsg(int fd, struct zts_msghdr* msg, int flags)
     return lwip_recvmsg(fd, (struct msghdr*)msg, flags);
 }
 
+int zts_bsd_recvmmsg(int fd, struct zts_mmsghdr* msgvec, unsigned int vlen, int flags)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! msgvec || vlen == 0) {
+        return ZTS_ERR_ARG;
+    }
+    vlen = std::min(vlen, (unsigned int)ZTS_MMSG_VLEN_MAX);
+    // Received datagrams are already queued on the netconn's mailbox and
+    // lwip_recvmsg() dequeues them without taking the core lock, so there is
+    // no lock round trip to batch. Only the first receive may wait.
+    unsigned int received = 0;
+    for (; received < vlen; received++) {
+        int f = received ? (flags | ZTS_MSG_DONTWAIT) : flags;
+        ssize_t err = lwip_recvmsg(fd, (struct msghdr*)&msgvec[received].msg_hdr, f);
+        if (err < 0) {
+            break;
+        }
+        msgvec[received].msg_len = (unsigned int)err;
+    }
+    return received > 0 ? (int)received : ZTS_ERR_SOCKET;
+}
+
 ssize_t zts_bsd_read(int fd, void* buf, size_t len)
 {
     if (! transport_ok()) {
@@ -409,9 +1610,6 @@ int zts_connect(int fd, const char* ipstr, unsigned short port, int timeout_ms)
     if (timeout_ms == 0) {
         timeout_ms = 30000;   // Default
     }
-    int div = 4;   // Must be > 0, Four connection attempts per second
-    int n_tries = (timeout_ms / 1000) * div;
-    int connect_delay = 1000 / div;
     int err = ZTS_ERR_SOCKET;
 
     zts_socklen_t addrlen = 0;
@@ -425,13 +1623,20 @@ int zts_connect(int fd, const char* ipstr, unsigned short port, int timeout_ms)
     sa = (struct zts_sockaddr*)&ss;
 
     if (addrlen > 0 && sa != NULL) {
-        if (zts_get_blocking(fd)) {
-            do {
-                err = zts_bsd_connect(fd, sa, addrlen);
-                zts_util_delay(connect_delay);
-                n_tries--;
-            } while ((err < 0) && (zts_errno != 0) && (n_tries > 0));
+        int blocking = zts_get_blocking(fd);
+        if (blocking < 0) {
+            return blocking;
+        }
+        if (! blocking) {
+            return zts_bsd_connect(fd, sa, addrlen);
         }
+        // Start the handshake without blocking and sleep in lwip_poll() until
+        // the stack signals completion, so that we return after one RTT
+        zts_set_blocking(fd, 0);
+        err = connect_and_wait(fd, sa, addrlen, timeout_ms);
+        int saved_errno = zts_errno;
+        zts_set_blocking(fd, 1);
+        zts_errno = saved_errno;
         return err;
     }
     return ZTS_ERR_ARG;
@@ -930,6 +2135,51 @@ int zts_get_keepalive(int fd)
     return optval != 0;
 }
 
+int zts_get_socket_stats(int fd, zts_tcp_info_t* dst)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! dst) {
+        return ZTS_ERR_ARG;
+    }
+    int err = ZTS_ERR_OK;
+    LOCK_TCPIP_CORE();
+    struct lwip_sock* sock = tcp_info_socket(fd);
+    if (sock) {
+        tcp_info_fill(fd, sock->conn->pcb.tcp, dst);
+    }
+    else {
+        zts_errno = ZTS_EBADF;
+        err = ZTS_ERR_SOCKET;
+    }
+    UNLOCK_TCPIP_CORE();
+    return err;
+}
+
+int zts_get_all_socket_stats(zts_tcp_info_t* dst, unsigned int* count)
+{
+    if (! transport_ok()) {
+        return ZTS_ERR_SERVICE;
+    }
+    if (! dst || ! count) {
+        return ZTS_ERR_ARG;
+    }
+    unsigned int n = 0;
+    // One pass under a single acquisition of the core lock
+    LOCK_TCPIP_CORE();
+    for (int i = 0; i < MEMP_NUM_NETCONN && n < *count; i++) {
+        const int fd = i + LWIP_SOCKET_OFFSET;
+        struct lwip_sock* sock = tcp_info_socket(fd);
+        if (sock) {
+            tcp_info_fill(fd, sock->conn->pcb.tcp, &dst[n++]);
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+    *count = n;
+    return ZTS_ERR_OK;
+}
+
 int zts_util_ntop(struct zts_sockaddr* addr, zts_socklen_t addrlen, char* dst_str, int len, unsigned short* port)
 {
     if (! addr || addrlen < sizeof(struct zts_sockaddr_in) || addrlen > sizeof(struct zts_sockaddr_storage) || ! dst_str
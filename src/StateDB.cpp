@@ -0,0 +1,453 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Single-file, append-only store for node state objects
+ */
+
+#include "StateDB.hpp"
+
+#include "OSUtils.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__WINDOWS__)
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Identifies a state database file, includes the format version
+#define ZTS_STATE_DB_FILE_MAGIC     "ZTSDB\0\0\1"
+#define ZTS_STATE_DB_FILE_MAGIC_LEN 8
+#define ZTS_STATE_DB_RECORD_MAGIC   0x5a545352   // "ZTSR"
+// magic, type, id[0], id[1], timestamp, length, check
+#define ZTS_STATE_DB_RECORD_HDR_LEN 40
+// Type flag of a record that removes an object
+#define ZTS_STATE_DB_REMOVED 0x80000000U
+// Don't bother rewriting the file to reclaim less than this
+#define ZTS_STATE_DB_COMPACT_MIN 65536
+// Minimum size of the mapping, grown by doubling
+#define ZTS_STATE_DB_MAP_MIN 1048576
+// An unchanged object is written again to record that it is still current
+// once its stored timestamp is this old (ms), well within any expiry period
+#define ZTS_STATE_DB_REFRESH_INTERVAL 86400000
+
+namespace ZeroTier {
+
+// FNV-1a, truncated
+static uint32_t record_check(const char* hdr, const void* data, uint32_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < (ZTS_STATE_DB_RECORD_HDR_LEN - 4); i++) {
+        h ^= (uint8_t)hdr[i];
+        h *= 0x100000001b3ULL;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= ((const uint8_t*)data)[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void record_header(
+    char* hdr,
+    int type,
+    const uint64_t id[2],
+    int64_t timestamp,
+    const void* data,
+    uint32_t len,
+    bool removed)
+{
+    const uint32_t magic = ZTS_STATE_DB_RECORD_MAGIC;
+    const uint32_t t = (uint32_t)type | (removed ? ZTS_STATE_DB_REMOVED : 0);
+    memcpy(hdr, &magic, 4);
+    memcpy(hdr + 4, &t, 4);
+    memcpy(hdr + 8, id, 16);
+    memcpy(hdr + 24, &timestamp, 8);
+    memcpy(hdr + 32, &len, 4);
+    const uint32_t check = record_check(hdr, data, len);
+    memcpy(hdr + 36, &check, 4);
+}
+
+static bool record_write(FILE* f, const char* hdr, const void* data, uint32_t len)
+{
+    return (fwrite(hdr, ZTS_STATE_DB_RECORD_HDR_LEN, 1, f) == 1) && ((len == 0) || (fwrite(data, len, 1, f) == 1));
+}
+
+static bool file_truncate(FILE* f, uint64_t size)
+{
+    fflush(f);
+#if defined(__WINDOWS__)
+    const bool ok = (_chsize_s(_fileno(f), (__int64)size) == 0);
+#else
+    const bool ok = (ftruncate(fileno(f), (off_t)size) == 0);
+#endif
+    fseek(f, 0, SEEK_END);
+    return ok;
+}
+
+StateDB::StateDB() : _f(NULL), _base(NULL), _mapped(0), _size(0), _dead(0)
+{
+}
+
+StateDB::~StateDB()
+{
+    close();
+}
+
+bool StateDB::open(const std::string& path)
+{
+    std::lock_guard<std::mutex> _l(_m);
+    closeLocked();
+    if (! openLocked(path)) {
+        return false;
+    }
+    // Reclaim space left over from the last run now rather than in an hour
+    compactLocked(-1, 0);
+    return isOpen();
+}
+
+void StateDB::close()
+{
+    std::lock_guard<std::mutex> _l(_m);
+    closeLocked();
+}
+
+bool StateDB::put(int type, const uint64_t id[2], const void* data, unsigned int len)
+{
+    std::lock_guard<std::mutex> _l(_m);
+    if (! _f) {
+        return false;
+    }
+    const Key k = { type, { id[0], id[1] } };
+    std::unordered_map<Key, Entry, KeyHash>::iterator e(_index.find(k));
+    const int64_t now = OSUtils::now();
+    if ((e != _index.end()) && (e->second.len == len) && (memcmp(recordData(e->second), data, len) == 0)
+        && ((now - e->second.timestamp) < ZTS_STATE_DB_REFRESH_INTERVAL)) {
+        return true;
+    }
+    return append(k, data, len, false, now);
+}
+
+bool StateDB::remove(int type, const uint64_t id[2])
+{
+    std::lock_guard<std::mutex> _l(_m);
+    if (! _f) {
+        return false;
+    }
+    const Key k = { type, { id[0], id[1] } };
+    if (_index.find(k) == _index.end()) {
+        return true;
+    }
+    return append(k, NULL, 0, true, OSUtils::now());
+}
+
+int StateDB::get(int type, const uint64_t id[2], void* data, unsigned int maxlen)
+{
+    std::lock_guard<std::mutex> _l(_m);
+    const Key k = { type, { id[0], id[1] } };
+    std::unordered_map<Key, Entry, KeyHash>::const_iterator e(_index.find(k));
+    if (e == _index.end()) {
+        return -1;
+    }
+    const unsigned int len = (e->second.len < maxlen) ? e->second.len : maxlen;
+    memcpy(data, recordData(e->second), len);
+    return (int)len;
+}
+
+std::vector<uint64_t> StateDB::list(int type)
+{
+    std::lock_guard<std::mutex> _l(_m);
+    std::vector<uint64_t> ids;
+    for (std::unordered_map<Key, Entry, KeyHash>::const_iterator e(_index.begin()); e != _index.end(); ++e) {
+        if (e->first.type == type) {
+            ids.push_back(e->first.id[0]);
+        }
+    }
+    return ids;
+}
+
+void StateDB::compact(int expireType, int64_t expireBefore)
+{
+    std::lock_guard<std::mutex> _l(_m);
+    compactLocked(expireType, expireBefore);
+}
+
+void StateDB::compactLocked(int expireType, int64_t expireBefore)
+{
+    if (! _f) {
+        return;
+    }
+    // Expired objects are removed right away, only reclaiming their space
+    // waits until enough of the file is dead
+    std::vector<Key> expired;
+    for (std::unordered_map<Key, Entry, KeyHash>::const_iterator e(_index.begin()); e != _index.end(); ++e) {
+        if ((e->first.type == expireType) && (e->second.timestamp < expireBefore)) {
+            expired.push_back(e->first);
+        }
+    }
+    const int64_t now = OSUtils::now();
+    for (size_t i = 0; _f && (i < expired.size()); i++) {
+        append(expired[i], NULL, 0, true, now);
+    }
+    if (! _f || (_dead < ZTS_STATE_DB_COMPACT_MIN) || (_dead < (_size - _dead))) {
+        return;
+    }
+    // Live records in file order, so that the rewrite reads the old file sequentially
+    std::vector<std::pair<uint64_t, Key> > keep;
+    for (std::unordered_map<Key, Entry, KeyHash>::const_iterator e(_index.begin()); e != _index.end(); ++e) {
+        keep.push_back(std::pair<uint64_t, Key>(e->second.offset, e->first));
+    }
+    std::sort(keep.begin(), keep.end(), [](const std::pair<uint64_t, Key>& a, const std::pair<uint64_t, Key>& b) {
+        return a.first < b.first;
+    });
+
+    const std::string tmp(_path + ".tmp");
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (! f) {
+        fprintf(stderr, "WARNING: unable to write to file: %s (unable to open)" ZT_EOL_S, tmp.c_str());
+        return;
+    }
+    bool ok = (fwrite(ZTS_STATE_DB_FILE_MAGIC, ZTS_STATE_DB_FILE_MAGIC_LEN, 1, f) == 1);
+    char hdr[ZTS_STATE_DB_RECORD_HDR_LEN];
+    for (size_t i = 0; ok && (i < keep.size()); i++) {
+        const Entry& e = _index[keep[i].second];
+        record_header(hdr, keep[i].second.type, keep[i].second.id, e.timestamp, recordData(e), e.len, false);
+        ok = record_write(f, hdr, recordData(e), e.len);
+    }
+    ok = ok && (fflush(f) == 0);
+#if ! defined(__WINDOWS__)
+    ok = ok && (fsync(fileno(f)) == 0);
+#endif
+    fclose(f);
+    if (ok) {
+        OSUtils::lockDownFile(tmp.c_str(), false);
+    }
+    else {
+        fprintf(stderr, "WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S, tmp.c_str());
+        OSUtils::rm(tmp.c_str());
+        return;
+    }
+
+    const std::string path(_path);
+    // Windows cannot replace a file that is open
+    closeLocked();
+#if defined(__WINDOWS__)
+    ok = (MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+    ok = (rename(tmp.c_str(), path.c_str()) == 0);
+#endif
+    if (! ok) {
+        fprintf(stderr, "WARNING: unable to write to file: %s (unable to rename)" ZT_EOL_S, path.c_str());
+        OSUtils::rm(tmp.c_str());
+    }
+    openLocked(path);
+}
+
+bool StateDB::openLocked(const std::string& path)
+{
+    _f = fopen(path.c_str(), "r+b");
+    if (! _f) {
+        _f = fopen(path.c_str(), "w+b");
+        if (! _f) {
+            fprintf(stderr, "WARNING: unable to open file: %s" ZT_EOL_S, path.c_str());
+            return false;
+        }
+    }
+    // Contains the identity secret
+    OSUtils::lockDownFile(path.c_str(), false);
+    _path = path;
+    fseek(_f, 0, SEEK_END);
+    const long end = ftell(_f);
+    _size = (end > 0) ? (uint64_t)end : 0;
+    if (_size < ZTS_STATE_DB_FILE_MAGIC_LEN) {
+        if (! file_truncate(_f, 0) || (fwrite(ZTS_STATE_DB_FILE_MAGIC, ZTS_STATE_DB_FILE_MAGIC_LEN, 1, _f) != 1)
+            || (fflush(_f) != 0)) {
+            fprintf(stderr, "WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S, path.c_str());
+            closeLocked();
+            return false;
+        }
+        _size = ZTS_STATE_DB_FILE_MAGIC_LEN;
+    }
+#if defined(__WINDOWS__)
+    _mem.resize((size_t)_size);
+    fseek(_f, 0, SEEK_SET);
+    const bool loaded = (fread(_mem.data(), (size_t)_size, 1, _f) == 1);
+    fseek(_f, 0, SEEK_END);
+    _base = _mem.data();
+    if (! loaded) {
+#else
+    if (! mapFile(_size)) {
+#endif
+        fprintf(stderr, "WARNING: unable to read file: %s" ZT_EOL_S, path.c_str());
+        closeLocked();
+        return false;
+    }
+    if (memcmp(_base, ZTS_STATE_DB_FILE_MAGIC, ZTS_STATE_DB_FILE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "WARNING: not a state database: %s" ZT_EOL_S, path.c_str());
+        closeLocked();
+        return false;
+    }
+
+    uint64_t off = ZTS_STATE_DB_FILE_MAGIC_LEN;
+    while ((_size - off) >= ZTS_STATE_DB_RECORD_HDR_LEN) {
+        const char* hdr = _base + off;
+        uint32_t magic, t, len, check;
+        Key k;
+        int64_t timestamp;
+        memcpy(&magic, hdr, 4);
+        memcpy(&t, hdr + 4, 4);
+        memcpy(k.id, hdr + 8, 16);
+        memcpy(&timestamp, hdr + 24, 8);
+        memcpy(&len, hdr + 32, 4);
+        memcpy(&check, hdr + 36, 4);
+        if ((magic != ZTS_STATE_DB_RECORD_MAGIC) || ((_size - off - ZTS_STATE_DB_RECORD_HDR_LEN) < len)
+            || (record_check(hdr, hdr + ZTS_STATE_DB_RECORD_HDR_LEN, len) != check)) {
+            break;
+        }
+        k.type = (int)(t & ~ZTS_STATE_DB_REMOVED);
+        std::unordered_map<Key, Entry, KeyHash>::iterator e(_index.find(k));
+        if (e != _index.end()) {
+            _dead += ZTS_STATE_DB_RECORD_HDR_LEN + e->second.len;
+        }
+        if (t & ZTS_STATE_DB_REMOVED) {
+            if (e != _index.end()) {
+                _index.erase(e);
+            }
+            _dead += ZTS_STATE_DB_RECORD_HDR_LEN + len;
+        }
+        else {
+            Entry& n = _index[k];
+            n.offset = off;
+            n.len = len;
+            n.timestamp = timestamp;
+        }
+        off += ZTS_STATE_DB_RECORD_HDR_LEN + len;
+    }
+    if (off < _size) {
+        // Interrupted append
+        fprintf(stderr, "WARNING: discarding incomplete record at end of %s" ZT_EOL_S, path.c_str());
+        if (! file_truncate(_f, off)) {
+            closeLocked();
+            return false;
+        }
+        _size = off;
+#if defined(__WINDOWS__)
+        _mem.resize((size_t)_size);
+#endif
+    }
+    return true;
+}
+
+void StateDB::closeLocked()
+{
+#if defined(__WINDOWS__)
+    _mem.clear();
+#else
+    if (_base) {
+        munmap((void*)_base, (size_t)_mapped);
+    }
+#endif
+    _base = NULL;
+    _mapped = 0;
+    if (_f) {
+        fclose(_f);
+        _f = NULL;
+    }
+    _size = 0;
+    _dead = 0;
+    _index.clear();
+}
+
+bool StateDB::append(const Key& k, const void* data, uint32_t len, bool removed, int64_t timestamp)
+{
+    char hdr[ZTS_STATE_DB_RECORD_HDR_LEN];
+    record_header(hdr, k.type, k.id, timestamp, data, len, removed);
+    if (! record_write(_f, hdr, data, len) || (fflush(_f) != 0)) {
+        fprintf(stderr, "WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S, _path.c_str());
+        file_truncate(_f, _size);
+        return false;
+    }
+    const uint64_t size = _size + ZTS_STATE_DB_RECORD_HDR_LEN + len;
+#if defined(__WINDOWS__)
+    _mem.insert(_mem.end(), hdr, hdr + ZTS_STATE_DB_RECORD_HDR_LEN);
+    _mem.insert(_mem.end(), (const char*)data, (const char*)data + len);
+    _base = _mem.data();
+#else
+    if (! mapFile(size)) {
+        // The record is on storage but can't be read back, stop using the file
+        fprintf(stderr, "WARNING: unable to read file: %s" ZT_EOL_S, _path.c_str());
+        closeLocked();
+        return false;
+    }
+#endif
+    std::unordered_map<Key, Entry, KeyHash>::iterator e(_index.find(k));
+    if (e != _index.end()) {
+        _dead += ZTS_STATE_DB_RECORD_HDR_LEN + e->second.len;
+    }
+    if (removed) {
+        if (e != _index.end()) {
+            _index.erase(e);
+        }
+        _dead += ZTS_STATE_DB_RECORD_HDR_LEN;
+    }
+    else {
+        Entry& n = _index[k];
+        n.offset = _size;
+        n.len = len;
+        n.timestamp = timestamp;
+    }
+    _size = size;
+    return true;
+}
+
+bool StateDB::mapFile(uint64_t size)
+{
+#if defined(__WINDOWS__)
+    (void)size;
+    return true;
+#else
+    if (size <= _mapped) {
+        return true;
+    }
+    // Map past the end of the file so appends rarely need a new mapping. Only
+    // the part backed by the file is ever read.
+    uint64_t cap = (_mapped > 0) ? _mapped : ZTS_STATE_DB_MAP_MIN;
+    while (cap < size) {
+        cap <<= 1;
+    }
+    void* m = mmap(NULL, (size_t)cap, PROT_READ, MAP_SHARED, fileno(_f), 0);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    if (_base) {
+        munmap((void*)_base, (size_t)_mapped);
+    }
+    _base = (const char*)m;
+    _mapped = cap;
+    return true;
+#endif
+}
+
+const char* StateDB::recordData(const Entry& e) const
+{
+    return _base + e.offset + ZTS_STATE_DB_RECORD_HDR_LEN;
+}
+
+}   // namespace ZeroTier
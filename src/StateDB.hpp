@@ -0,0 +1,137 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Single-file, append-only store for node state objects
+ */
+
+#ifndef ZTS_STATE_DB_HPP
+#define ZTS_STATE_DB_HPP
+
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ZeroTier {
+
+/**
+ * All state objects in one log file. Every put appends a record and an
+ * in-memory index maps (type, id) to the newest record. The file is
+ * memory-mapped so lookups are plain memory reads. Records that have been
+ * superseded, removed or expired are dropped by compact(), which rewrites the
+ * file. Thread-safe.
+ */
+class StateDB {
+  public:
+    StateDB();
+    ~StateDB();
+
+    /**
+     * @brief Open (or create) the database and build its index. A record that
+     * was only partially written when the process last stopped is discarded.
+     *
+     * @return Whether the database is usable
+     */
+    bool open(const std::string& path);
+
+    void close();
+
+    bool isOpen() const
+    {
+        return _f != NULL;
+    }
+
+    /**
+     * @brief Store an object. An object identical to the stored one is only
+     * written again once a day, to keep its timestamp current.
+     *
+     * @return False on I/O error
+     */
+    bool put(int type, const uint64_t id[2], const void* data, unsigned int len);
+
+    /** Remove an object */
+    bool remove(int type, const uint64_t id[2]);
+
+    /**
+     * @brief Copy an object
+     *
+     * @return Number of bytes copied, -1 if there is no such object
+     */
+    int get(int type, const uint64_t id[2], void* data, unsigned int maxlen);
+
+    /** Return the first ID word of every object of a given type */
+    std::vector<uint64_t> list(int type);
+
+    /**
+     * @brief Remove expired objects, then rewrite the file without dead
+     * records if they take up more space than live ones
+     *
+     * @param expireType Type of objects that expire, or -1
+     * @param expireBefore Objects of expireType last written before this time (ms) are removed
+     */
+    void compact(int expireType, int64_t expireBefore);
+
+  private:
+    struct Key {
+        int type;
+        uint64_t id[2];
+
+        bool operator==(const Key& k) const
+        {
+            return (type == k.type) && (id[0] == k.id[0]) && (id[1] == k.id[1]);
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const
+        {
+            return (size_t)(k.id[0] ^ (k.id[1] * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)k.type << 56));
+        }
+    };
+
+    struct Entry {
+        uint64_t offset;   // Start of the record
+        uint32_t len;      // Length of the object
+        int64_t timestamp;
+    };
+
+    bool openLocked(const std::string& path);
+    void closeLocked();
+    void compactLocked(int expireType, int64_t expireBefore);
+    bool append(const Key& k, const void* data, uint32_t len, bool removed, int64_t timestamp);
+    bool mapFile(uint64_t size);
+    const char* recordData(const Entry& e) const;
+
+    std::mutex _m;
+    std::string _path;
+    FILE* _f;
+    // View of the file
+    const char* _base;
+    uint64_t _mapped;
+#if defined(__WINDOWS__)
+    std::vector<char> _mem;
+#endif
+    uint64_t _size;
+    // Bytes occupied by superseded and removal records
+    uint64_t _dead;
+    std::unordered_map<Key, Entry, KeyHash> _index;
+};
+
+}   // namespace ZeroTier
+
+#endif   // _H
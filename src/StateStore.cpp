@@ -0,0 +1,346 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Background persistence of node state objects
+ */
+
+#include "StateStore.hpp"
+
+#include "OSUtils.hpp"
+#include "StateDB.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__WINDOWS__)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ZeroTier {
+
+StateStore::StateStore() : _db(NULL), _compactPending(false), _compactType(-1), _compactBefore(0), _running(false)
+{
+}
+
+StateStore::~StateStore()
+{
+    stop();
+}
+
+void StateStore::start()
+{
+    std::lock_guard<std::mutex> _l(_m);
+    if (! _running) {
+        _running = true;
+        _thread = Thread::start(this);
+    }
+}
+
+void StateStore::setDB(StateDB* db)
+{
+    _db = db;
+}
+
+void StateStore::stop()
+{
+    {
+        std::lock_guard<std::mutex> _l(_m);
+        if (! _running) {
+            return;
+        }
+        _running = false;
+    }
+    _cv.notify_one();
+    Thread::join(_thread);
+}
+
+void StateStore::put(const std::string& path, const std::string& dir, const void* data, unsigned int len, bool secure)
+{
+    const uint64_t h = contentHash(data, len);
+    std::unique_lock<std::mutex> _l(_m);
+    std::map<std::string, uint64_t>::const_iterator w = _written.find(path);
+    if ((w != _written.end()) && (w->second == h) && (_inflight.find(path) == _inflight.end())) {
+        // Back to what is already stored, drop any newer write still pending
+        _pending.erase(path);
+        return;
+    }
+    if (! _running) {
+        _l.unlock();
+        Pending obj;
+        obj.dir = dir;
+        obj.data.assign((const char*)data, len);
+        obj.secure = secure;
+        obj.removed = false;
+        obj.db = false;
+        if (write(path, obj)) {
+            _l.lock();
+            _written[path] = h;
+        }
+        return;
+    }
+    Pending& obj = _pending[path];
+    obj.dir = dir;
+    obj.data.assign((const char*)data, len);
+    obj.secure = secure;
+    obj.removed = false;
+    obj.db = false;
+    _l.unlock();
+    _cv.notify_one();
+}
+
+void StateStore::remove(const std::string& path)
+{
+    std::unique_lock<std::mutex> _l(_m);
+    _written.erase(path);
+    if (! _running) {
+        _pending.erase(path);
+        _l.unlock();
+        OSUtils::rm(path.c_str());
+        return;
+    }
+    Pending& obj = _pending[path];
+    obj.dir.clear();
+    obj.data.clear();
+    obj.secure = false;
+    obj.removed = true;
+    obj.db = false;
+    _l.unlock();
+    _cv.notify_one();
+}
+
+void StateStore::put(int type, const uint64_t id[2], const void* data, unsigned int len)
+{
+    Pending obj;
+    obj.data.assign((const char*)data, len);
+    obj.secure = false;
+    obj.removed = false;
+    obj.db = true;
+    obj.type = type;
+    obj.id[0] = id[0];
+    obj.id[1] = id[1];
+    std::unique_lock<std::mutex> _l(_m);
+    if (! _running) {
+        _l.unlock();
+        writeDB(obj);
+        return;
+    }
+    _pending[dbKey(type, id)] = obj;
+    _l.unlock();
+    _cv.notify_one();
+}
+
+void StateStore::remove(int type, const uint64_t id[2])
+{
+    Pending obj;
+    obj.secure = false;
+    obj.removed = true;
+    obj.db = true;
+    obj.type = type;
+    obj.id[0] = id[0];
+    obj.id[1] = id[1];
+    std::unique_lock<std::mutex> _l(_m);
+    if (! _running) {
+        _l.unlock();
+        writeDB(obj);
+        return;
+    }
+    _pending[dbKey(type, id)] = obj;
+    _l.unlock();
+    _cv.notify_one();
+}
+
+bool StateStore::get(int type, const uint64_t id[2], void* data, unsigned int maxlen, int& n)
+{
+    return get(dbKey(type, id), data, maxlen, n);
+}
+
+void StateStore::compact(int expireType, int64_t expireBefore)
+{
+    std::unique_lock<std::mutex> _l(_m);
+    if (! _running) {
+        _l.unlock();
+        if (_db) {
+            _db->compact(expireType, expireBefore);
+        }
+        return;
+    }
+    _compactPending = true;
+    _compactType = expireType;
+    _compactBefore = expireBefore;
+    _l.unlock();
+    _cv.notify_one();
+}
+
+bool StateStore::get(const std::string& path, void* data, unsigned int maxlen, int& n)
+{
+    std::lock_guard<std::mutex> _l(_m);
+    std::map<std::string, Pending>::const_iterator p = _pending.find(path);
+    if (p == _pending.end()) {
+        p = _inflight.find(path);
+        if (p == _inflight.end()) {
+            return false;
+        }
+    }
+    if (p->second.removed) {
+        n = -1;
+        return true;
+    }
+    const unsigned int len = (p->second.data.length() < maxlen) ? (unsigned int)p->second.data.length() : maxlen;
+    memcpy(data, p->second.data.data(), len);
+    n = (int)len;
+    return true;
+}
+
+void StateStore::threadMain() throw()
+{
+    for (;;) {
+        bool compact = false;
+        int compactType = -1;
+        int64_t compactBefore = 0;
+        {
+            std::unique_lock<std::mutex> _l(_m);
+            while (_pending.empty() && ! _compactPending && _running) {
+                _cv.wait(_l);
+            }
+            if (_pending.empty() && ! _compactPending) {
+                return;   // Stopped and nothing left to write
+            }
+            _inflight.swap(_pending);
+            compact = _compactPending;
+            compactType = _compactType;
+            compactBefore = _compactBefore;
+            _compactPending = false;
+        }
+        // _inflight is only modified by this thread, get() may read it concurrently
+        for (std::map<std::string, Pending>::const_iterator i(_inflight.begin()); i != _inflight.end(); ++i) {
+            if (i->second.db) {
+                writeDB(i->second);
+                continue;
+            }
+            if (i->second.removed) {
+                OSUtils::rm(i->first.c_str());
+                continue;
+            }
+            const uint64_t h = contentHash(i->second.data.data(), (unsigned int)i->second.data.length());
+            bool known;
+            {
+                std::lock_guard<std::mutex> _l(_m);
+                known = (_written.find(i->first) != _written.end());
+            }
+            bool stored = false;
+            if (! known) {
+                // First write of this object since startup, it may already be
+                // on storage from a previous run
+                std::string existing;
+                if (OSUtils::readFile(i->first.c_str(), existing)) {
+                    stored = (existing == i->second.data);
+                }
+            }
+            if (! stored) {
+                stored = write(i->first, i->second);
+            }
+            std::lock_guard<std::mutex> _l(_m);
+            if (stored) {
+                _written[i->first] = h;
+            }
+            else {
+                _written.erase(i->first);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> _l(_m);
+            _inflight.clear();
+        }
+        // After the writes, so that compaction does not copy records they replace
+        if (compact && _db) {
+            _db->compact(compactType, compactBefore);
+        }
+    }
+}
+
+std::string StateStore::dbKey(int type, const uint64_t id[2])
+{
+    // Cannot collide with a file path, which never starts with a NUL
+    std::string k(1, '\0');
+    k.append((const char*)&type, sizeof(type));
+    k.append((const char*)id, 2 * sizeof(uint64_t));
+    return k;
+}
+
+uint64_t StateStore::contentHash(const void* data, unsigned int len)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < len; i++) {
+        h ^= ((const uint8_t*)data)[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ len;
+}
+
+bool StateStore::writeDB(const Pending& obj)
+{
+    if (! _db) {
+        return false;
+    }
+    if (obj.removed) {
+        return _db->remove(obj.type, obj.id);
+    }
+    return _db->put(obj.type, obj.id, obj.data.data(), (unsigned int)obj.data.length());
+}
+
+bool StateStore::write(const std::string& path, const Pending& obj)
+{
+    const std::string tmp(path + ".tmp");
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if ((! f) && (obj.dir.length() > 0)) {   // create subdirectory if it does not exist
+        OSUtils::mkdir(obj.dir);
+        f = fopen(tmp.c_str(), "wb");
+    }
+    if (! f) {
+        fprintf(stderr, "WARNING: unable to write to file: %s (unable to open)" ZT_EOL_S, tmp.c_str());
+        return false;
+    }
+    bool ok = (obj.data.length() == 0) || (fwrite(obj.data.data(), obj.data.length(), 1, f) == 1);
+    ok = ok && (fflush(f) == 0);
+#if ! defined(__WINDOWS__)
+    // Make sure the content is durable before the rename makes it visible
+    ok = ok && (fsync(fileno(f)) == 0);
+#endif
+    fclose(f);
+    if (! ok) {
+        fprintf(stderr, "WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S, tmp.c_str());
+        OSUtils::rm(tmp.c_str());
+        return false;
+    }
+    if (obj.secure) {
+        OSUtils::lockDownFile(tmp.c_str(), false);
+    }
+#if defined(__WINDOWS__)
+    ok = (MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+    ok = (rename(tmp.c_str(), path.c_str()) == 0);
+#endif
+    if (! ok) {
+        fprintf(stderr, "WARNING: unable to write to file: %s (unable to rename)" ZT_EOL_S, path.c_str());
+        OSUtils::rm(tmp.c_str());
+    }
+    return ok;
+}
+
+}   // namespace ZeroTier
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Background persistence of node state objects
+ */
+
+#ifndef ZTS_STATE_STORE_HPP
+#define ZTS_STATE_STORE_HPP
+
+#include "Thread.hpp"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+namespace ZeroTier {
+
+class StateDB;
+
+/**
+ * Writes state objects to storage on its own thread. Repeated writes of an
+ * object that has not been flushed yet are coalesced, and writes of content
+ * identical to what was last written are skipped. Files are replaced
+ * atomically by writing a temporary file and renaming it. Objects addressed
+ * by type and ID go to a state database instead, if one is set.
+ */
+class StateStore {
+  public:
+    StateStore();
+    ~StateStore();
+
+    /** Start the writer thread. Until then writes happen synchronously */
+    void start();
+
+    /** Set the database that objects addressed by type and ID are written to, before start() */
+    void setDB(StateDB* db);
+
+    /** Write everything still pending and stop the writer thread */
+    void stop();
+
+    /**
+     * @brief Schedule a write
+     *
+     * @param path File to (re)place
+     * @param dir Directory to create if the file cannot be created, may be empty
+     * @param data Content
+     * @param len Length of content
+     * @param secure Restrict file permissions to the current user
+     */
+    void put(const std::string& path, const std::string& dir, const void* data, unsigned int len, bool secure);
+
+    /** Schedule the removal of a file */
+    void remove(const std::string& path);
+
+    /**
+     * @brief Read an object that has been put or removed but not yet written
+     *
+     * @param n Set to the length of the object, or -1 if it is being removed
+     * @return Whether a write is pending for the object
+     */
+    bool get(const std::string& path, void* data, unsigned int maxlen, int& n);
+
+    /** Schedule a write of a database object */
+    void put(int type, const uint64_t id[2], const void* data, unsigned int len);
+
+    /** Schedule the removal of a database object */
+    void remove(int type, const uint64_t id[2]);
+
+    /** Read a database object that has been put or removed but not yet written, see above */
+    bool get(int type, const uint64_t id[2], void* data, unsigned int maxlen, int& n);
+
+    /** Schedule a StateDB::compact() of the database */
+    void compact(int expireType, int64_t expireBefore);
+
+    void threadMain() throw();
+
+  private:
+    struct Pending {
+        std::string dir;
+        std::string data;
+        bool secure;
+        bool removed;
+        // Database object, the path is then only a key built by dbKey()
+        bool db;
+        int type;
+        uint64_t id[2];
+    };
+
+    static std::string dbKey(int type, const uint64_t id[2]);
+
+    static uint64_t contentHash(const void* data, unsigned int len);
+
+    /** Write one database object, returns whether it is now in the database */
+    bool writeDB(const Pending& obj);
+
+    /** Write one object, returns whether it is now on storage */
+    static bool write(const std::string& path, const Pending& obj);
+
+    std::mutex _m;
+    std::condition_variable _cv;
+    // Objects put but not yet picked up by the writer thread
+    std::map<std::string, Pending> _pending;
+    // Objects being written by the writer thread
+    std::map<std::string, Pending> _inflight;
+    // Hash of the content last written to each file
+    std::map<std::string, uint64_t> _written;
+    // Set before the writer thread starts and not changed while it runs
+    StateDB* _db;
+    // Compaction requested and not yet started, with its arguments
+    bool _compactPending;
+    int _compactType;
+    int64_t _compactBefore;
+    bool _running;
+    Thread _thread;
+};
+
+}   // namespace ZeroTier
+
+#endif   // _H
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Low-overhead counters that are always compiled in
+ */
+
+#include "Stats.hpp"
+
+#include "Mutex.hpp"
+
+namespace ZeroTier {
+
+// Guards the list of live blocks and the retired totals. Only taken when a
+// thread first touches a counter, when it exits, and when summing.
+static Mutex& stats_m()
+{
+    static Mutex m;
+    return m;
+}
+
+static zts_stats_block* _liveBlocks = NULL;
+
+// Totals of threads that have exited
+static uint64_t _retired[ZTS_STAT_COUNT] = { 0 };
+
+thread_local zts_stats_block _zts_thread_stats;
+
+zts_stats_block::zts_stats_block()
+{
+    for (int i = 0; i < ZTS_STAT_COUNT; i++) {
+        c[i].store(0, std::memory_order_relaxed);
+    }
+    Mutex::Lock _l(stats_m());
+    next = _liveBlocks;
+    _liveBlocks = this;
+}
+
+zts_stats_block::~zts_stats_block()
+{
+    Mutex::Lock _l(stats_m());
+    for (int i = 0; i < ZTS_STAT_COUNT; i++) {
+        _retired[i] += c[i].load(std::memory_order_relaxed);
+    }
+    zts_stats_block** b = &_liveBlocks;
+    while (*b) {
+        if (*b == this) {
+            *b = next;
+            break;
+        }
+        b = &((*b)->next);
+    }
+}
+
+uint64_t zts_stats_sum(zts_stat_id id)
+{
+    Mutex::Lock _l(stats_m());
+    uint64_t total = _retired[id];
+    for (zts_stats_block* b = _liveBlocks; b; b = b->next) {
+        total += b->c[id].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+}   // namespace ZeroTier
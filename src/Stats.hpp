@@ -0,0 +1,76 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Low-overhead counters that are always compiled in
+ */
+
+#ifndef ZTS_STATS_HPP
+#define ZTS_STATS_HPP
+
+#include <atomic>
+#include <stdint.h>
+
+namespace ZeroTier {
+
+/**
+ * Counter identifiers
+ */
+enum zts_stat_id {
+    ZTS_STAT_LINK_TX = 0,
+    ZTS_STAT_LINK_RX,
+    ZTS_STAT_LINK_DROP,
+    ZTS_STAT_LINK_ERR,
+    ZTS_STAT_LINK_COPY,   // Frames copied between the core and the stack
+    ZTS_STAT_MEM_ALLOC,   // Heap allocations made by the stack and its driver
+    ZTS_STAT_TCP_TX,      // TCP segments sent, counted by the TCP output hook
+    ZTS_STAT_TCP_RX,      // TCP segments delivered to a pcb, counted by the TCP input hook
+    ZTS_STAT_COUNT
+};
+
+/**
+ * A set of counters owned by one thread. Only the owning thread writes to it,
+ * readers may load it at any time to produce an aggregate.
+ */
+struct zts_stats_block {
+    std::atomic<uint64_t> c[ZTS_STAT_COUNT];
+    zts_stats_block* next;
+
+    zts_stats_block();
+    ~zts_stats_block();
+};
+
+extern thread_local zts_stats_block _zts_thread_stats;
+
+/**
+ * @brief Add to a counter of the calling thread
+ *
+ * @usage Safe to call from any thread, no locks or atomic read-modify-write
+ * instructions are involved
+ */
+inline void zts_stats_add(zts_stat_id id, uint64_t n = 1)
+{
+    std::atomic<uint64_t>& c = _zts_thread_stats.c[id];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Sum a counter across all threads, including threads that have exited
+ */
+uint64_t zts_stats_sum(zts_stat_id id);
+
+}   // namespace ZeroTier
+
+#endif   // _H
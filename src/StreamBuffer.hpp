@@ -0,0 +1,121 @@
+/*
+ * Copyright (c)2013-2021 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2026-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Fixed-capacity circular byte queue for stream I/O
+ */
+
+#ifndef ZTS_STREAM_BUFFER_HPP
+#define ZTS_STREAM_BUFFER_HPP
+
+#include <string.h>
+
+namespace ZeroTier {
+
+/**
+ * A circular byte queue. Bytes are appended at the tail and consumed from the
+ * head without moving the remaining data. Not thread-safe.
+ */
+class StreamBuffer {
+  public:
+    /**
+     * @param capacity Maximum number of queued bytes, must be a power of two
+     */
+    StreamBuffer(unsigned long capacity) : _buf(new char[capacity]), _mask(capacity - 1), _head(0), _tail(0)
+    {
+    }
+
+    ~StreamBuffer()
+    {
+        delete[] _buf;
+    }
+
+    /** Number of queued bytes */
+    inline unsigned long size() const
+    {
+        return _tail - _head;
+    }
+
+    /** Number of bytes that can still be appended */
+    inline unsigned long space() const
+    {
+        return (_mask + 1) - size();
+    }
+
+    /**
+     * @brief Append bytes
+     *
+     * @return False (and nothing is appended) if there is not enough space
+     */
+    inline bool append(const void* data, unsigned long len)
+    {
+        if (len > space()) {
+            return false;
+        }
+        const unsigned long at = _tail & _mask;
+        const unsigned long first = ((_mask + 1) - at < len) ? (_mask + 1) - at : len;
+        memcpy(_buf + at, data, first);
+        memcpy(_buf, (const char*)data + first, len - first);
+        _tail += len;
+        return true;
+    }
+
+    /**
+     * @brief Get the queued bytes as up to two contiguous segments
+     *
+     * @return Number of segments (0, 1 or 2)
+     */
+    inline unsigned int peek(const void* seg[2], unsigned long seglen[2]) const
+    {
+        const unsigned long len = size();
+        if (! len) {
+            return 0;
+        }
+        const unsigned long at = _head & _mask;
+        seg[0] = _buf + at;
+        seglen[0] = ((_mask + 1) - at < len) ? (_mask + 1) - at : len;
+        if (seglen[0] == len) {
+            return 1;
+        }
+        seg[1] = _buf;
+        seglen[1] = len - seglen[0];
+        return 2;
+    }
+
+    /** Discard bytes from the head */
+    inline void consume(unsigned long len)
+    {
+        _head += (len < size()) ? len : size();
+    }
+
+    inline void clear()
+    {
+        _head = _tail = 0;
+    }
+
+  private:
+    StreamBuffer(const StreamBuffer&);
+    StreamBuffer& operator=(const StreamBuffer&);
+
+    char* _buf;
+    const unsigned long _mask;
+    // Free-running positions, only ever masked on access
+    unsigned long _head;
+    unsigned long _tail;
+};
+
+}   // namespace ZeroTier
+
+#endif   // _H
@@ -29,21 +29,25 @@
 #include "lwip/tcpip.h"
 #include "netif/ethernet.h"
 
-#ifdef LWIP_STATS
-#include "lwip/stats.h"
-#endif
-
 #include "Events.hpp"
+#include "Stats.hpp"
 #include "VirtualTap.hpp"
-
-#if defined(__WINDOWS__)
-#include "synchapi.h"
-
-#include <time.h>
-#endif
-
-#define ZTS_TAP_THREAD_POLLING_INTERVAL 50
-#define LWIP_DRIVER_LOOP_INTERVAL       100
+#include "concurrentqueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of received frames queued on a tap before they are flushed into the
+// stack without waiting for the service loop to do it
+#define ZTS_RX_BATCH_MAX 64
+// Default upper bound on the number of receive buffers allocated for the pool
+#define ZTS_RX_PBUF_POOL_MAX PBUF_POOL_SIZE
+// Size of a pooled receive buffer, larger frames use a regular pbuf
+#define ZTS_RX_PBUF_BUFSIZE (LWIP_MTU + 32)
+// Prepended to each lwIP heap allocation to remember its size, keeps alignment
+#define ZTS_MEM_HEADER_SIZE 16
 
 namespace ZeroTier {
 
@@ -75,36 +79,22 @@ VirtualTap::VirtualTap(
     , _arg(arg)
     , _initialized(false)
     , _enabled(true)
-    , _run(true)
     , _mac(mac)
     , _mtu(mtu)
     , _net_id(net_id)
-    , _phy(this, false, true)
 {
+    // Frames are moved by the service thread (wire to stack) and by lwIP's
+    // thread (stack to wire), a tap needs neither a thread nor descriptors
     OSUtils::ztsnprintf(vtap_full_name, VTAP_NAME_LEN, "libzt-vtap-%llx", _net_id);
-#ifndef __WINDOWS__
-    ::pipe(_shutdownSignalPipe);
-#endif
-    // Start virtual tap thread and stack I/O loops
-    _thread = Thread::start(this);
 }
 
 VirtualTap::~VirtualTap()
 {
-    _run = false;
-#ifndef __WINDOWS__
-    ::write(_shutdownSignalPipe[1], "\0", 1);
-#endif
-    _phy.whack();
+    flush();
     zts_lwip_remove_netif(netif4);
     netif4 = NULL;
     zts_lwip_remove_netif(netif6);
     netif6 = NULL;
-    Thread::join(_thread);
-#ifndef __WINDOWS__
-    ::close(_shutdownSignalPipe[0]);
-    ::close(_shutdownSignalPipe[1]);
-#endif
 }
 
 void VirtualTap::lastConfigUpdate(uint64_t lastConfigUpdateTime)
@@ -209,6 +199,11 @@ void VirtualTap::put(const MAC& from, const MAC& to, unsigned int etherType, con
     }
 }
 
+void VirtualTap::flush()
+{
+    zts_lwip_eth_rx_flush(this);
+}
+
 void VirtualTap::scanMulticastGroups(std::vector<MulticastGroup>& added, std::vector<MulticastGroup>& removed)
 {
     std::vector<MulticastGroup> newGroups;
@@ -236,44 +231,16 @@ void VirtualTap::setMtu(unsigned int mtu)
     _mtu = mtu;
 }
 
-void VirtualTap::threadMain() throw()
-{
-    fd_set readfds, nullfds;
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    FD_ZERO(&readfds);
-    FD_ZERO(&nullfds);
-    int nfds = (int)std::max(_shutdownSignalPipe[0], 0) + 1;
-#if defined(__linux__)
-    // pthread_setname_np(pthread_self(), vtap_full_name);
-#endif
-#if defined(__APPLE__)
-    // pthread_setname_np(vtap_full_name);
-#endif
-    while (true) {
-        FD_SET(_shutdownSignalPipe[0], &readfds);
-        select(nfds, &readfds, &nullfds, &nullfds, &tv);
-        // writes to shutdown pipe terminate thread
-        if (FD_ISSET(_shutdownSignalPipe[0], &readfds)) {
-            break;
-        }
-#if defined(__WINDOWS__)
-        Sleep(ZTS_TAP_THREAD_POLLING_INTERVAL);
-#else
-        struct timespec sleepValue = { 0, 0 };
-        sleepValue.tv_nsec = ZTS_TAP_THREAD_POLLING_INTERVAL * 500000;
-        nanosleep(&sleepValue, NULL);
-#endif
-    }
-}
-
 //----------------------------------------------------------------------------//
 // Netif driver code for lwIP network stack                                   //
 //----------------------------------------------------------------------------//
 
-bool _has_exited = false;
-bool _has_started = false;
+// Whether lwIP has been started, and whether it has since been shut down.
+// lwIP can only be started once per process. Guarded by lwip_state_m.
+static bool _has_started = false;
+static bool _has_exited = false;
+
+static void zts_rx_pbuf_pool_close();
 
 // Used to generate enumerated lwIP interface names
 int netifCount = 0;
@@ -287,38 +254,10 @@ static void zts_tcpip_init_done(void* arg)
     sys_sem_t* sem;
     sem = (sys_sem_t*)arg;
     zts_events->setState(ZTS_STATE_STACK_RUNNING);
-    _has_started = true;
     // zts_events->enqueue(ZTS_EVENT_STACK_UP, NULL);
     sys_sem_signal(sem);
 }
 
-static void zts_main_lwip_driver_loop(void* arg)
-{
-#if defined(__linux__)
-    // pthread_setname_np(pthread_self(), ZTS_LWIP_THREAD_NAME);
-#endif
-#if defined(__APPLE__)
-    // pthread_setname_np(ZTS_LWIP_THREAD_NAME);
-#endif
-    sys_sem_t sem;
-    LWIP_UNUSED_ARG(arg);
-    if (sys_sem_new(&sem, 0) != ERR_OK) {
-        // DEBUG_ERROR("failed to create semaphore");
-    }
-    tcpip_init(zts_tcpip_init_done, &sem);
-    sys_sem_wait(&sem);
-    // Main loop
-    while (zts_events->getState(ZTS_STATE_STACK_RUNNING)) {
-        zts_util_delay(LWIP_DRIVER_LOOP_INTERVAL);
-    }
-    _has_exited = true;
-    
-    //
-    // no need to check if event was enqueued since NULL is being passed
-    //
-    zts_events->enqueue(ZTS_EVENT_STACK_DOWN, NULL);
-}
-
 bool zts_lwip_is_up()
 {
     Mutex::Lock _l(lwip_state_m);
@@ -327,38 +266,38 @@ bool zts_lwip_is_up()
 
 void zts_lwip_driver_init()
 {
-    if (zts_lwip_is_up()) {
-        return;
-    }
-    if (_has_exited) {
+    Mutex::Lock _l(lwip_state_m);
+    if (_has_started) {
         return;
     }
-    Mutex::Lock _l(lwip_state_m);
 #if defined(__WINDOWS__)
     sys_init();   // Required for win32 init of critical sections
 #endif
-    sys_thread_new(
-        ZTS_LWIP_THREAD_NAME,
-        zts_main_lwip_driver_loop,
-        NULL,
-        DEFAULT_THREAD_STACKSIZE,
-        DEFAULT_THREAD_PRIO);
+    sys_sem_t sem;
+    if (sys_sem_new(&sem, 0) != ERR_OK) {
+        return;
+    }
+    // lwIP runs on the thread created here, wait only until it is ready
+    tcpip_init(zts_tcpip_init_done, &sem);
+    sys_sem_wait(&sem);
+    sys_sem_free(&sem);
+    _has_started = true;
 }
 
 void zts_lwip_driver_shutdown()
 {
-    if (_has_exited) {
+    Mutex::Lock _l(lwip_state_m);
+    if (! _has_started || _has_exited) {
         return;
     }
-    Mutex::Lock _l(lwip_state_m);
     // Set flag to stop sending frames into the core
     zts_events->clrState(ZTS_STATE_STACK_RUNNING);
-    // Wait until the main lwIP thread has exited
-    if (_has_started) {
-        while (! _has_exited) {
-            zts_util_delay(LWIP_DRIVER_LOOP_INTERVAL);
-        }
-    }
+    _has_exited = true;
+    zts_rx_pbuf_pool_close();
+    //
+    // no need to check if event was enqueued since NULL is being passed
+    //
+    zts_events->enqueue(ZTS_EVENT_STACK_DOWN, NULL);
 }
 
 void zts_lwip_remove_netif(void* netif)
@@ -376,37 +315,263 @@ void zts_lwip_remove_netif(void* netif)
 
 signed char zts_lwip_eth_tx(struct netif* n, struct pbuf* p)
 {
-    if (! n) {
+    if (! n || ! p) {
         return ERR_IF;
     }
-    struct pbuf* q;
-    char buf[ZT_MAX_MTU + 32] = { 0 };
-    char* bufptr;
-    int totalLength = 0;
-
+    if (p->tot_len < sizeof(struct eth_hdr) || p->tot_len > (ZT_MAX_MTU + 32)) {
+        zts_stats_add(ZTS_STAT_LINK_ERR);
+        return ERR_BUF;
+    }
     VirtualTap* tap = (VirtualTap*)n->state;
-    bufptr = buf;
-    for (q = p; q != NULL; q = q->next) {
-        memcpy(bufptr, q->payload, q->len);
-        bufptr += q->len;
-        totalLength += q->len;
+    char* frame = NULL;
+    // Only gather segmented chains, a single pbuf is handed to the core as-is.
+    // The buffer is not zero-filled since exactly tot_len bytes are copied
+    // into it and nothing past that is read.
+    char buf[ZT_MAX_MTU + 32];
+    if (p->len == p->tot_len) {
+        frame = (char*)p->payload;
+    }
+    else {
+        if (pbuf_copy_partial(p, buf, p->tot_len, 0) != p->tot_len) {
+            zts_stats_add(ZTS_STAT_LINK_ERR);
+            return ERR_BUF;
+        }
+        zts_stats_add(ZTS_STAT_LINK_COPY);
+        frame = buf;
     }
-    struct eth_hdr* ethhdr;
-    ethhdr = (struct eth_hdr*)buf;
+    struct eth_hdr* ethhdr = (struct eth_hdr*)frame;
 
     MAC src_mac;
     MAC dest_mac;
     src_mac.setTo(ethhdr->src.addr, 6);
     dest_mac.setTo(ethhdr->dest.addr, 6);
 
-    char* data = buf + sizeof(struct eth_hdr);
-    int len = totalLength - sizeof(struct eth_hdr);
+    char* data = frame + sizeof(struct eth_hdr);
+    int len = p->tot_len - sizeof(struct eth_hdr);
     int proto = Utils::ntoh((uint16_t)ethhdr->type);
     tap->_handler(tap->_arg, NULL, tap->_net_id, src_mac, dest_mac, proto, 0, data, len);
+    zts_stats_add(ZTS_STAT_LINK_TX);
 
     return ERR_OK;
 }
 
+//----------------------------------------------------------------------------//
+// Stack limits                                                               //
+//----------------------------------------------------------------------------//
+
+// Effective limits with defaults filled in, a zero mem_limit means unlimited.
+// Only changed before the stack is started, guarded by lwip_state_m.
+zts_stack_limits_t zts_stack_limits = { 0, MEMP_NUM_NETCONN, ZTS_RX_PBUF_POOL_MAX, TCP_SND_BUF, TCP_WND, 0, 0 };
+
+// Bytes allocated by lwIP and the receive buffer pool
+static std::atomic<uint64_t> _memUsed(0);
+
+int zts_lwip_set_stack_limits(const zts_stack_limits_t* limits)
+{
+    Mutex::Lock _l(lwip_state_m);
+    if (_has_started) {
+        return ZTS_ERR_SERVICE;
+    }
+    zts_stack_limits.mem_limit = limits->mem_limit;
+    zts_stack_limits.max_sockets = limits->max_sockets ? std::min(limits->max_sockets, (unsigned int)MEMP_NUM_NETCONN)
+                                                       : (unsigned int)MEMP_NUM_NETCONN;
+    zts_stack_limits.rx_buffers = limits->rx_buffers ? limits->rx_buffers : ZTS_RX_PBUF_POOL_MAX;
+    zts_stack_limits.tcp_snd_buf = TCP_SND_BUF;
+    if (limits->tcp_snd_buf) {
+        zts_stack_limits.tcp_snd_buf = std::max(std::min(limits->tcp_snd_buf, (unsigned int)TCP_SND_BUF), 2U * TCP_MSS);
+    }
+    zts_stack_limits.tcp_rcv_wnd = TCP_WND;
+    if (limits->tcp_rcv_wnd) {
+        zts_stack_limits.tcp_rcv_wnd = std::max(std::min(limits->tcp_rcv_wnd, (unsigned int)TCP_WND), 2U * TCP_MSS);
+    }
+    zts_stack_limits.tcp_autotune = limits->tcp_autotune;
+    zts_stack_limits.tcp_autotune_mem = limits->tcp_autotune_mem;
+    return ZTS_ERR_OK;
+}
+
+uint64_t zts_lwip_mem_used()
+{
+    return _memUsed.load();
+}
+
+// Account for an allocation, fails if it would exceed the budget
+static bool zts_mem_reserve(uint64_t n)
+{
+    const uint64_t used = _memUsed.fetch_add(n) + n;
+    if (zts_stack_limits.mem_limit && (used > zts_stack_limits.mem_limit)) {
+        _memUsed.fetch_sub(n);
+        return false;
+    }
+    return true;
+}
+
+}   // namespace ZeroTier
+
+// Heap functions for lwIP (mem_clib_* in lwipopts.h)
+extern "C" {
+
+void* zts_lwip_mem_malloc(size_t size)
+{
+    const uint64_t n = (uint64_t)size + ZTS_MEM_HEADER_SIZE;
+    if (! ZeroTier::zts_mem_reserve(n)) {
+        return NULL;
+    }
+    ZeroTier::zts_stats_add(ZeroTier::ZTS_STAT_MEM_ALLOC);
+    char* p = (char*)malloc((size_t)n);
+    if (! p) {
+        ZeroTier::_memUsed.fetch_sub(n);
+        return NULL;
+    }
+    *((size_t*)p) = size;
+    return p + ZTS_MEM_HEADER_SIZE;
+}
+
+void* zts_lwip_mem_calloc(size_t count, size_t size)
+{
+    if (size && (count > ((size_t)-1 - ZTS_MEM_HEADER_SIZE) / size)) {
+        return NULL;
+    }
+    void* p = zts_lwip_mem_malloc(count * size);
+    if (p) {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+void zts_lwip_mem_free(void* ptr)
+{
+    if (! ptr) {
+        return;
+    }
+    char* p = (char*)ptr - ZTS_MEM_HEADER_SIZE;
+    ZeroTier::_memUsed.fetch_sub(*((size_t*)p) + ZTS_MEM_HEADER_SIZE);
+    free(p);
+}
+
+}   // extern "C"
+
+namespace ZeroTier {
+
+//----------------------------------------------------------------------------//
+// Receive buffer pool                                                        //
+//----------------------------------------------------------------------------//
+
+/**
+ * A receive buffer handed to the stack as a custom pbuf. When lwIP frees the
+ * pbuf the buffer is put back into the pool instead of being deallocated.
+ */
+struct zts_rx_pbuf {
+    struct pbuf_custom pc;   // Must be first
+    char buf[ZTS_RX_PBUF_BUFSIZE];
+};
+
+static moodycamel::ConcurrentQueue<zts_rx_pbuf*> _rxPbufPool;
+static std::atomic<int> _rxPbufCount(0);
+// Set once the stack has been shut down, buffers are then freed when released
+static std::atomic<bool> _rxPbufPoolClosed(false);
+
+static void zts_rx_pbuf_delete(zts_rx_pbuf* rp)
+{
+    delete rp;
+    _rxPbufCount.fetch_sub(1);
+    _memUsed.fetch_sub(sizeof(zts_rx_pbuf));
+}
+
+// Called by lwIP from whichever thread releases the last reference
+static void zts_rx_pbuf_free(struct pbuf* p)
+{
+    if (_rxPbufPoolClosed.load()) {
+        zts_rx_pbuf_delete((zts_rx_pbuf*)p);
+        return;
+    }
+    _rxPbufPool.enqueue((zts_rx_pbuf*)p);
+}
+
+// Free the pooled buffers, those still held by the stack are freed as they
+// are released
+static void zts_rx_pbuf_pool_close()
+{
+    _rxPbufPoolClosed.store(true);
+    zts_rx_pbuf* rp = NULL;
+    while (_rxPbufPool.try_dequeue(rp)) {
+        zts_rx_pbuf_delete(rp);
+    }
+}
+
+static struct pbuf* zts_rx_pbuf_alloc(uint16_t len)
+{
+    zts_rx_pbuf* rp = NULL;
+    if (len <= ZTS_RX_PBUF_BUFSIZE && ! _rxPbufPool.try_dequeue(rp)) {
+        // Pooled buffers are never freed, they stay counted against the budget
+        if ((_rxPbufCount.fetch_add(1) < (int)zts_stack_limits.rx_buffers)
+            && zts_mem_reserve(sizeof(zts_rx_pbuf))) {
+            rp = new zts_rx_pbuf;
+        }
+        else {
+            _rxPbufCount.fetch_sub(1);
+        }
+    }
+    if (! rp) {
+        // Oversized frame, pool exhausted or over budget
+        return pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    }
+    rp->pc.custom_free_function = zts_rx_pbuf_free;
+    return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &rp->pc, rp->buf, ZTS_RX_PBUF_BUFSIZE);
+}
+
+// Feeds the queued frames into the stack. Only the swap of the queues happens
+// under tap->_rxq_m, so receive workers keep queueing frames while the stack
+// processes a batch. tap->_rxInject_m keeps batches in the order they were
+// queued. See NodeService::flushTaps() for the lock order.
+static void zts_lwip_eth_rx_inject(VirtualTap* tap)
+{
+    Mutex::Lock _il(tap->_rxInject_m);
+    {
+        Mutex::Lock _l(tap->_rxq_m);
+        if (tap->_rxq4.empty() && tap->_rxq6.empty()) {
+            return;
+        }
+        tap->_rxInject4.swap(tap->_rxq4);
+        tap->_rxInject6.swap(tap->_rxq6);
+    }
+    std::vector<void*>& q4 = tap->_rxInject4;
+    std::vector<void*>& q6 = tap->_rxInject6;
+    if (! zts_events->getState(ZTS_STATE_STACK_RUNNING)) {
+        zts_stats_add(ZTS_STAT_LINK_DROP, q4.size() + q6.size());
+        for (size_t i = 0; i < q4.size(); i++) {
+            pbuf_free((struct pbuf*)q4[i]);
+        }
+        for (size_t i = 0; i < q6.size(); i++) {
+            pbuf_free((struct pbuf*)q6[i]);
+        }
+        q4.clear();
+        q6.clear();
+        return;
+    }
+    // The netif input function (tcpip_input) would take the core lock once
+    // per frame, instead take it once and call the Ethernet layer directly.
+    LOCK_TCPIP_CORE();
+    struct netif* n = (struct netif*)tap->netif4;
+    for (size_t i = 0; i < q4.size(); i++) {
+        struct pbuf* p = (struct pbuf*)q4[i];
+        if (! n || ethernet_input(p, n) != ERR_OK) {
+            zts_stats_add(ZTS_STAT_LINK_DROP);
+            pbuf_free(p);
+        }
+    }
+    n = (struct netif*)tap->netif6;
+    for (size_t i = 0; i < q6.size(); i++) {
+        struct pbuf* p = (struct pbuf*)q6[i];
+        if (! n || ethernet_input(p, n) != ERR_OK) {
+            zts_stats_add(ZTS_STAT_LINK_DROP);
+            pbuf_free(p);
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+    q4.clear();
+    q6.clear();
+}
+
 void zts_lwip_eth_rx(
     VirtualTap* tap,
     const MAC& from,
@@ -415,63 +580,64 @@ void zts_lwip_eth_rx(
     const void* data,
     unsigned int len)
 {
-#ifdef LWIP_STATS
-    stats_display();
-#endif
+    zts_stats_add(ZTS_STAT_LINK_RX);
     if (! zts_events->getState(ZTS_STATE_STACK_RUNNING)) {
+        zts_stats_add(ZTS_STAT_LINK_DROP);
+        return;
+    }
+    bool isV4 = (etherType == 0x800 || etherType == 0x806);
+    bool isV6 = (etherType == 0x86DD);
+    if ((! isV4 || ! tap->netif4) && (! isV6 || ! tap->netif6)) {
+        zts_stats_add(ZTS_STAT_LINK_DROP);
+        return;
+    }
+    if ((len + sizeof(struct eth_hdr)) > 0xffff) {
+        zts_stats_add(ZTS_STAT_LINK_ERR);
         return;
     }
-    struct pbuf *p, *q;
     struct eth_hdr ethhdr;
     from.copyTo(ethhdr.src.addr, 6);
     to.copyTo(ethhdr.dest.addr, 6);
     ethhdr.type = Utils::hton((uint16_t)etherType);
 
-    p = pbuf_alloc(PBUF_RAW, (uint16_t)len + sizeof(struct eth_hdr), PBUF_RAM);
+    struct pbuf* p = zts_rx_pbuf_alloc((uint16_t)(len + sizeof(struct eth_hdr)));
     if (! p) {
         // DEBUG_ERROR("dropped packet: unable to allocate memory for
         // pbuf");
+        zts_stats_add(ZTS_STAT_LINK_DROP);
         return;
     }
-    // First pbuf gets Ethernet header at start
-    q = p;
-    if (q->len < sizeof(ethhdr)) {
+    // Copy Ethernet header and frame data into pbuf
+    if (pbuf_take(p, &ethhdr, sizeof(ethhdr)) != ERR_OK
+        || pbuf_take_at(p, data, (uint16_t)len, sizeof(ethhdr)) != ERR_OK) {
+        zts_stats_add(ZTS_STAT_LINK_ERR);
         pbuf_free(p);
-        p = NULL;
-        // DEBUG_ERROR("dropped packet: first pbuf smaller than Ethernet
-        // header");
         return;
     }
-    // Copy frame data into pbuf
-    const char* dataptr = reinterpret_cast<const char*>(data);
-    memcpy(q->payload, &ethhdr, sizeof(ethhdr));
-    int remainingPayloadSpace = q->len - sizeof(ethhdr);
-    memcpy((char*)q->payload + sizeof(ethhdr), dataptr, remainingPayloadSpace);
-    dataptr += remainingPayloadSpace;
-    // Remaining pbufs (if any) get rest of data
-    while ((q = q->next)) {
-        memcpy(q->payload, dataptr, q->len);
-        dataptr += q->len;
-    }
-    // Feed packet into stack
-    int err;
-
-    if (Utils::ntoh(ethhdr.type) == 0x800 || Utils::ntoh(ethhdr.type) == 0x806) {
-        if (tap->netif4) {
-            if ((err = ((struct netif*)tap->netif4)->input(p, (struct netif*)tap->netif4)) != ERR_OK) {
-                // DEBUG_ERROR("packet input error (%d)", err);
-                pbuf_free(p);
-            }
+    zts_stats_add(ZTS_STAT_LINK_COPY);
+    // Queue packet for the stack
+    bool full;
+    {
+        Mutex::Lock _l(tap->_rxq_m);
+        if (isV4) {
+            tap->_rxq4.push_back((void*)p);
         }
-    }
-    if (Utils::ntoh(ethhdr.type) == 0x86DD) {
-        if (tap->netif6) {
-            if ((err = ((struct netif*)tap->netif6)->input(p, (struct netif*)tap->netif6)) != ERR_OK) {
-                // DEBUG_ERROR("packet input error (%d)", err);
-                pbuf_free(p);
-            }
+        else {
+            tap->_rxq6.push_back((void*)p);
         }
+        full = (tap->_rxq4.size() + tap->_rxq6.size()) >= ZTS_RX_BATCH_MAX;
+    }
+    if (full) {
+        zts_lwip_eth_rx_inject(tap);
+    }
+}
+
+void zts_lwip_eth_rx_flush(VirtualTap* tap)
+{
+    if (! tap) {
+        return;
     }
+    zts_lwip_eth_rx_inject(tap);
 }
 
 bool zts_lwip_is_netif_up(void* n)
@@ -20,15 +20,15 @@
 #ifndef ZTS_VIRTUAL_TAP_HPP
 #define ZTS_VIRTUAL_TAP_HPP
 
-#define ZTS_LWIP_THREAD_NAME "ZTNetworkStackThread"
-#define VTAP_NAME_LEN        64
+#define VTAP_NAME_LEN 64
 
 #define ZTS_UNUSED_ARG(x) (void)x
 
 #include "Events.hpp"
 #include "MAC.hpp"
-#include "Phy.hpp"
-#include "Thread.hpp"
+
+#include <string>
+#include <vector>
 
 namespace ZeroTier {
 
@@ -44,8 +44,6 @@ struct InetAddress;
  * then be destroyed upon leaving the network.
  */
 class VirtualTap {
-    friend class Phy<VirtualTap*>;
-
   public:
     VirtualTap(
         const char* homePath,
@@ -111,6 +109,11 @@ class VirtualTap {
      */
     void put(const MAC& from, const MAC& to, unsigned int etherType, const void* data, unsigned int len);
 
+    /**
+     * Hands all frames queued by put() to the user-space stack in one batch
+     */
+    void flush();
+
     /**
      * Scan multicast groups
      */
@@ -121,11 +124,6 @@ class VirtualTap {
      */
     void setMtu(unsigned int mtu);
 
-    /**
-     * Calls main network stack loops
-     */
-    void threadMain() throw();
-
     /**
      * For moving data onto the ZeroTier virtual wire
      */
@@ -160,43 +158,21 @@ class VirtualTap {
     void* _arg;
     volatile bool _initialized;
     volatile bool _enabled;
-    volatile bool _run;
     MAC _mac;
     unsigned int _mtu;
     uint64_t _net_id;
-    Phy<VirtualTap*> _phy;
-
-    Thread _thread;
-
-    int _shutdownSignalPipe[2] = { 0 };
 
     std::vector<MulticastGroup> _multicastGroups;
     Mutex _multicastGroups_m;
 
-    void phyOnTcpConnect(PhySocket* sock, void** uptr, bool success)
-    {
-        ZTS_UNUSED_ARG(sock);
-        ZTS_UNUSED_ARG(uptr);
-        ZTS_UNUSED_ARG(success);
-    }
-    void phyOnTcpAccept(PhySocket* sockL, PhySocket* sockN, void** uptrL, void** uptrN, const struct sockaddr* from)
-    {
-        ZTS_UNUSED_ARG(sockL);
-        ZTS_UNUSED_ARG(sockN);
-        ZTS_UNUSED_ARG(uptrL);
-        ZTS_UNUSED_ARG(uptrN);
-        ZTS_UNUSED_ARG(from);
-    }
-    void phyOnTcpClose(PhySocket* sock, void** uptr)
-    {
-        ZTS_UNUSED_ARG(sock);
-        ZTS_UNUSED_ARG(uptr);
-    }
-    void phyOnUnixClose(PhySocket* sock, void** uptr)
-    {
-        ZTS_UNUSED_ARG(sock);
-        ZTS_UNUSED_ARG(uptr);
-    }
+    // Received frames (struct pbuf*) waiting to be fed into the stack
+    std::vector<void*> _rxq4;
+    std::vector<void*> _rxq6;
+    Mutex _rxq_m;
+    // Frames being fed into the stack, guarded by _rxInject_m
+    std::vector<void*> _rxInject4;
+    std::vector<void*> _rxInject6;
+    Mutex _rxInject_m;
 };
 
 /**
@@ -245,6 +221,20 @@ void zts_lwip_driver_init();
  */
 void zts_lwip_driver_shutdown();
 
+/**
+ * @brief Set the memory budget, buffer counts and socket defaults of the
+ * network stack. Zero fields select the compile-time defaults, larger values
+ * are capped to them.
+ *
+ * @return ZTS_ERR_OK, or ZTS_ERR_SERVICE if the stack has already been started
+ */
+int zts_lwip_set_stack_limits(const zts_stack_limits_t* limits);
+
+/**
+ * Returns the number of bytes currently allocated by the network stack
+ */
+uint64_t zts_lwip_mem_used();
+
 /**
  * @brief Requests that a netif be brought down and removed.
  */
@@ -277,7 +267,8 @@ void zts_lwip_remove_address_from_netif(void* tapref, const InetAddress& ip);
  * stack enter the ZeroTier virtual wire here.
  *
  * @usage This shall only be called from the stack or the stack driver. Not
- * the application thread.
+ * the application thread. Frames contained in a single pbuf are passed to
+ * the core without being copied, chained pbufs are gathered exactly once.
  * @param netif Transmits an outgoing Ethernet frame from the network stack
  * onto the ZeroTier virtual wire
  * @param p A pointer to the beginning of a chain pf struct pbufs
@@ -289,7 +280,8 @@ signed char zts_lwip_eth_tx(struct netif* netif, struct pbuf* p);
  * @brief Receives incoming Ethernet frames from the ZeroTier virtual wire
  *
  * @usage This shall be called from the VirtualTap's I/O thread (via
- * VirtualTap::put())
+ * VirtualTap::put()). Frames are copied into pooled pbufs and queued on the
+ * tap, they are handed to the stack by zts_lwip_eth_rx_flush()
  * @param tap Pointer to VirtualTap from which this data comes
  * @param from Origin address (virtual ZeroTier hardware address)
  * @param to Intended destination address (virtual ZeroTier hardware
@@ -306,6 +298,15 @@ void zts_lwip_eth_rx(
     const void* data,
     unsigned int len);
 
+/**
+ * @brief Feeds all frames queued by zts_lwip_eth_rx() into the stack under a
+ * single acquisition of the core lock
+ *
+ * @usage This shall not be called while holding the core lock
+ * @param tap Pointer to VirtualTap whose queued frames should be delivered
+ */
+void zts_lwip_eth_rx_flush(VirtualTap* tap);
+
 }   // namespace ZeroTier
 
 #endif   // _H
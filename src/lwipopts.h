@@ -60,6 +60,36 @@
 #elif !defined(_MSC_VER)
 #define LWIP_PROVIDE_ERRNO              1
 #endif
+// Heap (MEM_LIBC_MALLOC), allocations are counted against the memory budget
+// set with zts_init_set_stack_limits(). Implemented in VirtualTap.cpp.
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+void* zts_lwip_mem_malloc(size_t size);
+void* zts_lwip_mem_calloc(size_t count, size_t size);
+void zts_lwip_mem_free(void* ptr);
+#ifdef __cplusplus
+}
+#endif
+#define mem_clib_malloc                 zts_lwip_mem_malloc
+#define mem_clib_calloc                 zts_lwip_mem_calloc
+#define mem_clib_free                   zts_lwip_mem_free
+// Per-socket TCP statistics (zts_get_socket_stats()), implemented in Sockets.cpp
+#include <stdint.h>
+struct pbuf;
+struct tcp_hdr;
+struct tcp_pcb;
+#ifdef __cplusplus
+extern "C" {
+#endif
+signed char zts_lwip_tcp_in_hook(struct tcp_pcb* pcb, struct tcp_hdr* hdr, struct pbuf* p);
+uint32_t* zts_lwip_tcp_out_hook(struct pbuf* p, struct tcp_hdr* hdr, const struct tcp_pcb* pcb, uint32_t* opts);
+#ifdef __cplusplus
+}
+#endif
+#define LWIP_HOOK_TCP_INPACKET_PCB(pcb, hdr, optlen, opt1len, opt2, p) zts_lwip_tcp_in_hook(pcb, hdr, p)
+#define LWIP_HOOK_TCP_OUT_ADD_TCPOPTS(p, hdr, pcb, opts) zts_lwip_tcp_out_hook(p, hdr, pcb, opts)
 // Sockets
 #define LWIP_SOCKET                     1
 #define LWIP_COMPAT_SOCKETS             0
@@ -115,6 +145,8 @@
 #define TCP_WND_UPDATE_THRESHOLD        LWIP_MIN((TCP_WND / 4), (TCP_MSS * 4))
 #define LWIP_WND_SCALE                  1
 #define TCP_RCV_SCALE                   4
+// Used by the socket layer to limit accepted connections (zts_init_set_stack_limits)
+#define LWIP_TCP_PCB_NUM_EXT_ARGS       1
 // tcpip
 #define TCPIP_MBOX_SIZE                 0
 #define LWIP_TCPIP_CORE_LOCKING         1
@@ -126,6 +158,8 @@
 #define LWIP_NETIF_HWADDRHINT           1
 #define LWIP_NETIF_TX_SINGLE_PBUF       0
 #define TCPIP_THREAD_PRIO               1
+// pbuf (pooled receive buffers in VirtualTap.cpp)
+#define LWIP_SUPPORT_CUSTOM_PBUF        1
 
 /*------------------------------------------------------------------------------
 ------------------------------------ Timers ------------------------------------
@@ -138,12 +172,7 @@ measuring time using something more accurate.  If you call the timer
 functions very frequently you may see things (such as retransmissions)
 happening sooner than they should.
 */
-/* these are originally defined in tcp_impl.h */
-#ifndef TCP_TMR_INTERVAL
-/* The TCP timer interval in milliseconds. */
-#define TCP_TMR_INTERVAL       25
-#endif /* TCP_TMR_INTERVAL */
-
+/* these are originally defined in tcp_impl.h, TCP_TMR_INTERVAL is set above */
 #ifndef TCP_FAST_INTERVAL
 /* the fine grained timeout in milliseconds */
 #define TCP_FAST_INTERVAL      TCP_TMR_INTERVAL
@@ -297,18 +326,6 @@ happening sooner than they should.
 #define LWIP_TCPIP_CORE_LOCKING         1
 #endif
 
-/**
- * LWIP_TCPIP_CORE_LOCKING_INPUT: when LWIP_TCPIP_CORE_LOCKING is enabled,
- * this lets tcpip_input() grab the mutex for input packets as well,
- * instead of allocating a message and passing it to tcpip_thread.
- *
- * ATTENTION: this does not work when tcpip_input() is called from
- * interrupt context!
- */
-#if !defined LWIP_TCPIP_CORE_LOCKING_INPUT || defined __DOXYGEN__
-#define LWIP_TCPIP_CORE_LOCKING_INPUT   0
-#endif
-
 /**
  * SYS_LIGHTWEIGHT_PROT==1: enable inter-task protection (and task-vs-interrupt
  * protection) for certain critical regions during buffer allocation, deallocation
@@ -399,6 +416,8 @@ happening sooner than they should.
 /**
  * MEM_SIZE: the size of the heap memory. If the application will send
  * a lot of data that needs to be copied, this should be set high.
+ * Unused with MEM_LIBC_MALLOC, the heap is bounded at runtime instead
+ * (see zts_init_set_stack_limits)
  */
 #if !defined MEM_SIZE || defined __DOXYGEN__
 #define MEM_SIZE                        1024 * 1024 * 32
@@ -631,14 +650,6 @@ happening sooner than they should.
 #define MEMP_NUM_NETBUF                 2
 #endif
 
-/**
- * MEMP_NUM_NETCONN: the number of struct netconns.
- * (only needed if you use the sequential API, like api_lib.c)
- */
-#if !defined MEMP_NUM_NETCONN || defined __DOXYGEN__
-#define MEMP_NUM_NETCONN                1024
-#endif
-
 /**
  * MEMP_NUM_SELECT_CB: the number of struct lwip_select_cb.
  * (Only needed if you have LWIP_MPU_COMPATIBLE==1 and use the socket API.
@@ -648,24 +659,6 @@ happening sooner than they should.
 #define MEMP_NUM_SELECT_CB              4
 #endif
 
-/**
- * MEMP_NUM_TCPIP_MSG_API: the number of struct tcpip_msg, which are used
- * for callback/timeout API communication.
- * (only needed if you use tcpip.c)
- */
-#if !defined MEMP_NUM_TCPIP_MSG_API || defined __DOXYGEN__
-#define MEMP_NUM_TCPIP_MSG_API          64
-#endif
-
-/**
- * MEMP_NUM_TCPIP_MSG_INPKT: the number of struct tcpip_msg, which are used
- * for incoming packets.
- * (only needed if you use tcpip.c)
- */
-#if !defined MEMP_NUM_TCPIP_MSG_INPKT || defined __DOXYGEN__
-#define MEMP_NUM_TCPIP_MSG_INPKT        64
-#endif
-
 /**
  * MEMP_NUM_NETDB: the number of concurrently running lwip_addrinfo() calls
  * (before freeing the corresponding memory using lwip_freeaddrinfo()).
@@ -682,13 +675,6 @@ happening sooner than they should.
 #define MEMP_NUM_LOCALHOSTLIST          1
 #endif
 
-/**
- * PBUF_POOL_SIZE: the number of buffers in the pbuf pool.
- */
-#if !defined PBUF_POOL_SIZE || defined __DOXYGEN__
-#define PBUF_POOL_SIZE                  128
-#endif
-
 /** MEMP_NUM_API_MSG: the number of concurrently active calls to various
  * socket, netconn, and tcpip functions
  */
@@ -1335,17 +1321,6 @@ happening sooner than they should.
 #define TCP_TTL                         IP_DEFAULT_TTL
 #endif
 
-/**
- * TCP_WND: The size of a TCP window.  This must be at least
- * (2 * TCP_MSS) for things to work well.
- * ATTENTION: when using TCP_RCV_SCALE, TCP_WND is the total size
- * with scaling applied. Maximum window value in the TCP header
- * will be TCP_WND >> TCP_RCV_SCALE
- */
-#if !defined TCP_WND || defined __DOXYGEN__
-#define TCP_WND                         (1 * 0xffff) // *1024 //0xFFFF // (4 * TCP_MSS)
-#endif
-
 /**
  * TCP_MAXRTX: Maximum number of retransmissions of data segments.
  */
@@ -1389,17 +1364,6 @@ happening sooner than they should.
 #define LWIP_TCP_MAX_SACK_NUM           4
 #endif
 
-/**
- * TCP_MSS: TCP Maximum segment size. (default is 536, a conservative default,
- * you might want to increase this.)
- * For the receive side, this MSS is advertised to the remote side
- * when opening a connection. For the transmit size, this MSS sets
- * an upper limit on the MSS advertised by the remote host.
- */
-#if !defined TCP_MSS || defined __DOXYGEN__
-#define TCP_MSS                         (MTU - 40)
-#endif
-
 /**
  * TCP_CALCULATE_EFF_SEND_MSS: "The maximum size of a segment that TCP really
  * sends, the 'effective send MSS,' MUST be the smaller of the send MSS (which
@@ -1413,22 +1377,6 @@ happening sooner than they should.
 #endif
 
 
-/**
- * TCP_SND_BUF: TCP sender buffer space (bytes).
- * To achieve good performance, this should be at least 2 * TCP_MSS.
- */
-#if !defined TCP_SND_BUF || defined __DOXYGEN__
-#define TCP_SND_BUF                     (32 * TCP_MSS)
-#endif
-
-/**
- * TCP_SND_QUEUELEN: TCP sender buffer space (pbufs). This must be at least
- * as much as (2 * TCP_SND_BUF/TCP_MSS) for things to work.
- */
-#if !defined TCP_SND_QUEUELEN || defined __DOXYGEN__
-#define TCP_SND_QUEUELEN                (64 * (2 * (TCP_SND_BUF/TCP_MSS))) // 1024 // ((4 * (TCP_SND_BUF) + (TCP_MSS - 1))/(TCP_MSS))
-#endif
-
 /**
  * TCP_SNDLOWAT: TCP writable space (bytes). This must be less than
  * TCP_SND_BUF. It is the amount of space which must be available in the
@@ -1538,15 +1486,6 @@ happening sooner than they should.
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
-/**
- * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
- * explicit window update
- */
-#if !defined TCP_WND_UPDATE_THRESHOLD || defined __DOXYGEN__
-//#define TCP_WND_UPDATE_THRESHOLD        (TCP_MSS)
-#define TCP_WND_UPDATE_THRESHOLD        LWIP_MIN((TCP_WND / 4), (TCP_MSS * 4))
-#endif
-
 /**
  * LWIP_EVENT_API and LWIP_CALLBACK_API: Only one of these should be set to 1.
  *     LWIP_EVENT_API==1: The user defines lwip_tcp_event() to receive all
@@ -1566,19 +1505,6 @@ happening sooner than they should.
 #endif
 #endif
 
-/**
- * LWIP_WND_SCALE and TCP_RCV_SCALE:
- * Set LWIP_WND_SCALE to 1 to enable window scaling.
- * Set TCP_RCV_SCALE to the desired scaling factor (shift count in the
- * range of [0..14]).
- * When LWIP_WND_SCALE is enabled but TCP_RCV_SCALE is 0, we can use a large
- * send window while having a small receive window only.
- */
-#if !defined LWIP_WND_SCALE || defined __DOXYGEN__
-#define LWIP_WND_SCALE                  1
-#define TCP_RCV_SCALE                   0
-#endif
-
 /**
  * LWIP_TCP_PCB_NUM_EXT_ARGS:
  * When this is > 0, every tcp pcb (including listen pcb) includes a number of
@@ -1701,39 +1627,6 @@ happening sooner than they should.
 #define LWIP_NETIF_API                  1
 #endif
 
-/**
- * LWIP_NETIF_STATUS_CALLBACK==1: Support a callback function whenever an interface
- * changes its up/down status (i.e., due to DHCP IP acquisition)
- */
-#if !defined LWIP_NETIF_STATUS_CALLBACK || defined __DOXYGEN__
-#define LWIP_NETIF_STATUS_CALLBACK      1
-#endif
-
-/**
- * LWIP_NETIF_EXT_STATUS_CALLBACK==1: Support an extended callback function
- * for several netif related event that supports multiple subscribers.
- * @see netif_ext_status_callback
- */
-#if !defined LWIP_NETIF_EXT_STATUS_CALLBACK || defined __DOXYGEN__
-#define LWIP_NETIF_EXT_STATUS_CALLBACK  1
-#endif
-
-/**
- * LWIP_NETIF_LINK_CALLBACK==1: Support a callback function from an interface
- * whenever the link changes (i.e., link down)
- */
-#if !defined LWIP_NETIF_LINK_CALLBACK || defined __DOXYGEN__
-#define LWIP_NETIF_LINK_CALLBACK        1
-#endif
-
-/**
- * LWIP_NETIF_REMOVE_CALLBACK==1: Support a callback function that is called
- * when a netif has been removed
- */
-#if !defined LWIP_NETIF_REMOVE_CALLBACK || defined __DOXYGEN__
-#define LWIP_NETIF_REMOVE_CALLBACK      1
-#endif
-
 /**
  * LWIP_NETIF_HWADDRHINT==1: Cache link-layer-address hints (e.g. table
  * indices) in struct netif. TCP and UDP can make use of this to prevent
@@ -1807,6 +1700,9 @@ happening sooner than they should.
 /**
  * LWIP_NETIF_LOOPBACK==1: Support sending packets with a destination IP
  * address equal to the netif IP address, looping them back up the stack.
+ * Together with LWIP_HAVE_LOOPIF this lets sockets talk to 127.0.0.1 and ::1
+ * without a network being joined. Off in library builds, the selftest build
+ * turns it on (ZTS_ENABLE_LOOPBACK) to check sockets over 127.0.0.1.
  */
 #if !defined LWIP_NETIF_LOOPBACK || defined __DOXYGEN__
 #define LWIP_NETIF_LOOPBACK             0
@@ -0,0 +1,820 @@
+/**
+ * Two-node benchmark. Runs a server node and a client node on this host, in
+ * two processes since each process has one network stack, and reports TCP and
+ * UDP throughput, round-trip time percentiles and CPU time per byte between
+ * them. The churn test opens and closes short TCP connections back to back,
+ * keeping up to `concurrency` of them open, and reports the connection rate,
+ * setup latency and the peak number of open sockets and TIME_WAIT pcbs of
+ * each side. It stops with an error as soon as a socket, pcb or memory limit
+ * of either stack is reached. `max_sockets` and `mem_limit` are passed to
+ * zts_init_set_stack_limits() on both nodes. The nodes reach each other over
+ * UDP on one of this host's addresses and the server node is the only root,
+ * so no network access is needed.
+ *
+ * Usage: bench [-c concurrency] [-s max_sockets] [-m mem_limit]
+ *              [all|tcp|udp|rtt|churn] [seconds] [underlay_ipv4]
+ */
+
+#include <ZeroTierSockets.h>
+// TIME_WAIT pcbs are not owned by any socket, so they are counted in lwIP
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/tcpip.h"
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//----------------------------------------------------------------------------//
+// Parameters                                                                 //
+//----------------------------------------------------------------------------//
+
+// ZeroTier (underlay) ports of the two nodes
+#define BENCH_SERVER_ZT_PORT 29993
+#define BENCH_CLIENT_ZT_PORT 29994
+// Port of the benchmark server on the virtual network, TCP and UDP
+#define BENCH_PORT 8000
+// Arbitrary ID of the generated root set
+#define BENCH_ROOTS_ID 149604618
+// Size of each write in the TCP throughput test
+#define BENCH_TCP_WRITE_LEN 65536
+// Size of each datagram in the UDP throughput test
+#define BENCH_UDP_LEN 1400
+// Size of each message in the round-trip test
+#define BENCH_RTT_LEN 64
+// Number of round trips measured
+#define BENCH_RTT_COUNT 2000
+// Upper bound on the number of connections timed in the churn test
+#define BENCH_CHURN_MAX 1000000
+// Upper bound on the number of churn connections held open at once
+#define BENCH_CHURN_HOLD_MAX 1024
+// How often the churn test counts TIME_WAIT pcbs (us)
+#define BENCH_CHURN_SAMPLE_INTERVAL 10000
+// How long to wait for the nodes to come up (ms)
+#define BENCH_STARTUP_TIMEOUT 60000
+
+// Commands sent as the first byte of each connection to the server
+#define BENCH_CMD_SINK 'S'
+#define BENCH_CMD_ECHO 'E'
+#define BENCH_CMD_UDP  'U'
+// The server closes the connection first, leaving it in TIME_WAIT on its side
+#define BENCH_CMD_CLOSE 'C'
+// The server replies with one byte and keeps the connection open until the
+// client closes it
+#define BENCH_CMD_HOLD 'H'
+// The server replies with its churn_report_t
+#define BENCH_CMD_REPORT 'R'
+
+// Passed to zts_init_set_stack_limits() on both nodes
+static zts_stack_limits_t stack_limits;
+
+//----------------------------------------------------------------------------//
+// Helpers                                                                    //
+//----------------------------------------------------------------------------//
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// User and system CPU time of this process
+static uint64_t cpu_us()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// Server process, only set in the client
+static pid_t server_pid = 0;
+
+static void stop_server()
+{
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        server_pid = 0;
+    }
+}
+
+static void fail(const char* msg)
+{
+    fprintf(stderr, "bench: %s (zts_errno=%d)\n", msg, zts_errno);
+    stop_server();
+    exit(1);
+}
+
+// Name of the limit that made the last socket call fail, NULL if it failed
+// for another reason
+static const char* limit_reached()
+{
+    switch (zts_errno) {
+        case ZTS_EMFILE:
+        case ZTS_ENFILE:
+            return "socket limit reached (max_sockets, MEMP_NUM_NETCONN)";
+        case ZTS_ENOBUFS:
+        case ZTS_ENOMEM:
+            return "pcb or memory limit reached (MEMP_NUM_TCP_PCB, mem_limit)";
+        default:
+            return NULL;
+    }
+}
+
+static int read_full(int fd, void* buf, size_t len)
+{
+    size_t n = 0;
+    while (n < len) {
+        ssize_t r = zts_read(fd, (char*)buf + n, len - n);
+        if (r <= 0) {
+            return -1;
+        }
+        n += r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void* buf, size_t len)
+{
+    size_t n = 0;
+    while (n < len) {
+        ssize_t w = zts_write(fd, (const char*)buf + n, len - n);
+        if (w <= 0) {
+            return -1;
+        }
+        n += w;
+    }
+    return 0;
+}
+
+// First IPv4 address of an interface that is up and not loopback. ZeroTier
+// does not use loopback addresses for paths.
+static int underlay_addr(char* dst, size_t len)
+{
+    struct ifaddrs* ifa = NULL;
+    if (getifaddrs(&ifa) != 0) {
+        return -1;
+    }
+    int err = -1;
+    for (struct ifaddrs* i = ifa; i; i = i->ifa_next) {
+        if (! i->ifa_addr || i->ifa_addr->sa_family != AF_INET || ! (i->ifa_flags & IFF_UP)
+            || (i->ifa_flags & IFF_LOOPBACK)) {
+            continue;
+        }
+        inet_ntop(AF_INET, &((struct sockaddr_in*)i->ifa_addr)->sin_addr, dst, len);
+        err = 0;
+        break;
+    }
+    freeifaddrs(ifa);
+    return err;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double ns_per_byte(uint64_t cpu, uint64_t bytes)
+{
+    return bytes ? (double)cpu * 1000.0 / (double)bytes : 0.0;
+}
+
+static double mbps(uint64_t bytes, uint64_t us)
+{
+    return us ? (double)bytes * 8.0 / (double)us : 0.0;
+}
+
+//----------------------------------------------------------------------------//
+// Churn statistics                                                           //
+//----------------------------------------------------------------------------//
+
+// Kept by each side of the churn test, the server sends its own on request
+typedef struct {
+    // Most sockets open at once, including the listening ones on the server
+    uint64_t peak_open;
+    // Most pcbs in TIME_WAIT at once
+    uint64_t peak_time_wait;
+    // Connections the server could not accept because of a resource limit
+    uint64_t accept_failures;
+    // zts_errno of the last of those
+    uint64_t accept_errno;
+} churn_report_t;
+
+// Number of pcbs of this process's stack in TIME_WAIT
+static unsigned int time_wait_pcbs()
+{
+    unsigned int n = 0;
+    LOCK_TCPIP_CORE();
+    for (struct tcp_pcb* pcb = tcp_tw_pcbs; pcb; pcb = pcb->next) {
+        n++;
+    }
+    UNLOCK_TCPIP_CORE();
+    return n;
+}
+
+// Record the number of open sockets, and every so often of TIME_WAIT pcbs
+static void churn_sample(churn_report_t* report, unsigned int open)
+{
+    static uint64_t last = 0;
+    if (open > report->peak_open) {
+        report->peak_open = open;
+    }
+    uint64_t now = now_us();
+    if (now - last >= BENCH_CHURN_SAMPLE_INTERVAL) {
+        last = now;
+        unsigned int tw = time_wait_pcbs();
+        if (tw > report->peak_time_wait) {
+            report->peak_time_wait = tw;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------//
+// Nodes                                                                      //
+//----------------------------------------------------------------------------//
+
+static void
+start_node(const char* key, const char* roots, unsigned int roots_len, unsigned short port, uint64_t net_id, int is_root)
+{
+    if (zts_init_from_memory(key, strlen(key)) != ZTS_ERR_OK || zts_init_set_roots(roots, roots_len) != ZTS_ERR_OK
+        || zts_init_set_port(port) != ZTS_ERR_OK || zts_init_set_stack_limits(&stack_limits) != ZTS_ERR_OK) {
+        fail("unable to configure node");
+    }
+    if (zts_node_start() != ZTS_ERR_OK) {
+        fail("unable to start node");
+    }
+    uint64_t deadline = now_us() + BENCH_STARTUP_TIMEOUT * 1000ULL;
+    // The root never sees another root and so never reports itself online
+    while (! is_root && ! zts_node_is_online()) {
+        if (now_us() > deadline) {
+            fail("node did not come online");
+        }
+        zts_util_delay(50);
+    }
+    if (zts_net_join(net_id) != ZTS_ERR_OK) {
+        fail("unable to join network");
+    }
+    while (! zts_net_transport_is_ready(net_id)) {
+        if (now_us() > deadline) {
+            fail("network did not become ready");
+        }
+        zts_util_delay(50);
+    }
+}
+
+//----------------------------------------------------------------------------//
+// Server                                                                     //
+//----------------------------------------------------------------------------//
+
+static pthread_mutex_t udp_m = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t udp_bytes = 0;
+static uint64_t udp_datagrams = 0;
+
+static void* udp_sink(void* arg)
+{
+    int fd = *(int*)arg;
+    char buf[BENCH_UDP_LEN];
+    for (;;) {
+        ssize_t n = zts_bsd_recvfrom(fd, buf, sizeof(buf), 0, NULL, NULL);
+        if (n < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&udp_m);
+        udp_bytes += n;
+        udp_datagrams++;
+        pthread_mutex_unlock(&udp_m);
+    }
+    return NULL;
+}
+
+static churn_report_t server_churn;
+
+// Handle the command of a new connection, returns the command or 0
+static char serve(int fd)
+{
+    static uint64_t udp_cpu_start = 0;
+    static char buf[BENCH_TCP_WRITE_LEN];
+    char cmd;
+    if (read_full(fd, &cmd, 1) < 0) {
+        return 0;
+    }
+    if (cmd == BENCH_CMD_SINK) {
+        // Read until the client shuts down its side, then report
+        uint64_t cpu_start = cpu_us();
+        uint64_t bytes = 0;
+        ssize_t n;
+        while ((n = zts_read(fd, buf, sizeof(buf))) > 0) {
+            bytes += n;
+        }
+        uint64_t reply[2] = { bytes, cpu_us() - cpu_start };
+        write_full(fd, reply, sizeof(reply));
+    }
+    if (cmd == BENCH_CMD_ECHO) {
+        ssize_t n;
+        while ((n = zts_read(fd, buf, sizeof(buf))) > 0) {
+            if (write_full(fd, buf, n) < 0) {
+                break;
+            }
+        }
+    }
+    if (cmd == BENCH_CMD_UDP) {
+        // Report what has been received since the last report
+        uint64_t cpu = cpu_us();
+        pthread_mutex_lock(&udp_m);
+        uint64_t reply[3] = { udp_bytes, udp_datagrams, cpu - udp_cpu_start };
+        udp_bytes = 0;
+        udp_datagrams = 0;
+        pthread_mutex_unlock(&udp_m);
+        udp_cpu_start = cpu;
+        write_full(fd, reply, sizeof(reply));
+    }
+    if (cmd == BENCH_CMD_HOLD) {
+        write_full(fd, &cmd, 1);
+    }
+    if (cmd == BENCH_CMD_REPORT) {
+        write_full(fd, &server_churn, sizeof(server_churn));
+    }
+    return cmd;
+}
+
+static void run_server(const char* key, const char* roots, unsigned int roots_len, uint64_t net_id, int addr_pipe)
+{
+    start_node(key, roots, roots_len, BENCH_SERVER_ZT_PORT, net_id, 1);
+    char addr[ZTS_IP_MAX_STR_LEN] = { 0 };
+    if (zts_addr_get_str(net_id, ZTS_AF_INET6, addr, sizeof(addr)) != ZTS_ERR_OK) {
+        fail("server has no address");
+    }
+    static int udp_fd;
+    if ((udp_fd = zts_udp_server(addr, BENCH_PORT)) < 0) {
+        fail("unable to bind UDP socket");
+    }
+    pthread_t udp_thread;
+    pthread_create(&udp_thread, NULL, udp_sink, &udp_fd);
+    int listen_fd;
+    if ((listen_fd = zts_bsd_socket(ZTS_AF_INET6, ZTS_SOCK_STREAM, 0)) < 0
+        || zts_bind(listen_fd, addr, BENCH_PORT) != ZTS_ERR_OK || zts_listen(listen_fd, 16) != ZTS_ERR_OK) {
+        fail("unable to listen");
+    }
+    // Ready, tell the client where to find us
+    if (write(addr_pipe, addr, sizeof(addr)) != sizeof(addr)) {
+        fail("unable to report server address");
+    }
+    close(addr_pipe);
+    // The listening socket, then connections held open for the churn test
+    static struct zts_pollfd fds[1 + BENCH_CHURN_HOLD_MAX];
+    unsigned int held = 0;
+    unsigned int open = 2;
+    fds[0].fd = listen_fd;
+    fds[0].events = ZTS_POLLIN;
+    for (;;) {
+        if (zts_bsd_poll(fds, 1 + held, -1) < 0) {
+            continue;
+        }
+        // Held connections the client has closed
+        for (unsigned int i = 1; i <= held;) {
+            if (! fds[i].revents) {
+                i++;
+                continue;
+            }
+            zts_close(fds[i].fd);
+            open--;
+            fds[i] = fds[held--];
+        }
+        if (! (fds[0].revents & ZTS_POLLIN)) {
+            continue;
+        }
+        char remote[ZTS_IP_MAX_STR_LEN];
+        unsigned short port;
+        int fd = zts_accept(listen_fd, remote, sizeof(remote), &port);
+        if (fd < 0) {
+            // The client learns about it with BENCH_CMD_REPORT
+            if (limit_reached()) {
+                server_churn.accept_failures++;
+                server_churn.accept_errno = zts_errno;
+            }
+            continue;
+        }
+        churn_sample(&server_churn, ++open);
+        if (serve(fd) == BENCH_CMD_HOLD && held < BENCH_CHURN_HOLD_MAX) {
+            held++;
+            fds[held].fd = fd;
+            fds[held].events = ZTS_POLLIN;
+            fds[held].revents = 0;
+            continue;
+        }
+        zts_close(fd);
+        churn_sample(&server_churn, --open);
+    }
+}
+
+//----------------------------------------------------------------------------//
+// Client                                                                     //
+//----------------------------------------------------------------------------//
+
+static int bench_connect(const char* addr, char cmd)
+{
+    int fd;
+    if ((fd = zts_bsd_socket(ZTS_AF_INET6, ZTS_SOCK_STREAM, 0)) < 0) {
+        fail("unable to create socket");
+    }
+    if (zts_connect(fd, addr, BENCH_PORT, 0) != ZTS_ERR_OK) {
+        fail("unable to connect to server");
+    }
+    if (write_full(fd, &cmd, 1) < 0) {
+        fail("unable to send command");
+    }
+    return fd;
+}
+
+static void bench_tcp(const char* addr, int seconds)
+{
+    static char buf[BENCH_TCP_WRITE_LEN];
+    memset(buf, 0xa5, sizeof(buf));
+    int fd = bench_connect(addr, BENCH_CMD_SINK);
+    uint64_t start = now_us();
+    uint64_t cpu_start = cpu_us();
+    uint64_t deadline = start + seconds * 1000000ULL;
+    uint64_t sent = 0;
+    while (now_us() < deadline) {
+        if (write_full(fd, buf, sizeof(buf)) < 0) {
+            fail("TCP write failed");
+        }
+        sent += sizeof(buf);
+    }
+    zts_bsd_shutdown(fd, ZTS_SHUT_WR);
+    // The server replies once it has read everything
+    uint64_t reply[2];
+    if (read_full(fd, reply, sizeof(reply)) < 0) {
+        fail("no reply from TCP sink");
+    }
+    uint64_t elapsed = now_us() - start;
+    uint64_t cpu = cpu_us() - cpu_start;
+    zts_close(fd);
+    printf(
+        "tcp  %10.2f Mbit/s  %12llu bytes  client %8.2f ns/byte  server %8.2f ns/byte\n",
+        mbps(reply[0], elapsed),
+        (unsigned long long)reply[0],
+        ns_per_byte(cpu, sent),
+        ns_per_byte(reply[1], reply[0]));
+}
+
+static void udp_report(const char* addr, uint64_t* reply)
+{
+    int fd = bench_connect(addr, BENCH_CMD_UDP);
+    if (read_full(fd, reply, 3 * sizeof(uint64_t)) < 0) {
+        fail("no reply to UDP report request");
+    }
+    zts_close(fd);
+}
+
+static void bench_udp(const char* addr, int seconds)
+{
+    static char buf[BENCH_UDP_LEN];
+    memset(buf, 0x5a, sizeof(buf));
+    struct zts_sockaddr_storage ss;
+    zts_socklen_t ss_len = sizeof(ss);
+    if (zts_util_ipstr_to_saddr(addr, BENCH_PORT, (struct zts_sockaddr*)&ss, &ss_len) != ZTS_ERR_OK) {
+        fail("invalid server address");
+    }
+    int fd;
+    if ((fd = zts_udp_client(addr)) < 0) {
+        fail("unable to create UDP socket");
+    }
+    uint64_t reply[3];
+    udp_report(addr, reply);   // Reset the server's counters
+    uint64_t start = now_us();
+    uint64_t cpu_start = cpu_us();
+    uint64_t deadline = start + seconds * 1000000ULL;
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    while (now_us() < deadline) {
+        if (zts_bsd_sendto(fd, buf, sizeof(buf), 0, (struct zts_sockaddr*)&ss, ss_len) == sizeof(buf)) {
+            sent++;
+        }
+        else {
+            dropped++;   // Out of buffers locally
+        }
+    }
+    uint64_t elapsed = now_us() - start;
+    uint64_t cpu = cpu_us() - cpu_start;
+    zts_close(fd);
+    zts_util_delay(500);   // Let the last datagrams arrive
+    udp_report(addr, reply);
+    printf(
+        "udp  %10.2f Mbit/s  %12llu datagrams  sent %llu  local drops %llu  loss %.2f%%  client %8.2f ns/byte  "
+        "server %8.2f ns/byte\n",
+        mbps(reply[0], elapsed),
+        (unsigned long long)reply[1],
+        (unsigned long long)sent,
+        (unsigned long long)dropped,
+        sent ? 100.0 * (double)(sent - (reply[1] < sent ? reply[1] : sent)) / (double)sent : 0.0,
+        ns_per_byte(cpu, sent * BENCH_UDP_LEN),
+        ns_per_byte(reply[2], reply[0]));
+}
+
+static void bench_rtt(const char* addr)
+{
+    static uint64_t rtt[BENCH_RTT_COUNT];
+    char msg[BENCH_RTT_LEN];
+    memset(msg, 0x3c, sizeof(msg));
+    int fd = bench_connect(addr, BENCH_CMD_ECHO);
+    zts_set_no_delay(fd, 1);
+    for (int i = 0; i < BENCH_RTT_COUNT; i++) {
+        uint64_t start = now_us();
+        if (write_full(fd, msg, sizeof(msg)) < 0 || read_full(fd, msg, sizeof(msg)) < 0) {
+            fail("echo failed");
+        }
+        rtt[i] = now_us() - start;
+    }
+    zts_close(fd);
+    qsort(rtt, BENCH_RTT_COUNT, sizeof(rtt[0]), cmp_u64);
+    printf(
+        "rtt  p50 %llu us  p90 %llu us  p99 %llu us  max %llu us  (%d round trips of %d bytes)\n",
+        (unsigned long long)rtt[(BENCH_RTT_COUNT - 1) * 50 / 100],
+        (unsigned long long)rtt[(BENCH_RTT_COUNT - 1) * 90 / 100],
+        (unsigned long long)rtt[(BENCH_RTT_COUNT - 1) * 99 / 100],
+        (unsigned long long)rtt[BENCH_RTT_COUNT - 1],
+        BENCH_RTT_COUNT,
+        BENCH_RTT_LEN);
+}
+
+// Connections the churn test holds open, oldest first
+static int churn_held[BENCH_CHURN_HOLD_MAX];
+static unsigned int churn_oldest = 0;
+static unsigned int churn_open = 0;
+
+static void churn_close_all()
+{
+    while (churn_open) {
+        zts_close(churn_held[churn_oldest]);
+        churn_oldest = (churn_oldest + 1) % BENCH_CHURN_HOLD_MAX;
+        churn_open--;
+    }
+}
+
+// Ask the server for its churn statistics
+static int churn_server_report(const char* addr, churn_report_t* report)
+{
+    char cmd = BENCH_CMD_REPORT;
+    int fd = zts_bsd_socket(ZTS_AF_INET6, ZTS_SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int err = (zts_connect(fd, addr, BENCH_PORT, 0) != ZTS_ERR_OK || write_full(fd, &cmd, 1) < 0
+               || read_full(fd, report, sizeof(*report)) < 0);
+    zts_close(fd);
+    return err ? -1 : 0;
+}
+
+static void churn_fail(const char* addr, const char* what, unsigned int count)
+{
+    const char* limit = limit_reached();
+    fprintf(
+        stderr,
+        "bench: churn %s failed after %u connections: %s (zts_errno=%d)\n",
+        what,
+        count,
+        limit ? limit : "not a resource limit",
+        zts_errno);
+    // Free the server's sockets so that it can answer
+    churn_close_all();
+    zts_util_delay(500);
+    churn_report_t server;
+    if (churn_server_report(addr, &server) != 0) {
+        fprintf(stderr, "bench: no churn report from the server\n");
+    }
+    else if (server.accept_failures) {
+        zts_errno = (int)server.accept_errno;
+        fprintf(
+            stderr,
+            "bench: server failed to accept %llu connections: %s (zts_errno=%d)\n",
+            (unsigned long long)server.accept_failures,
+            limit_reached(),
+            zts_errno);
+    }
+    stop_server();
+    exit(1);
+}
+
+static void bench_churn(const char* addr, int seconds, unsigned int concurrency)
+{
+    uint64_t* setup = (uint64_t*)malloc(BENCH_CHURN_MAX * sizeof(uint64_t));
+    if (! setup) {
+        fail("out of memory");
+    }
+    churn_report_t client;
+    memset(&client, 0, sizeof(client));
+    char cmd = (concurrency > 1) ? BENCH_CMD_HOLD : BENCH_CMD_CLOSE;
+    char c;
+    uint64_t start = now_us();
+    uint64_t deadline = start + seconds * 1000000ULL;
+    unsigned int n = 0;
+    while (n < BENCH_CHURN_MAX && now_us() < deadline) {
+        if (churn_open == concurrency) {
+            zts_close(churn_held[churn_oldest]);
+            churn_oldest = (churn_oldest + 1) % BENCH_CHURN_HOLD_MAX;
+            churn_open--;
+        }
+        uint64_t t = now_us();
+        int fd;
+        if ((fd = zts_bsd_socket(ZTS_AF_INET6, ZTS_SOCK_STREAM, 0)) < 0) {
+            churn_fail(addr, "socket", n);
+        }
+        if (zts_connect(fd, addr, BENCH_PORT, 0) != ZTS_ERR_OK) {
+            churn_fail(addr, "connect", n);
+        }
+        setup[n++] = now_us() - t;
+        churn_sample(&client, churn_open + 1);
+        if (cmd == BENCH_CMD_CLOSE) {
+            // Wait for the server to close its side before closing ours
+            if (write_full(fd, &cmd, 1) < 0 || zts_read(fd, &c, 1) != 0) {
+                churn_fail(addr, "exchange", n);
+            }
+            zts_close(fd);
+            continue;
+        }
+        // The server closes connections it cannot hold instead of replying
+        if (write_full(fd, &cmd, 1) < 0 || zts_read(fd, &c, 1) != 1) {
+            churn_fail(addr, "exchange", n);
+        }
+        churn_held[(churn_oldest + churn_open) % BENCH_CHURN_HOLD_MAX] = fd;
+        churn_open++;
+    }
+    uint64_t elapsed = now_us() - start;
+    churn_close_all();
+    if (! n) {
+        fail("no connections were made");
+    }
+    churn_report_t server;
+    if (churn_server_report(addr, &server) != 0) {
+        fail("no churn report from the server");
+    }
+    qsort(setup, n, sizeof(setup[0]), cmp_u64);
+    printf(
+        "churn %9.1f conn/s  %u connections  setup p50 %llu us  p99 %llu us  max %llu us\n",
+        elapsed ? (double)n * 1000000.0 / (double)elapsed : 0.0,
+        n,
+        (unsigned long long)setup[(n - 1) * 50 / 100],
+        (unsigned long long)setup[(n - 1) * 99 / 100],
+        (unsigned long long)setup[n - 1]);
+    printf(
+        "churn peak open sockets client %llu server %llu  peak TIME_WAIT pcbs client %llu server %llu\n",
+        (unsigned long long)client.peak_open,
+        (unsigned long long)server.peak_open,
+        (unsigned long long)client.peak_time_wait,
+        (unsigned long long)server.peak_time_wait);
+    free(setup);
+}
+
+//----------------------------------------------------------------------------//
+// Setup                                                                      //
+//----------------------------------------------------------------------------//
+
+static void new_identity(char* key, char* public_id)
+{
+    unsigned int len = ZTS_ID_STR_BUF_LEN;
+    if (zts_id_new(key, &len) != ZTS_ERR_OK) {
+        fail("unable to generate identity");
+    }
+    // address:0:public:secret
+    strcpy(public_id, key);
+    char* p = strchr(public_id, ':');
+    p = p ? strchr(p + 1, ':') : NULL;
+    p = p ? strchr(p + 1, ':') : NULL;
+    if (p) {
+        *p = 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* prog = argv[0];
+    int concurrency = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:m:")) != -1) {
+        switch (opt) {
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 's':
+                stack_limits.max_sockets = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                stack_limits.mem_limit = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                concurrency = 0;
+                break;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    const char* mode = (argc > 1) ? argv[1] : "all";
+    int seconds = (argc > 2) ? atoi(argv[2]) : 10;
+    if (seconds <= 0 || concurrency <= 0 || concurrency > BENCH_CHURN_HOLD_MAX
+        || (strcmp(mode, "all") && strcmp(mode, "tcp") && strcmp(mode, "udp") && strcmp(mode, "rtt")
+            && strcmp(mode, "churn"))) {
+        fprintf(
+            stderr,
+            "Usage: %s [-c concurrency] [-s max_sockets] [-m mem_limit] [all|tcp|udp|rtt|churn] [seconds] "
+            "[underlay_ipv4]\n",
+            prog);
+        return 1;
+    }
+    char underlay[ZTS_IP_MAX_STR_LEN] = { 0 };
+    if (argc > 3) {
+        strncpy(underlay, argv[3], sizeof(underlay) - 1);
+    }
+    else if (underlay_addr(underlay, sizeof(underlay)) != 0) {
+        fail("no usable IPv4 address, pass one as the third argument");
+    }
+
+    // Stand-in root set whose only root is the server node
+    char server_key[ZTS_ID_STR_BUF_LEN] = { 0 };
+    char client_key[ZTS_ID_STR_BUF_LEN] = { 0 };
+    char server_public[ZTS_ID_STR_BUF_LEN] = { 0 };
+    char client_public[ZTS_ID_STR_BUF_LEN] = { 0 };
+    new_identity(server_key, server_public);
+    new_identity(client_key, client_public);
+    char endpoint[ZTS_MAX_ENDPOINT_STR_LEN + 1] = { 0 };
+    snprintf(endpoint, sizeof(endpoint), "%s/%d", underlay, BENCH_SERVER_ZT_PORT);
+    zts_root_set_t spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.public_id_str[0] = server_public;
+    spec.endpoint_ip_str[0][0] = endpoint;
+    char roots[4096] = { 0 };
+    char prev_key[4096] = { 0 };
+    char curr_key[4096] = { 0 };
+    unsigned int roots_len = sizeof(roots);
+    unsigned int prev_key_len = sizeof(prev_key);
+    unsigned int curr_key_len = sizeof(curr_key);
+    if (zts_util_sign_root_set(
+            roots,
+            &roots_len,
+            prev_key,
+            &prev_key_len,
+            curr_key,
+            &curr_key_len,
+            BENCH_ROOTS_ID,
+            1,
+            &spec)
+        != ZTS_ERR_OK) {
+        fail("unable to sign root set");
+    }
+    // Controller-less network that allows the benchmark port
+    uint64_t net_id = zts_net_compute_adhoc_id(BENCH_PORT, BENCH_PORT);
+
+    int addr_pipe[2];
+    if (pipe(addr_pipe) != 0) {
+        fail("unable to create pipe");
+    }
+    pid_t server = fork();
+    if (server < 0) {
+        fail("unable to fork");
+    }
+    if (server == 0) {
+        close(addr_pipe[0]);
+        run_server(server_key, roots, roots_len, net_id, addr_pipe[1]);
+        return 0;
+    }
+    server_pid = server;
+    close(addr_pipe[1]);
+
+    fprintf(stderr, "bench: underlay %s, network %llx\n", underlay, (unsigned long long)net_id);
+    start_node(client_key, roots, roots_len, BENCH_CLIENT_ZT_PORT, net_id, 0);
+    char server_addr[ZTS_IP_MAX_STR_LEN] = { 0 };
+    if (read(addr_pipe[0], server_addr, sizeof(server_addr)) != sizeof(server_addr)) {
+        fail("server did not start");
+    }
+    fprintf(stderr, "bench: server at [%s]:%d\n", server_addr, BENCH_PORT);
+
+    int all = ! strcmp(mode, "all");
+    if (all || ! strcmp(mode, "rtt")) {
+        bench_rtt(server_addr);
+    }
+    if (all || ! strcmp(mode, "tcp")) {
+        bench_tcp(server_addr, seconds);
+    }
+    if (all || ! strcmp(mode, "udp")) {
+        bench_udp(server_addr, seconds);
+    }
+    if (all || ! strcmp(mode, "churn")) {
+        bench_churn(server_addr, seconds, (unsigned int)concurrency);
+    }
+
+    stop_server();
+    zts_node_stop();
+    return 0;
+}
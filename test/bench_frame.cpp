@@ -0,0 +1,384 @@
+/**
+ * Frame path microbenchmarks. Feeds synthetic Ethernet frames through
+ * VirtualTap::put() (zts_lwip_eth_rx) and zts_lwip_eth_tx() and reports the
+ * time, heap allocations and frame copies per frame. The ZeroTier core is not
+ * started, outbound frames are handed to a stub in place of the handler that
+ * NodeService installs (tapFrameHandler, which forwards each frame to
+ * Node::processVirtualNetworkFrame).
+ *
+ * Usage: bench-frame [filter] [min_seconds]
+ */
+
+#include "InetAddress.hpp"
+#include "MAC.hpp"
+#include "lwip/pbuf.h"
+#include "lwip/sockets.h"
+#include "lwip/tcpip.h"
+#include "netif/ethernet.h"
+
+#include "Events.hpp"
+#include "Stats.hpp"
+#include "VirtualTap.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace ZeroTier;
+
+namespace ZeroTier {
+extern Events* zts_events;
+}
+
+//----------------------------------------------------------------------------//
+// Parameters                                                                 //
+//----------------------------------------------------------------------------//
+
+// Frames per batch, the service loop flushes a tap after each wire packet but
+// lwIP is given up to ZTS_RX_BATCH_MAX frames at a time
+#define BENCH_BATCH 32
+// Default minimum measuring time of each case (s)
+#define BENCH_MIN_SECONDS 0.5
+// Virtual network of the tap
+#define BENCH_NET_ID 0x8056c2e21c000001ULL
+#define BENCH_MTU    2800
+#define BENCH_TAP_IP "10.147.17.1/24"
+#define BENCH_TAP_MAC  0x32aabbccdd01ULL
+#define BENCH_PEER_MAC 0x32aabbccdd02ULL
+// UDP port of the socket receiving the rx/udp frames
+#define BENCH_UDP_PORT 9000
+
+static const uint8_t _tapIp[4] = { 10, 147, 17, 1 };
+static const uint8_t _peerIp[4] = { 10, 147, 17, 2 };
+static const uint8_t _foreignIp[4] = { 10, 147, 17, 99 };
+
+//----------------------------------------------------------------------------//
+// Allocation counting                                                        //
+//----------------------------------------------------------------------------//
+
+// Allocations made with operator new, the stack's own heap allocations are
+// counted by ZTS_STAT_MEM_ALLOC
+static std::atomic<uint64_t> _newCount(0);
+
+void* operator new(size_t n)
+{
+    _newCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(n ? n : 1);
+    if (! p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+static uint64_t allocs()
+{
+    return _newCount.load(std::memory_order_relaxed) + zts_stats_sum(ZTS_STAT_MEM_ALLOC);
+}
+
+//----------------------------------------------------------------------------//
+// Stubbed core                                                               //
+//----------------------------------------------------------------------------//
+
+static std::atomic<uint64_t> _coreFrames(0);
+
+static void stub_frame_handler(
+    void* arg,
+    void* tptr,
+    uint64_t net_id,
+    const MAC& from,
+    const MAC& to,
+    unsigned int etherType,
+    unsigned int vlanId,
+    const void* data,
+    unsigned int len)
+{
+    ZTS_UNUSED_ARG(arg);
+    ZTS_UNUSED_ARG(tptr);
+    ZTS_UNUSED_ARG(net_id);
+    ZTS_UNUSED_ARG(from);
+    ZTS_UNUSED_ARG(to);
+    ZTS_UNUSED_ARG(etherType);
+    ZTS_UNUSED_ARG(vlanId);
+    ZTS_UNUSED_ARG(data);
+    ZTS_UNUSED_ARG(len);
+    _coreFrames.fetch_add(1, std::memory_order_relaxed);
+}
+
+//----------------------------------------------------------------------------//
+// Frames                                                                     //
+//----------------------------------------------------------------------------//
+
+static uint16_t ip_checksum(const uint8_t* b, unsigned int len)
+{
+    uint32_t sum = 0;
+    for (unsigned int i = 0; i + 1 < len; i += 2) {
+        sum += (uint32_t)((b[i] << 8) | b[i + 1]);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+// Writes an IPv4/UDP packet of len bytes (Ethernet payload), UDP checksum unset
+static void build_udp(uint8_t* b, unsigned int len, const uint8_t* src, const uint8_t* dst, uint16_t port)
+{
+    memset(b, 0, len);
+    b[0] = 0x45;
+    b[2] = (uint8_t)(len >> 8);
+    b[3] = (uint8_t)len;
+    b[6] = 0x40;   // DF
+    b[8] = 64;
+    b[9] = 17;
+    memcpy(b + 12, src, 4);
+    memcpy(b + 16, dst, 4);
+    uint16_t csum = ip_checksum(b, 20);
+    b[10] = (uint8_t)(csum >> 8);
+    b[11] = (uint8_t)csum;
+    b[20] = (uint8_t)(port >> 8);
+    b[21] = (uint8_t)port;
+    b[22] = (uint8_t)(port >> 8);
+    b[23] = (uint8_t)port;
+    b[24] = (uint8_t)((len - 20) >> 8);
+    b[25] = (uint8_t)(len - 20);
+}
+
+// Writes an ARP request from the peer for the tap's address, returns its length
+static unsigned int build_arp(uint8_t* b)
+{
+    static const uint8_t hdr[8] = { 0, 1, 8, 0, 6, 4, 0, 1 };
+    memset(b, 0, 28);
+    memcpy(b, hdr, sizeof(hdr));
+    MAC(BENCH_PEER_MAC).copyTo(b + 8, 6);
+    memcpy(b + 14, _peerIp, 4);
+    memcpy(b + 24, _tapIp, 4);
+    return 28;
+}
+
+//----------------------------------------------------------------------------//
+// Cases                                                                      //
+//----------------------------------------------------------------------------//
+
+enum frame_kind {
+    RX_UDP,       // UDP to a bound socket, read by the application
+    RX_FOREIGN,   // IPv4 for another host, dropped by the stack
+    RX_ARP,       // ARP request for the tap, answered through zts_lwip_eth_tx
+    TX_PBUF,      // zts_lwip_eth_tx with a single pbuf
+    TX_CHAIN,     // zts_lwip_eth_tx with a chain of two pbufs
+    TX_SENDTO     // UDP sendto() through the stack
+};
+
+struct frame_case {
+    const char* name;
+    frame_kind kind;
+    unsigned int len;   // Ethernet payload length
+};
+
+static const frame_case _cases[] = {
+    { "rx/udp/64", RX_UDP, 64 },
+    { "rx/udp/512", RX_UDP, 512 },
+    { "rx/udp/1400", RX_UDP, 1400 },
+    { "rx/udp/2800", RX_UDP, 2800 },
+    { "rx/foreign/1400", RX_FOREIGN, 1400 },
+    { "rx/arp", RX_ARP, 28 },
+    { "tx/pbuf/64", TX_PBUF, 64 },
+    { "tx/pbuf/1400", TX_PBUF, 1400 },
+    { "tx/pbuf/2800", TX_PBUF, 2800 },
+    { "tx/chain/1400", TX_CHAIN, 1400 },
+    { "tx/chain/2800", TX_CHAIN, 2800 },
+    { "tx/sendto/64", TX_SENDTO, 64 },
+    { "tx/sendto/1400", TX_SENDTO, 1400 },
+    { "tx/sendto/2800", TX_SENDTO, 2800 },
+};
+
+static VirtualTap* _tap = NULL;
+static int _udpFd = -1;
+static uint8_t _frame[BENCH_MTU];
+static unsigned int _frameLen = 0;
+static struct pbuf* _txPbuf = NULL;
+static struct sockaddr_in _peerAddr;
+// Frames that did not arrive where they should have
+static uint64_t _missing = 0;
+
+static void expect(unsigned int n, uint64_t delivered)
+{
+    if (delivered < n) {
+        _missing += n - delivered;
+    }
+}
+
+static void prepare(const frame_case& c)
+{
+    if (c.kind == RX_UDP) {
+        build_udp(_frame, c.len, _peerIp, _tapIp, BENCH_UDP_PORT);
+        _frameLen = c.len;
+    }
+    if (c.kind == RX_FOREIGN) {
+        build_udp(_frame, c.len, _peerIp, _foreignIp, BENCH_UDP_PORT);
+        _frameLen = c.len;
+    }
+    if (c.kind == RX_ARP) {
+        _frameLen = build_arp(_frame);
+    }
+    if (c.kind == TX_PBUF || c.kind == TX_CHAIN) {
+        uint8_t buf[sizeof(struct eth_hdr) + BENCH_MTU];
+        struct eth_hdr* eth = (struct eth_hdr*)buf;
+        MAC(BENCH_PEER_MAC).copyTo(eth->dest.addr, 6);
+        MAC(BENCH_TAP_MAC).copyTo(eth->src.addr, 6);
+        eth->type = PP_HTONS(ETHTYPE_IP);
+        build_udp(buf + sizeof(struct eth_hdr), c.len, _tapIp, _peerIp, BENCH_UDP_PORT);
+        uint16_t len = (uint16_t)(sizeof(struct eth_hdr) + c.len);
+        if (c.kind == TX_PBUF) {
+            _txPbuf = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+        }
+        else {
+            _txPbuf = pbuf_alloc(PBUF_RAW, len / 2, PBUF_RAM);
+            pbuf_cat(_txPbuf, pbuf_alloc(PBUF_RAW, len - len / 2, PBUF_RAM));
+        }
+        pbuf_take(_txPbuf, buf, len);
+    }
+    if (c.kind == TX_SENDTO) {
+        // UDP payload of a packet of c.len bytes
+        _frameLen = c.len - 28;
+        memset(_frame, 0, _frameLen);
+    }
+}
+
+static void release(const frame_case& c)
+{
+    if (c.kind == TX_PBUF || c.kind == TX_CHAIN) {
+        pbuf_free(_txPbuf);
+        _txPbuf = NULL;
+    }
+}
+
+static void run_batch(const frame_case& c, unsigned int n)
+{
+    const MAC peer(BENCH_PEER_MAC);
+    const MAC tap(BENCH_TAP_MAC);
+    const MAC bcast(0xffffffffffffULL);
+    uint64_t sent = _coreFrames.load(std::memory_order_relaxed);
+    switch (c.kind) {
+        case RX_UDP:
+        case RX_FOREIGN:
+            for (unsigned int i = 0; i < n; i++) {
+                _tap->put(peer, tap, ETHTYPE_IP, _frame, _frameLen);
+            }
+            _tap->flush();
+            if (c.kind == RX_UDP) {
+                uint8_t buf[BENCH_MTU];
+                unsigned int received = 0;
+                while (lwip_recv(_udpFd, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+                    received++;
+                }
+                expect(n, received);
+            }
+            break;
+        case RX_ARP:
+            for (unsigned int i = 0; i < n; i++) {
+                _tap->put(peer, bcast, ETHTYPE_ARP, _frame, _frameLen);
+            }
+            _tap->flush();
+            expect(n, _coreFrames.load(std::memory_order_relaxed) - sent);
+            break;
+        case TX_PBUF:
+        case TX_CHAIN:
+            for (unsigned int i = 0; i < n; i++) {
+                zts_lwip_eth_tx((struct netif*)_tap->netif4, _txPbuf);
+            }
+            expect(n, _coreFrames.load(std::memory_order_relaxed) - sent);
+            break;
+        case TX_SENDTO:
+            for (unsigned int i = 0; i < n; i++) {
+                lwip_sendto(_udpFd, _frame, _frameLen, 0, (struct sockaddr*)&_peerAddr, sizeof(_peerAddr));
+            }
+            expect(n, _coreFrames.load(std::memory_order_relaxed) - sent);
+            break;
+    }
+}
+
+static void run_case(const frame_case& c, double minSeconds)
+{
+    prepare(c);
+    // Fill the receive buffer pool and the stack's caches before measuring
+    run_batch(c, BENCH_BATCH);
+    _missing = 0;
+    const uint64_t allocs0 = allocs();
+    const uint64_t copies0 = zts_stats_sum(ZTS_STAT_LINK_COPY);
+    const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    uint64_t frames = 0;
+    double elapsed = 0;
+    do {
+        run_batch(c, BENCH_BATCH);
+        frames += BENCH_BATCH;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    } while (elapsed < minSeconds);
+    const uint64_t nAllocs = allocs() - allocs0;
+    const uint64_t nCopies = zts_stats_sum(ZTS_STAT_LINK_COPY) - copies0;
+    release(c);
+    printf(
+        "%-20s %12llu %12.1f %14.2f %14.2f",
+        c.name,
+        (unsigned long long)frames,
+        elapsed * 1e9 / frames,
+        (double)nAllocs / frames,
+        (double)nCopies / frames);
+    if (_missing) {
+        printf("   %llu frames missing", (unsigned long long)_missing);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* filter = (argc > 1) ? argv[1] : "";
+    double minSeconds = (argc > 2) ? atof(argv[2]) : BENCH_MIN_SECONDS;
+    if (minSeconds <= 0) {
+        minSeconds = BENCH_MIN_SECONDS;
+    }
+
+    zts_events = new Events();
+    zts_lwip_driver_init();
+    _tap = new VirtualTap(".", MAC(BENCH_TAP_MAC), BENCH_MTU, 0, BENCH_NET_ID, stub_frame_handler, NULL);
+    if (! _tap->addIp(InetAddress(BENCH_TAP_IP)) || ! _tap->netif4) {
+        fprintf(stderr, "bench-frame: unable to set up the tap\n");
+        return 1;
+    }
+
+    _udpFd = lwip_socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = lwip_htons(BENCH_UDP_PORT);
+    if (_udpFd < 0 || lwip_bind(_udpFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "bench-frame: unable to bind UDP socket\n");
+        return 1;
+    }
+    memset(&_peerAddr, 0, sizeof(_peerAddr));
+    _peerAddr.sin_family = AF_INET;
+    _peerAddr.sin_port = lwip_htons(BENCH_UDP_PORT);
+    memcpy(&_peerAddr.sin_addr, _peerIp, 4);
+
+    // Let the stack learn the peer's hardware address so that sendto() does
+    // not queue behind an ARP request
+    _frameLen = build_arp(_frame);
+    _tap->put(MAC(BENCH_PEER_MAC), MAC(0xffffffffffffULL), ETHTYPE_ARP, _frame, _frameLen);
+    _tap->flush();
+
+    printf("%-20s %12s %12s %14s %14s\n", "Benchmark", "Frames", "ns/frame", "allocs/frame", "copies/frame");
+    for (size_t i = 0; i < sizeof(_cases) / sizeof(_cases[0]); i++) {
+        if (strstr(_cases[i].name, filter)) {
+            run_case(_cases[i], minSeconds);
+        }
+    }
+    // lwIP can not be shut down and restarted, leave the tap and stack up
+    return 0;
+}